@@ -0,0 +1,395 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <vector>
+#include <algorithm>
+
+#define HEADSOCKET_IMPLEMENTATION
+#include <headsocket/headsocket.h>
+
+#include "../Utils.h"
+
+using namespace headsocket;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Frame codec is protected in web_socket_client, this never gets instantiated
+struct frame_codec : web_socket_client
+{
+  using web_socket_client::frame_header;
+};
+
+// Runs kernels, prints their cost and compares it with a baseline loaded from file
+class suite
+{
+public:
+  std::string filter;
+  double sample_seconds = 0.02;
+  double threshold = 5.0;
+  int regressions = 0;
+
+  bool load(const std::string &fileName)
+  {
+    std::ifstream file(fileName);
+    std::string line;
+
+    if (!file)
+      return false;
+
+    while (std::getline(file, line))
+    {
+      std::istringstream fields(line);
+      std::string key;
+      double ns;
+
+      if (line.empty() || line[0] == '#' || !(fields >> key >> ns))
+        continue;
+
+      _baseline[key] = ns;
+    }
+
+    return true;
+  }
+
+  bool save(const std::string &fileName) const
+  {
+    std::ofstream file(fileName);
+
+    if (!file)
+      return false;
+
+    file << "# kernel/size ns_per_op\n";
+
+    for (auto &result : _results)
+      file << result.first << " " << result.second << "\n";
+
+    return true;
+  }
+
+  // One call of 'op' is one operation over 'bytes' bytes (0 when throughput makes no sense)
+  template <typename F>
+  void run(const char *name, size_t size, size_t bytes, F &&op)
+  {
+    std::string key = std::string(name) + "/" + std::to_string(size);
+
+    if (!filter.empty() && key.find(filter) == std::string::npos)
+      return;
+
+    // Warmup doubles iterations until one batch takes a quarter of a sample, then scales them to a full sample
+    size_t iterations = 1;
+    uint64_t elapsed = 0;
+
+    while (true)
+    {
+      uint64_t start = bench::now_ns();
+
+      for (size_t i = 0; i < iterations; ++i)
+        op();
+
+      elapsed = bench::now_ns() - start;
+
+      if (elapsed >= sample_seconds * 0.25e9)
+        break;
+
+      iterations *= 2;
+    }
+
+    iterations = std::max<size_t>(1, static_cast<size_t>(iterations * sample_seconds * 1e9 / (elapsed ? elapsed : 1)));
+
+    // Median of several samples rides out the occasional interrupt or migration
+    std::vector<std::pair<double, double>> samples;
+
+    for (int sample = 0; sample < 7; ++sample)
+    {
+      uint64_t startCycles = bench::cycles(), start = bench::now_ns();
+
+      for (size_t i = 0; i < iterations; ++i)
+        op();
+
+      uint64_t ns = bench::now_ns() - start, cyc = bench::cycles() - startCycles;
+      samples.emplace_back(static_cast<double>(ns) / iterations, static_cast<double>(cyc) / iterations);
+    }
+
+    std::sort(samples.begin(), samples.end());
+    double ns = samples[samples.size() / 2].first, cyc = samples[samples.size() / 2].second;
+    _results.emplace_back(key, ns);
+
+    printf("%-34s %12.1f ns %12.0f cyc", key.c_str(), ns, cyc);
+    printf(bytes ? " %10.1f MB/s" : "                ", bytes / ns * 1e3);
+
+    auto baseline = _baseline.find(key);
+
+    if (baseline != _baseline.end())
+    {
+      double change = (ns / baseline->second - 1.0) * 100.0;
+      bool regressed = change > threshold;
+      regressions += regressed ? 1 : 0;
+      printf(" %+8.1f %%%s", change, regressed ? "  SLOWER" : (change < -threshold ? "  faster" : ""));
+    }
+
+    printf("\n");
+  }
+
+private:
+  std::map<std::string, double> _baseline;
+  std::vector<std::pair<std::string, double>> _results;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static std::vector<uint8_t> random_bytes(size_t size)
+{
+  std::vector<uint8_t> result(size);
+  uint32_t state = 2463534242u;
+
+  for (auto &byte : result)
+  {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    byte = static_cast<uint8_t>(state);
+  }
+
+  return result;
+}
+
+static void frame_kernels(suite &s)
+{
+  // Length fields of 7, 16 and 64 bits
+  for (size_t size : { 64, 1000, 70000 })
+  {
+    frame_codec::frame_header header;
+    header.fin = true;
+    header.op = opcode::binary;
+    header.masked = true;
+    header.payload_length = size;
+    header.masking_key = 0x12345678;
+
+    // Read kernel gets its input here, not from the write kernel, which --filter may skip
+    uint8_t buffer[16];
+    header.write(buffer, sizeof(buffer));
+
+    s.run("frame_header::write", size, 0, [&]()
+    {
+      bench::keep(header.write(buffer, sizeof(buffer)));
+      bench::keep(header);
+    });
+
+    s.run("frame_header::read", size, 0, [&]()
+    {
+      frame_codec::frame_header decoded;
+      bench::keep(decoded.read(buffer, sizeof(buffer)));
+      bench::keep(decoded);
+    });
+  }
+}
+
+static void xor32_kernels(suite &s)
+{
+  for (size_t size : { 16, 125, 1024, 16384, 1048576 })
+  {
+    auto data = random_bytes(size);
+
+    s.run("utils::xor32", size, size, [&]()
+    {
+      detail::utils::xor32(0x12345678, data.data(), data.size());
+      bench::keep(data[0]);
+    });
+
+    // Masking of outgoing frames, fused with the copy into the send buffer
+    std::vector<uint8_t> output(size);
+
+    s.run("utils::xor32_copy", size, size, [&]()
+    {
+      detail::utils::xor32_copy(0x12345678, data.data(), output.data(), data.size());
+      bench::keep(output[0]);
+    });
+  }
+}
+
+static void sha1_kernels(suite &s)
+{
+  // 60 bytes is the handshake: client key and GUID
+  for (size_t size : { 60, 1024, 65536 })
+  {
+    auto data = random_bytes(size);
+
+    s.run("sha1", size, size, [&]()
+    {
+      detail::sha1 sha;
+      sha.process_bytes(data.data(), data.size());
+      detail::sha1::digest8_t digest;
+      bench::keep(sha.get_digest_bytes(digest));
+      bench::keep(digest);
+    });
+  }
+}
+
+static void base64_kernels(suite &s)
+{
+  // 20 bytes is the handshake digest
+  for (size_t size : { 20, 1024, 65536 })
+  {
+    auto data = random_bytes(size);
+    std::vector<char> encoded(detail::utils::base64_encoded_length(size));
+    std::vector<uint8_t> decoded(size);
+
+    // Decode kernel gets its input here, not from the encode kernel, which --filter may skip
+    detail::utils::base64_encode(data.data(), data.size(), encoded.data());
+
+    s.run("utils::base64_encode", size, size, [&]()
+    {
+      bench::keep(detail::utils::base64_encode(data.data(), data.size(), encoded.data()));
+      bench::keep(encoded[0]);
+    });
+
+    s.run("utils::base64_decode", encoded.size(), encoded.size(), [&]()
+    {
+      bench::keep(detail::utils::base64_decode(encoded.data(), encoded.size(), decoded.data()));
+      bench::keep(decoded[0]);
+    });
+  }
+}
+
+static void url_kernels(suite &s)
+{
+  for (size_t size : { 64, 1024 })
+  {
+    // Plain query text and one where every eighth character is escaped
+    std::string plain, escaped;
+
+    while (plain.length() < size)
+      plain += "name=value&";
+
+    while (escaped.length() < size)
+      escaped += "J%C3%B6rg+x";
+
+    plain.resize(size);
+    escaped.resize(size);
+    std::vector<char> output(size);
+
+    s.run("utils::url_decode.plain", size, size, [&]()
+    {
+      bench::keep(detail::utils::url_decode(plain.c_str(), plain.length(), output.data()));
+      bench::keep(output[0]);
+    });
+
+    s.run("utils::url_decode.escaped", size, size, [&]()
+    {
+      bench::keep(detail::utils::url_decode(escaped.c_str(), escaped.length(), output.data()));
+      bench::keep(output[0]);
+    });
+  }
+}
+
+static void queue_kernels(suite &s)
+{
+  // One 64 byte message in and one out per operation, with 'depth' messages waiting in the queue
+  for (size_t depth : { 1, 64, 4096 })
+  {
+    auto message = random_bytes(64);
+    uint8_t output[64];
+    detail::data_block_buffer queue;
+
+    for (size_t i = 1; i < depth; ++i)
+    {
+      queue.block_begin(opcode::binary);
+      queue.write(message.data(), message.size());
+      queue.block_end();
+    }
+
+    s.run("data_block_buffer.push_pop", depth, message.size(), [&]()
+    {
+      queue.block_begin(opcode::binary);
+      queue.write(message.data(), message.size());
+      queue.block_end();
+      bench::keep(queue.read(output, sizeof(output)));
+      bench::keep(output[0]);
+    });
+  }
+}
+
+static void http_kernels(suite &s)
+{
+  // Parsing decodes URL escapes in place, so every operation starts from a fresh copy
+  const std::string request =
+    "GET /api/items?id=42&name=J%C3%B6rg&sort=desc&flag HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "Connection: keep-alive\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "Cookie: session=0123456789abcdef; theme=dark\r\n"
+    "\r\n";
+
+  std::vector<char> buffer(request.length());
+
+  s.run("http_parser::parse", request.length(), request.length(), [&]()
+  {
+    memcpy(buffer.data(), request.data(), request.length());
+    detail::http_request req;
+    bench::keep(detail::http_parser::parse(buffer.data(), buffer.size(), req));
+    bench::keep(req);
+  });
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void print_usage()
+{
+  std::cout <<
+    "Usage: Kernels [options]\n"
+    "  --filter TEXT           run kernels whose name/size contains TEXT\n"
+    "  --time MS               milliseconds per sample, median of 7 samples is reported (20)\n"
+    "  --baseline FILE         compare with results saved earlier, exit code 1 when anything got slower\n"
+    "  --threshold PERCENT     change still considered noise (5)\n"
+    "  --save FILE             save results as a new baseline\n";
+}
+
+int main(int argc, char *argv[])
+{
+  bench::options opts(argc, argv);
+
+  if (opts.has("help"))
+  {
+    print_usage();
+    return 0;
+  }
+
+  suite s;
+  s.filter = opts.get("filter", "");
+  s.sample_seconds = std::max<int64_t>(1, opts.get("time", 20)) / 1e3;
+  s.threshold = static_cast<double>(opts.get("threshold", 5));
+
+  std::string baseline = opts.get("baseline", "");
+
+  if (!baseline.empty() && !s.load(baseline))
+  {
+    std::cout << "Could not read baseline " << baseline << "!" << std::endl;
+    return 1;
+  }
+
+  frame_kernels(s);
+  xor32_kernels(s);
+  sha1_kernels(s);
+  base64_kernels(s);
+  url_kernels(s);
+  queue_kernels(s);
+  http_kernels(s);
+
+  std::string save = opts.get("save", "");
+
+  if (!save.empty() && !s.save(save))
+  {
+    std::cout << "Could not write " << save << "!" << std::endl;
+    return 1;
+  }
+
+  if (!baseline.empty())
+    std::cout << s.regressions << " kernel(s) slower than baseline" << std::endl;
+
+  return s.regressions ? 1 : 0;
+}
@@ -0,0 +1,222 @@
+#include <iostream>
+#include <thread>
+#include <deque>
+#include <memory>
+#include <algorithm>
+
+#define HEADSOCKET_IMPLEMENTATION
+#include <headsocket/headsocket.h>
+
+#include "../Utils.h"
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Nothing but accept, handshake, registry and disconnect is measured, so clients do not do anything
+class storm_client : public headsocket::web_socket_client
+{
+  HEADSOCKET_CLIENT(storm_client, headsocket::web_socket_client);
+};
+
+typedef headsocket::web_socket_server<storm_client> storm_server;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct storm_settings
+{
+  std::string host = "127.0.0.1";
+  int port = 9002;
+  bool upgrade = true;
+  size_t workers = 16;
+  double rate = 0.0;
+  int timeout = 3000;
+  uint64_t hold = 0;
+};
+
+// Filled by one worker thread, merged when all are done
+struct worker_stats
+{
+  uint64_t attempts = 0;
+  uint64_t connected = 0;
+  uint64_t upgraded = 0;
+  uint64_t refused = 0;
+  uint64_t timeouts = 0;
+  uint64_t failed = 0;
+  headsocket::latency_histogram connect;
+  headsocket::latency_histogram handshake;
+
+  void add_failure(int error)
+  {
+    if (error == ECONNREFUSED)
+      ++refused;
+    else if (error == EAGAIN || error == EWOULDBLOCK || error == EINPROGRESS || error == ETIMEDOUT)
+      ++timeouts;
+    else
+      ++failed;
+  }
+
+  void merge(const worker_stats &other)
+  {
+    attempts += other.attempts;
+    connected += other.connected;
+    upgraded += other.upgraded;
+    refused += other.refused;
+    timeouts += other.timeouts;
+    failed += other.failed;
+    bench::merge(connect, other.connect);
+    bench::merge(handshake, other.handshake);
+  }
+};
+
+// Attempts are scheduled at a fixed pace (open loop, workers interleaved), late ones start right away
+static void run_worker(const storm_settings &settings, worker_stats &stats, size_t index, uint64_t start, uint64_t end)
+{
+  typedef std::pair<uint64_t, std::unique_ptr<bench::ws_connection>> held_connection;
+  std::deque<held_connection> held;
+
+  double interval = settings.rate > 0.0 ? settings.workers * 1e9 / settings.rate : 0.0;
+  uint64_t now = bench::now_ns();
+
+  for (uint64_t attempt = 0; now < end; ++attempt)
+  {
+    uint64_t due = start + static_cast<uint64_t>(interval * (attempt + static_cast<double>(index) / settings.workers));
+
+    if (due >= end)
+      break;
+
+    while ((now = bench::now_ns()) < due)
+      std::this_thread::sleep_for(std::chrono::nanoseconds(std::min<uint64_t>(due - now, 1000000)));
+
+    while (!held.empty() && held.front().first <= now)
+      held.pop_front();
+
+    auto conn = std::make_unique<bench::ws_connection>();
+    ++stats.attempts;
+
+    if (!conn->open(settings.host, settings.port, settings.timeout))
+    {
+      stats.add_failure(conn->error());
+      continue;
+    }
+
+    uint64_t connected = bench::now_ns();
+    bench::record(stats.connect, connected - now);
+    ++stats.connected;
+
+    if (settings.upgrade)
+    {
+      if (!conn->upgrade(settings.host))
+      {
+        stats.add_failure(conn->error());
+        continue;
+      }
+
+      bench::record(stats.handshake, bench::now_ns() - now);
+      ++stats.upgraded;
+    }
+
+    if (settings.hold)
+      held.emplace_back(bench::now_ns() + settings.hold, std::move(conn));
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void print_usage()
+{
+  std::cout <<
+    "Usage: Storm [options]\n"
+    "  --mode websocket|tcp    full upgrades, or just TCP connections closed right away (websocket)\n"
+    "  --rate N                connection attempts per second, 0 for as many as workers manage (0)\n"
+    "  --workers N             connecting threads (16)\n"
+    "  --seconds N             duration (5)\n"
+    "  --hold MS               keep connections open for a while before closing them (0)\n"
+    "  --timeout MS            limit of connect and upgrade (3000)\n"
+    "  --port N                server port (9002)\n"
+    "  --connect HOST          storm a server running elsewhere, server side numbers are not reported then\n";
+}
+
+int main(int argc, char *argv[])
+{
+  bench::options opts(argc, argv);
+
+  if (opts.has("help"))
+  {
+    print_usage();
+    return 0;
+  }
+
+  storm_settings settings;
+  settings.upgrade = opts.get("mode", "websocket") != "tcp";
+  settings.rate = static_cast<double>(std::max<int64_t>(0, opts.get("rate", 0)));
+  settings.workers = static_cast<size_t>(std::max<int64_t>(1, opts.get("workers", 16)));
+  settings.timeout = static_cast<int>(opts.get("timeout", 3000));
+  settings.hold = static_cast<uint64_t>(std::max<int64_t>(0, opts.get("hold", 0))) * 1000000;
+  settings.port = static_cast<int>(opts.get("port", 9002));
+  int64_t seconds = std::max<int64_t>(1, opts.get("seconds", 5));
+
+  headsocket::ptr<storm_server> host;
+
+  if (opts.has("connect"))
+    settings.host = opts.get("connect", "127.0.0.1");
+  else
+  {
+    host = storm_server::create(settings.port);
+
+    if (!host->is_running())
+    {
+      std::cout << "Could not start server on port " << settings.port << "!" << std::endl;
+      return 1;
+    }
+  }
+
+  std::vector<worker_stats> stats(settings.workers);
+  std::vector<std::thread> workers;
+
+  auto before = headsocket::metrics::snapshot();
+  double cpuStart = bench::cpu_seconds();
+  uint64_t start = bench::now_ns(), end = start + static_cast<uint64_t>(seconds) * 1000000000;
+
+  for (size_t i = 0; i < settings.workers; ++i)
+    workers.emplace_back(run_worker, std::cref(settings), std::ref(stats[i]), i, start, end);
+
+  for (auto &worker : workers)
+    worker.join();
+
+  double elapsed = (bench::now_ns() - start) / 1e9, cpu = bench::cpu_seconds() - cpuStart;
+  auto after = headsocket::metrics::snapshot();
+
+  worker_stats total;
+
+  for (auto &s : stats)
+    total.merge(s);
+
+  auto perSecond = [elapsed](uint64_t value) { return value / elapsed; };
+
+  printf("%s storm, %s, %zu workers, %.1f s, hold %llu ms\n", settings.upgrade ? "websocket" : "tcp",
+    settings.rate > 0.0 ? ("target " + std::to_string(static_cast<int64_t>(settings.rate)) + "/s").c_str() : "unpaced",
+    settings.workers, elapsed, static_cast<unsigned long long>(settings.hold / 1000000));
+  printf("  %-22s %10llu  %10.0f /s\n", "attempted", static_cast<unsigned long long>(total.attempts), perSecond(total.attempts));
+  printf("  %-22s %10llu  %10.0f /s\n", "connected", static_cast<unsigned long long>(total.connected), perSecond(total.connected));
+
+  if (settings.upgrade)
+    printf("  %-22s %10llu  %10.0f /s\n", "upgraded", static_cast<unsigned long long>(total.upgraded), perSecond(total.upgraded));
+
+  printf("  %-22s %10llu\n", "refused", static_cast<unsigned long long>(total.refused));
+  printf("  %-22s %10llu\n", "timed out", static_cast<unsigned long long>(total.timeouts));
+  printf("  %-22s %10llu\n", "failed", static_cast<unsigned long long>(total.failed));
+  bench::print_latency("connect", total.connect);
+
+  if (settings.upgrade)
+    bench::print_latency("connect and upgrade", total.handshake);
+
+  if (host)
+  {
+    printf("  %-22s %10llu  %10.0f /s\n", "server accepted", static_cast<unsigned long long>(after.accepts - before.accepts),
+      perSecond(after.accepts - before.accepts));
+    printf("  %-22s %10llu\n", "server rejected", static_cast<unsigned long long>(after.handshakes_failed - before.handshakes_failed));
+    printf("  %-22s %10lld\n", "server clients left", static_cast<long long>(after.clients));
+    printf("  %-22s %10.1f us CPU/connection (server and load)\n", "cost", total.attempts ? cpu * 1e6 / total.attempts : 0.0);
+  }
+
+  return 0;
+}
@@ -0,0 +1,13 @@
+project("Storm")
+
+generateProject(
+{
+  type = "console",
+	language = "C++",
+})
+
+files { "../Utils.h" }
+
+filter { "system:linux" }
+  links { "pthread" }
+filter { }
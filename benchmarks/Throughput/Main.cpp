@@ -0,0 +1,257 @@
+#include <iostream>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+
+#define HEADSOCKET_IMPLEMENTATION
+#include <headsocket/headsocket.h>
+
+#include "../Utils.h"
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Echo: every load client keeps a window of messages in flight and sends a new one whenever one comes back.
+// Broadcast: the first load client publishes (paced the same way by its own copies), server pushes each message to all.
+static bool broadcast_mode = false;
+
+class bench_client : public headsocket::web_socket_client
+{
+  HEADSOCKET_CLIENT(bench_client, headsocket::web_socket_client);
+
+public:
+  bool async_received_data(const headsocket::data_block &db, uint8_t *ptr, size_t length) override;
+};
+
+class bench_server : public headsocket::web_socket_server<bench_client>
+{
+  HEADSOCKET_SERVER(bench_server, headsocket::web_socket_server<bench_client>) { }
+
+public:
+  void broadcast(const uint8_t *ptr, size_t length)
+  {
+    for (auto client : clients())
+      if (client)
+        client->push(ptr, length);
+  }
+};
+
+bool bench_client::async_received_data(const headsocket::data_block &db, uint8_t *ptr, size_t length)
+{
+  if (!broadcast_mode)
+    push(ptr, length);
+  else if (auto host = std::static_pointer_cast<bench_server>(server()))
+    host->broadcast(ptr, length);
+
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Load client with its own thread, counters are written by that thread only
+struct load_client
+{
+  bench::ws_connection conn;
+  std::thread thread;
+  std::atomic<uint64_t> messages = { 0 };
+  std::atomic<uint64_t> bytes = { 0 };
+  headsocket::latency_histogram latency;
+};
+
+struct load_settings
+{
+  size_t size = 64;
+  size_t window = 8;
+  std::atomic_bool measuring = { false };
+  std::atomic_bool stopping = { false };
+};
+
+static void run_load_client(load_client &client, load_settings &settings, bool sends)
+{
+  std::vector<uint8_t> message(settings.size, 'x'), received;
+
+  // Send time travels in the first 8 bytes, both ends share the same monotonic clock
+  auto send = [&]()
+  {
+    uint64_t now = bench::now_ns();
+    memcpy(message.data(), &now, sizeof(now));
+    return client.conn.send(0x02, message.data(), message.size());
+  };
+
+  for (size_t i = 0; sends && i < settings.window; ++i)
+    if (!send())
+      return;
+
+  while (client.conn.receive(received))
+  {
+    if (received.size() >= 8 && settings.measuring.load(std::memory_order_relaxed))
+    {
+      uint64_t sent;
+      memcpy(&sent, received.data(), sizeof(sent));
+      bench::record(client.latency, bench::now_ns() - sent);
+      client.messages.store(client.messages.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      client.bytes.store(client.bytes.load(std::memory_order_relaxed) + received.size(), std::memory_order_relaxed);
+    }
+
+    if (sends && !settings.stopping && !send())
+      break;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void print_usage()
+{
+  std::cout <<
+    "Usage: Throughput [options]\n"
+    "  --mode echo|broadcast   message pattern (echo)\n"
+    "  --clients N             load connections (16)\n"
+    "  --size BYTES            message size, at least 8 (64)\n"
+    "  --window N              messages in flight per sending connection (8)\n"
+    "  --seconds N             measured time (5)\n"
+    "  --warmup N              seconds before measuring (1)\n"
+    "  --port N                server port (9001)\n"
+    "  --server-only           run just the server and print its rates every second until ENTER\n"
+    "  --connect HOST          run just the load against a server started elsewhere with --server-only\n";
+}
+
+static int run_server_only(headsocket::ptr<bench_server> host)
+{
+  std::cout << "Server is running on port " << host->port() << ", press ENTER to quit" << std::endl;
+
+  std::atomic_bool quit = { false };
+  std::thread reporter([&quit]()
+  {
+    auto last = headsocket::metrics::snapshot();
+    double lastCpu = bench::cpu_seconds();
+
+    while (!quit)
+    {
+      std::this_thread::sleep_for(std::chrono::seconds(1));
+
+      auto current = headsocket::metrics::snapshot();
+      double cpu = bench::cpu_seconds();
+      uint64_t in = current.frames_in[static_cast<size_t>(headsocket::opcode::binary)] - last.frames_in[static_cast<size_t>(headsocket::opcode::binary)];
+      uint64_t out = current.frames_out[static_cast<size_t>(headsocket::opcode::binary)] - last.frames_out[static_cast<size_t>(headsocket::opcode::binary)];
+
+      printf("%8llu msgs/s in  %8llu msgs/s out  %7.1f MB/s out  %5.0f %% CPU  %6.2f us CPU/msg\n",
+        static_cast<unsigned long long>(in), static_cast<unsigned long long>(out), (current.bytes_out - last.bytes_out) / 1e6,
+        (cpu - lastCpu) * 100.0, in + out ? (cpu - lastCpu) * 1e6 / (in + out) : 0.0);
+
+      last = current;
+      lastCpu = cpu;
+    }
+  });
+
+  std::getchar();
+  quit = true;
+  reporter.join();
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  bench::options opts(argc, argv);
+
+  if (opts.has("help"))
+  {
+    print_usage();
+    return 0;
+  }
+
+  broadcast_mode = opts.get("mode", "echo") == "broadcast";
+  int port = static_cast<int>(opts.get("port", 9001));
+  size_t clientCount = static_cast<size_t>(std::max<int64_t>(1, opts.get("clients", 16)));
+  int64_t seconds = opts.get("seconds", 5), warmup = opts.get("warmup", 1);
+
+  load_settings settings;
+  settings.size = static_cast<size_t>(std::max<int64_t>(8, opts.get("size", 64)));
+  settings.window = static_cast<size_t>(std::max<int64_t>(1, opts.get("window", 8)));
+
+  std::string address = opts.get("connect", "");
+  headsocket::ptr<bench_server> host;
+
+  if (address.empty())
+  {
+    host = bench_server::create(port);
+
+    if (!host->is_running())
+    {
+      std::cout << "Could not start server on port " << port << "!" << std::endl;
+      return 1;
+    }
+
+    if (opts.has("server-only"))
+      return run_server_only(host);
+
+    address = "127.0.0.1";
+  }
+
+  std::vector<std::unique_ptr<load_client>> load;
+
+  for (size_t i = 0; i < clientCount; ++i)
+  {
+    load.push_back(std::make_unique<load_client>());
+
+    if (!load.back()->conn.connect(address, port))
+    {
+      std::cout << "Could not connect load client " << i << "!" << std::endl;
+      return 1;
+    }
+  }
+
+  for (size_t i = 0; i < clientCount; ++i)
+    load[i]->thread = std::thread(run_load_client, std::ref(*load[i]), std::ref(settings), !broadcast_mode || !i);
+
+  std::this_thread::sleep_for(std::chrono::seconds(warmup));
+
+  auto sum = [&load](std::atomic<uint64_t> load_client::*counter)
+  {
+    uint64_t result = 0;
+
+    for (auto &client : load)
+      result += ((*client).*counter).load(std::memory_order_relaxed);
+
+    return result;
+  };
+
+  double cpuStart = bench::cpu_seconds();
+  uint64_t start = bench::now_ns();
+  settings.measuring = true;
+
+  std::this_thread::sleep_for(std::chrono::seconds(seconds));
+
+  settings.measuring = false;
+  double elapsed = (bench::now_ns() - start) / 1e9, cpu = bench::cpu_seconds() - cpuStart;
+  uint64_t messages = sum(&load_client::messages), bytes = sum(&load_client::bytes);
+
+  settings.stopping = true;
+
+  for (auto &client : load)
+    client->conn.shutdown();
+
+  headsocket::latency_histogram latency;
+
+  for (auto &client : load)
+  {
+    client->thread.join();
+    bench::merge(latency, client->latency);
+  }
+
+  printf("%s, %zu clients, %zu B messages, window %zu, %.1f s\n", broadcast_mode ? "broadcast" : "echo",
+    clientCount, settings.size, settings.window, elapsed);
+  printf("  %-22s %12.0f msgs/s\n", "received", messages / elapsed);
+  printf("  %-22s %12.1f MB/s\n", "payload", bytes / elapsed / 1e6);
+  printf("  %-22s %12.2f us CPU/msg (%.0f %% CPU, %s)\n", "cost", messages ? cpu * 1e6 / messages : 0.0, cpu / elapsed * 100.0,
+    host ? "server and load" : "load only");
+  bench::print_latency(broadcast_mode ? "send to receive" : "round trip", latency);
+
+  if (host)
+  {
+    auto serverLatency = host->latency();
+    bench::print_latency("receive to callback", serverLatency.receive_to_callback);
+    bench::print_latency("push to wire", serverLatency.push_to_wire);
+  }
+
+  return 0;
+}
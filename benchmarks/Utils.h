@@ -0,0 +1,402 @@
+#pragma once
+
+// Helpers shared by benchmarks: command line options, clocks, reports and a minimal blocking WebSocket client, which
+// speaks raw frames, so the load generator itself stays cheap and does not depend on the code being measured.
+// Benchmarks run over loopback on POSIX systems (Linux in the first place).
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <utility>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include <headsocket/headsocket.h>
+
+namespace bench {
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// "--key value" pairs and "--flag" switches
+class options
+{
+public:
+  options(int argc, char *argv[])
+  {
+    for (int i = 1; i < argc; ++i)
+    {
+      if (strncmp(argv[i], "--", 2))
+        continue;
+
+      const char *key = argv[i] + 2;
+      bool hasValue = i + 1 < argc && strncmp(argv[i + 1], "--", 2);
+      _values.emplace_back(key, hasValue ? argv[++i] : "");
+    }
+  }
+
+  bool has(const char *key) const { return find(key) != nullptr; }
+
+  std::string get(const char *key, const char *defaultValue) const
+  {
+    const std::string *value = find(key);
+    return value ? *value : defaultValue;
+  }
+
+  int64_t get(const char *key, int64_t defaultValue) const
+  {
+    const std::string *value = find(key);
+    return value && !value->empty() ? strtoll(value->c_str(), nullptr, 10) : defaultValue;
+  }
+
+  // Plain literals (0 in particular would be ambiguous)
+  int64_t get(const char *key, int defaultValue) const { return get(key, static_cast<int64_t>(defaultValue)); }
+
+private:
+  const std::string *find(const char *key) const
+  {
+    for (auto &value : _values)
+      if (value.first == key)
+        return &value.second;
+
+    return nullptr;
+  }
+
+  std::vector<std::pair<std::string, std::string>> _values;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+inline uint64_t now_ns()
+{
+  return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// Time stamp counter (constant rate reference cycles) where available, 0 elsewhere
+inline uint64_t cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#elif defined(__aarch64__)
+  uint64_t value;
+  asm volatile("mrs %0, cntvct_el0" : "=r"(value));
+  return value;
+#else
+  return 0;
+#endif
+}
+
+// Keeps the compiler from optimizing away results (and stores behind them) of measured code
+template <typename T>
+inline void keep(const T &value)
+{
+  asm volatile("" : : "r"(&value) : "memory");
+}
+
+// User and system time of the whole process
+inline double cpu_seconds()
+{
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// Histograms owned by a single thread are filled without atomics and merged once threads are done
+inline void record(headsocket::latency_histogram &histogram, uint64_t value)
+{
+  ++histogram.counts[headsocket::latency_histogram::bucket(value)];
+  ++histogram.count;
+  histogram.sum += value;
+  histogram.max = value > histogram.max ? value : histogram.max;
+}
+
+inline void merge(headsocket::latency_histogram &histogram, const headsocket::latency_histogram &other)
+{
+  for (size_t i = 0; i < headsocket::latency_histogram::bucket_count; ++i)
+    histogram.counts[i] += other.counts[i];
+
+  histogram.count += other.count;
+  histogram.sum += other.sum;
+  histogram.max = other.max > histogram.max ? other.max : histogram.max;
+}
+
+inline void print_latency(const char *name, const headsocket::latency_histogram &histogram)
+{
+  printf("  %-22s p50 %9.1f us  p99 %9.1f us  p999 %9.1f us  max %9.1f us  (%llu samples)\n", name,
+    histogram.p50() / 1e3, histogram.p99() / 1e3, histogram.p999() / 1e3, histogram.max / 1e3,
+    static_cast<unsigned long long>(histogram.count));
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Blocking client side of RFC 6455: sends masked frames, receives whole messages (continuations are joined)
+class ws_connection
+{
+public:
+  ~ws_connection() { close(); }
+
+  // Plain TCP connection only, see upgrade(). Non-zero timeout limits connect and every send or receive after it.
+  bool open(const std::string &host, int port, int timeoutMs = 0)
+  {
+    addrinfo hints = { }, *addresses = nullptr;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses))
+    {
+      _error = EHOSTUNREACH;
+      return false;
+    }
+
+    for (addrinfo *address = addresses; address && _socket < 0; address = address->ai_next)
+    {
+      _socket = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+
+      if (_socket >= 0 && timeoutMs > 0)
+      {
+        // Linux applies send timeout to connect as well
+        timeval timeout = { timeoutMs / 1000, (timeoutMs % 1000) * 1000 };
+        setsockopt(_socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        setsockopt(_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+      }
+
+      if (_socket >= 0 && ::connect(_socket, address->ai_addr, address->ai_addrlen))
+      {
+        _error = errno;
+        close();
+      }
+    }
+
+    freeaddrinfo(addresses);
+
+    if (_socket < 0)
+      return false;
+
+    int noDelay = 1;
+    setsockopt(_socket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    _mask = static_cast<uint32_t>(now_ns() * 2654435761u) | 1;
+    return true;
+  }
+
+  // Upgrade request on an open connection, true once the server answers with 101 Switching Protocols
+  bool upgrade(const std::string &host)
+  {
+    std::string request =
+      "GET / HTTP/1.1\r\nHost: " + host + "\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+      "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n";
+
+    if (!send_all(request.c_str(), request.length()))
+      return false;
+
+    while (true)
+    {
+      const char *begin = reinterpret_cast<const char *>(_in.data());
+      const char *end = _inEnd ? static_cast<const char *>(memmem(begin, _inEnd, "\r\n\r\n", 4)) : nullptr;
+
+      if (end)
+      {
+        bool switched = _inEnd >= 12 && !memcmp(begin, "HTTP/1.1 101", 12);
+        _inBegin = end + 4 - begin;
+        return switched;
+      }
+
+      if (!fill())
+        return false;
+    }
+  }
+
+  bool connect(const std::string &host, int port) { return open(host, port) && upgrade(host); }
+
+  bool send(uint8_t op, const void *ptr, size_t length)
+  {
+    _out.resize(14 + length);
+    uint8_t *cursor = _out.data();
+    *cursor++ = 0x80 | op;
+
+    if (length < 126)
+      *cursor++ = 0x80 | static_cast<uint8_t>(length);
+    else if (length < 65536)
+    {
+      *cursor++ = 0x80 | 126;
+      *cursor++ = static_cast<uint8_t>(length >> 8);
+      *cursor++ = static_cast<uint8_t>(length);
+    }
+    else
+    {
+      *cursor++ = 0x80 | 127;
+
+      for (int shift = 56; shift >= 0; shift -= 8)
+        *cursor++ = static_cast<uint8_t>(static_cast<uint64_t>(length) >> shift);
+    }
+
+    // Fresh key for every frame (xorshift), payload is masked while copied
+    _mask ^= _mask << 13;
+    _mask ^= _mask >> 17;
+    _mask ^= _mask << 5;
+    uint8_t key[4];
+    memcpy(key, &_mask, 4);
+    memcpy(cursor, key, 4);
+    cursor += 4;
+
+    const uint8_t *payload = static_cast<const uint8_t *>(ptr);
+
+    for (size_t i = 0; i < length; ++i)
+      cursor[i] = payload[i] ^ key[i & 3];
+
+    return send_all(_out.data(), cursor + length - _out.data());
+  }
+
+  // Next data message into 'payload', control frames from server are skipped, false once connection is gone
+  bool receive(std::vector<uint8_t> &payload, uint8_t *op = nullptr)
+  {
+    payload.clear();
+
+    while (true)
+    {
+      size_t available = _inEnd - _inBegin;
+      const uint8_t *header = _in.data() + _inBegin;
+
+      if (available >= 2)
+      {
+        size_t headerSize = 2, length = header[1] & 0x7F;
+
+        if (length == 126)
+          headerSize += 2;
+        else if (length == 127)
+          headerSize += 8;
+
+        headerSize += (header[1] & 0x80) ? 4 : 0;
+
+        if (available >= headerSize)
+        {
+          if (length >= 126)
+          {
+            size_t bytes = length == 126 ? 2 : 8;
+            length = 0;
+
+            for (size_t i = 0; i < bytes; ++i)
+              length = (length << 8) | header[2 + i];
+          }
+
+          if (available >= headerSize + length)
+          {
+            uint8_t frameOp = header[0] & 0x0F;
+            bool fin = (header[0] & 0x80) != 0;
+
+            if (frameOp == 0x08)
+              return false;
+
+            if (frameOp < 0x08)
+            {
+              if (frameOp && op)
+                *op = frameOp;
+
+              payload.insert(payload.end(), header + headerSize, header + headerSize + length);
+            }
+
+            _inBegin += headerSize + length;
+
+            if (fin && frameOp < 0x08)
+              return true;
+
+            continue;
+          }
+        }
+      }
+
+      if (!fill())
+        return false;
+    }
+  }
+
+  // Wakes up a thread blocked in receive()
+  void shutdown()
+  {
+    if (_socket >= 0)
+      ::shutdown(_socket, SHUT_RDWR);
+  }
+
+  void close()
+  {
+    if (_socket >= 0)
+      ::close(_socket);
+
+    _socket = -1;
+  }
+
+  int socket_handle() const { return _socket; }
+
+  // errno of the last failure, 0 when the peer closed connection
+  int error() const { return _error; }
+
+private:
+  bool send_all(const void *ptr, size_t length)
+  {
+    const char *cursor = static_cast<const char *>(ptr);
+
+    while (length)
+    {
+      ssize_t result = ::send(_socket, cursor, length, MSG_NOSIGNAL);
+
+      if (result <= 0)
+      {
+        _error = result ? errno : 0;
+        return false;
+      }
+
+      cursor += result;
+      length -= static_cast<size_t>(result);
+    }
+
+    return true;
+  }
+
+  bool fill()
+  {
+    // Only an incomplete frame is left behind, moving it to the front is cheap
+    if (_inBegin)
+    {
+      memmove(_in.data(), _in.data() + _inBegin, _inEnd - _inBegin);
+      _inEnd -= _inBegin;
+      _inBegin = 0;
+    }
+
+    if (_in.size() - _inEnd < 65536)
+      _in.resize(_inEnd + 65536);
+
+    ssize_t result = recv(_socket, _in.data() + _inEnd, _in.size() - _inEnd, 0);
+
+    if (result <= 0)
+    {
+      _error = result ? errno : 0;
+      return false;
+    }
+
+    _inEnd += static_cast<size_t>(result);
+    return true;
+  }
+
+  int _socket = -1;
+  int _error = 0;
+  uint32_t _mask = 1;
+  std::vector<uint8_t> _in;
+  std::vector<uint8_t> _out;
+  size_t _inBegin = 0;
+  size_t _inEnd = 0;
+};
+
+}
@@ -0,0 +1,3 @@
+include "Throughput"
+include "Kernels"
+include "Storm"
@@ -19,7 +19,13 @@ Usage:
 
 #include <memory>
 #include <string>
+#include <string_view>
+#include <functional>
 #include <map>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -31,6 +37,8 @@ class basic_tcp_server;
 class basic_tcp_client;
 class tcp_client;
 class async_tcp_client;
+class basic_connection_pool;
+class event_stream;
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -46,22 +54,139 @@ struct connection_impl;
 struct basic_tcp_server_impl;
 struct basic_tcp_client_impl;
 struct async_tcp_client_impl;
+struct http_server_impl;
+struct http_buffer;
+struct http_request;
+struct cached_response;
+struct connection_pool_impl;
+struct event_stream_impl;
+struct deferred_state;
+class event_stream_client;
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 static bool handshake_websocket(connection &conn);
+static std::string web_socket_accept(const std::string_view &key);
+static std::string web_socket_response(const std::string_view &key);
+
+// Runs 'task' on a detached thread of its own, see create_async() of clients
+void run_detached(std::function<void()> task);
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// ASCII only, header and parameter names are not localized
+inline char fold_case(char ch) { return ch >= 'A' && ch <= 'Z' ? static_cast<char>(ch | 0x20) : ch; }
+
+inline bool iequals(const std::string_view &s1, const std::string_view &s2)
+{
+  if (s1.length() != s2.length())
+    return false;
+
+  for (size_t i = 0, S = s1.length(); i < S; ++i)
+    if (s1[i] != s2[i] && fold_case(s1[i]) != fold_case(s2[i]))
+      return false;
+
+  return true;
+}
+
+// FNV-1a over case-folded characters, so names differing only in case land in the same slot
+inline uint32_t ihash(const std::string_view &text)
+{
+  uint32_t hash = 2166136261u;
+
+  for (char ch : text)
+    hash = (hash ^ static_cast<uint8_t>(fold_case(ch))) * 16777619u;
+
+  return hash;
+}
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-struct less_comparator : std::binary_function<std::string, std::string, bool>
+// Fixed capacity table of items with case-insensitive 'name', kept in insertion order. Lookups go through open
+// addressing index of precomputed name hashes, items themselves only point to the data (no allocations at all).
+template <typename T, size_t N>
+class flat_table
 {
-  bool operator()(const std::string &s1, const std::string &s2) const
+public:
+  typedef const T *const_iterator;
+
+  flat_table() { memset(_slots, 0, sizeof(_slots)); }
+
+  bool empty() const { return !_size; }
+  size_t size() const { return _size; }
+  static size_t capacity() { return N; }
+
+  const_iterator begin() const { return _items; }
+  const_iterator end() const { return _items + _size; }
+
+  // Returns first item with given name
+  const_iterator find(const std::string_view &name) const
+  {
+    uint32_t hash = ihash(name);
+
+    for (size_t slot = hash & slot_mask; _slots[slot]; slot = (slot + 1) & slot_mask)
+    {
+      size_t index = _slots[slot] - 1;
+
+      if (_hashes[index] == hash && iequals(_items[index].name, name))
+        return _items + index;
+    }
+
+    return end();
+  }
+
+  // Returns empty item when name is not found
+  const T &operator[](const std::string_view &name) const
+  {
+    static const T empty_item = T();
+    auto iter = find(name);
+    return iter != end() ? *iter : empty_item;
+  }
+
+  bool push_back(const T &item)
+  {
+    if (_size == N)
+      return false;
+
+    uint32_t hash = ihash(item.name);
+    size_t slot = hash & slot_mask;
+
+    while (_slots[slot])
+      slot = (slot + 1) & slot_mask;
+
+    _slots[slot] = static_cast<slot_t>(_size + 1);
+    _hashes[_size] = hash;
+    _items[_size++] = item;
+    return true;
+  }
+
+  // Removing newest items first keeps probe sequences of the remaining ones intact
+  void truncate(size_t size)
   {
-    return std::lexicographical_compare(s1.begin(), s1.end(), s2.begin(), s2.end(), [](char c1, char c2)->bool
+    while (_size > size)
     {
-      return tolower(c1) < tolower(c2);
-    });
+      --_size;
+      size_t slot = _hashes[_size] & slot_mask;
+
+      while (_slots[slot] != _size + 1)
+        slot = (slot + 1) & slot_mask;
+
+      _slots[slot] = 0;
+    }
   }
+
+  void clear() { truncate(0); }
+
+private:
+  static_assert(N && !(N & (N - 1)), "flat_table capacity must be a power of two");
+
+  typedef typename std::conditional<N < 256, uint8_t, uint16_t>::type slot_t;
+  static const size_t slot_mask = N * 2 - 1;
+
+  T _items[N];
+  uint32_t _hashes[N];
+  slot_t _slots[N * 2];
+  size_t _size = 0;
 };
 
 }
@@ -112,6 +237,7 @@ struct data_block
   size_t offset;
   size_t length = 0;
   bool is_completed = false;
+  uint64_t pushed_at = 0;
 
   data_block(opcode opc, size_t off)
     : op(opc)
@@ -123,6 +249,123 @@ struct data_block
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// Process-wide totals since start, every thread counts into its own slots and snapshot() sums them up
+struct metrics
+{
+  uint64_t accepts = 0;
+  uint64_t handshakes_failed = 0;
+  uint64_t connects = 0;
+  uint64_t connect_failures = 0;
+  uint64_t bytes_in = 0;
+  uint64_t bytes_out = 0;
+  uint64_t http_requests = 0;
+  uint64_t frames_in[16] = { };
+  uint64_t frames_out[16] = { };
+
+  // Gauges: open connections (accepted and outgoing) and bytes pushed, but not written to sockets yet
+  int64_t clients = 0;
+  int64_t queued_bytes = 0;
+
+  static metrics snapshot();
+
+  // Prometheus text exposition format, see http_server::serve_metrics
+  std::string prometheus() const;
+};
+
+// Snapshot of a log-linear histogram of nanoseconds (HdrHistogram style): values below 64 have buckets of their own,
+// every power of two above is split into 32 buckets, so reported percentiles are at most 1/32 above recorded values
+struct latency_histogram
+{
+  static const size_t bucket_count = 1024;
+
+  uint64_t counts[bucket_count] = { };
+  uint64_t count = 0;
+  uint64_t sum = 0;
+  uint64_t max = 0;
+
+  // Highest value of the bucket reaching p percent of all samples, 0 when empty
+  uint64_t percentile(double p) const;
+  uint64_t p50() const { return percentile(50.0); }
+  uint64_t p99() const { return percentile(99.0); }
+  uint64_t p999() const { return percentile(99.9); }
+
+  static size_t bucket(uint64_t value);
+  static uint64_t bucket_max(size_t index);
+};
+
+// Receive to callback: recv() returning the last bytes of a message until async_received_data() is called with it.
+// Push to wire: push() until send() returns with the last bytes of the message.
+struct latency_metrics
+{
+  latency_histogram receive_to_callback;
+  latency_histogram push_to_wire;
+
+  // Prometheus summaries (0.5, 0.99 and 0.999 quantiles in seconds)
+  std::string prometheus() const;
+};
+
+// Connection events (accept, handshake, frames in, callbacks, pushes, sends, lock waits and disconnects), every thread
+// records into a ring buffer of its own while started. Compiled in only with HEADSOCKET_TRACE defined for the
+// implementation, otherwise recording costs nothing and the trace stays empty.
+struct trace
+{
+  static void start();
+  static void stop();
+  static bool is_running();
+
+  // Drops recorded events, buffers of finished threads included
+  static void clear();
+
+  // Chrome trace event format JSON of events still in the buffers, opens in chrome://tracing and ui.perfetto.dev
+  static std::string chrome_json();
+};
+
+// Totals of every HEADSOCKET_LOCK site since start, compiled in only with HEADSOCKET_LOCK_PROFILE defined for the
+// implementation, otherwise locks stay plain lock_guards and snapshots are empty
+struct lock_profile
+{
+  struct site
+  {
+    std::string file;
+    int line = 0;
+    std::string lock;
+    bool signal = false;
+    uint64_t acquisitions = 0;
+    uint64_t contended = 0;
+    uint64_t wait_ns = 0;
+    uint64_t hold_ns = 0;
+  };
+
+  // Longest total wait first. Semaphore sites ('signal') count waiting for a notify as wait as well.
+  std::vector<site> sites;
+
+  static lock_profile snapshot();
+
+  // Text table, one line per site
+  std::string report() const;
+};
+
+// Outgoing connections race all resolved addresses (Happy Eyeballs, RFC 8305): attempts start 'attempt_delay_ms' apart,
+// alternating IPv6 and IPv4, or right away once the previous one failed. The first one to connect wins.
+struct connect_options
+{
+  int attempt_delay_ms = 250;
+
+  // Single attempt still not connected by then is given up, the others keep racing (0 waits as long as the system does)
+  int attempt_timeout_ms = 3000;
+
+  // Whole race, resolving addresses is not included (0 means no limit)
+  int timeout_ms = 10000;
+
+  // Resolved addresses of a host and port are reused for this long (getaddrinfo does not report TTLs of records),
+  // 0 resolves every time. Entries none of whose addresses connected are dropped right away.
+  int dns_ttl_ms = 30000;
+
+  static void clear_dns_cache();
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
 class basic_tcp_server : public std::enable_shared_from_this<basic_tcp_server>
 {
 public:
@@ -132,6 +375,9 @@ public:
   bool disconnect(ptr<basic_tcp_client> client);
   bool disconnect(id_t id);
 
+  // Recorded by all clients of this server
+  latency_metrics latency() const;
+
 protected:
   struct protected_tag { };
   void init() { }
@@ -144,12 +390,15 @@ protected:
   virtual void client_connected(ptr<basic_tcp_client> client) = 0;
   virtual void client_disconnected(ptr<basic_tcp_client> client) = 0;
 
+  bool replace_client(const basic_tcp_client *oldClient, ptr<basic_tcp_client> newClient);
+
   std::unique_ptr<detail::basic_tcp_server_impl> _p;
 
 private:
   template <typename T> friend class tcp_server;
+  friend class async_tcp_client;
 
-  void remove_disconnected() const;
+  bool remove_disconnected() const;
 
   size_t acquire_clients() const;
   void release_clients() const;
@@ -168,11 +417,21 @@ private:
     explicit className(int port): baseClassName(port) { init(); } \
   public: \
     typedef baseClassName base_t; \
+    typedef typename base_t::protected_tag protected_tag; \
     className(const protected_tag &, int port): className(port) { } \
     static headsocket::ptr<className> create(int port) { return std::make_shared<className>(protected_tag{}, port); } \
   protected: \
     void init()
 
+#define HEADSOCKET_SERVER_BASE(className, baseClassName) \
+  protected: \
+    explicit className(int port); \
+  public: \
+    typedef baseClassName base_t; \
+    typedef typename base_t::protected_tag protected_tag; \
+    className(const protected_tag &, int port): className(port) { } \
+    static headsocket::ptr<className> create(int port) { return std::make_shared<className>(protected_tag{}, port); }
+
 template <typename T>
 class tcp_server : public basic_tcp_server
 {
@@ -250,7 +509,13 @@ private:
 
   ptr<basic_tcp_client> accept(connection &conn) override
   {
-    ptr<basic_tcp_client> newClient = T::create(shared_from_this(), conn);
+    // Server being destroyed may still finish a handshake in progress, the connection is dropped then
+    auto self = weak_from_this().lock();
+
+    if (!self)
+      return nullptr;
+
+    auto newClient = T::create(self, conn);
     return newClient->is_connected() ? newClient : nullptr;
   }
 
@@ -286,11 +551,16 @@ protected:
   struct protected_tag { };
 
   friend class basic_tcp_server;
+  friend class basic_connection_pool;
+  friend class http_server;
 
   virtual void on_accept() { }
   virtual void on_disconnect() { }
 
-  basic_tcp_client(const std::string &address, int port);
+  // Outgoing connection got established, called by create() once the whole object is constructed
+  virtual void on_connect() { }
+
+  basic_tcp_client(const std::string &address, int port, const connect_options &options = connect_options());
   basic_tcp_client(ptr<basic_tcp_server> server, connection &conn);
 
   std::unique_ptr<detail::basic_tcp_client_impl> _p;
@@ -299,21 +569,33 @@ protected:
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 #define __HEADSOCKET_CLIENT_STATIC_CTORS(className) \
-  className(const protected_tag &, const std::string &address, int port): className(address, port) { } \
+  className(const protected_tag &, const std::string &address, int port, const headsocket::connect_options &options): className(address, port, options) { } \
   className(const protected_tag &, headsocket::ptr<headsocket::basic_tcp_server> server, headsocket::connection &conn): className(server, conn) { } \
-  static headsocket::ptr<className> create(const std::string &address, int port) { return std::make_shared<className>(protected_tag{}, address, port); } \
+  static headsocket::ptr<className> create(const std::string &address, int port, const headsocket::connect_options &options = headsocket::connect_options()) \
+  { \
+    auto result = std::make_shared<className>(protected_tag{}, address, port, options); \
+    if (result->is_connected()) result->on_connect(); \
+    return result; \
+  } \
+  /* Connects on a thread of its own, 'callback' gets called there with the client (not connected when it failed) */ \
+  static void create_async(const std::string &address, int port, std::function<void(headsocket::ptr<className>)> callback, \
+    const headsocket::connect_options &options = headsocket::connect_options()) \
+  { \
+    headsocket::detail::run_detached([address, port, callback, options]() { callback(create(address, port, options)); }); \
+  } \
   static headsocket::ptr<className> create(headsocket::ptr<headsocket::basic_tcp_server> server, headsocket::connection &conn) { return std::make_shared<className>(protected_tag{}, server, conn); }
 
 #define HEADSOCKET_CLIENT_BASE(className) \
   protected: \
-    className(const std::string &address, int port); \
+    className(const std::string &address, int port, const connect_options &options = connect_options()); \
     className(ptr<basic_tcp_server> server, connection &conn); \
   public: \
     __HEADSOCKET_CLIENT_STATIC_CTORS(className)
 
 #define HEADSOCKET_CLIENT(className, baseClassName) \
   protected: \
-    className(const std::string &address, int port): baseClassName(address, port) { } \
+    className(const std::string &address, int port, const headsocket::connect_options &options = headsocket::connect_options()) \
+      : baseClassName(address, port, options) { } \
     className(headsocket::ptr<headsocket::basic_tcp_server> server, headsocket::connection &conn): baseClassName(server, conn) { } \
   public: \
     __HEADSOCKET_CLIENT_STATIC_CTORS(className)
@@ -332,6 +614,7 @@ public:
   virtual size_t read(void *ptr, size_t length);
 
   bool force_write(const void *ptr, size_t length);
+  bool force_write(const std::string &text) { return force_write(text.c_str(), text.length()); }
   bool force_read(void *ptr, size_t length);
 
   bool read_line(std::string &output);
@@ -354,8 +637,13 @@ public:
   size_t peek() const;
   size_t pop(void *ptr, size_t length);
 
+  // Per-client histograms are off until the first track_latency() call, latency() is empty until then
+  void track_latency();
+  latency_metrics latency() const;
+
 protected:
   void on_accept() override { init_threads(); }
+  void on_connect() override { init_threads(); }
   void on_disconnect() override { kill_threads(); }
 
   virtual void init_threads();
@@ -396,7 +684,14 @@ protected:
   size_t async_write_handler(uint8_t *ptr, size_t length) override;
   size_t async_read_handler(uint8_t *ptr, size_t length) override;
 
-private:
+  // Outgoing clients send the upgrade request and verify Sec-WebSocket-Accept before starting their threads,
+  // a failed handshake disconnects
+  void on_connect() override;
+
+  // Request target of the upgrade request
+  virtual std::string upgrade_path() const { return "/"; }
+
+  // Frame codec, returns bytes written or read (0 when buffer is too short)
   struct frame_header
   {
     bool fin;
@@ -409,8 +704,15 @@ private:
     size_t read(const uint8_t *ptr, size_t length);
   };
 
+private:
+  bool handshake();
+
+  // Frames sent by outgoing clients are masked with keys from this xorshift state, server side keeps it at zero
+  uint32_t next_masking_key();
+
   size_t _payload_size = 0;
   frame_header _current_header;
+  uint32_t _masking_state = 0;
 };
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -435,44 +737,300 @@ private:
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-class http_server : public tcp_server<tcp_client>
+// Idle outgoing connections kept by host and port, see connection_pool<T>
+class basic_connection_pool
 {
-  HEADSOCKET_SERVER(http_server, tcp_server<tcp_client>) { }
+public:
+  struct options
+  {
+    // Per host and port, the longest idle ones are closed first
+    size_t max_idle = 8;
+
+    // Idle connections are closed after this long idle, or this long after connecting (0 means no limit for both)
+    int max_idle_ms = 30000;
+    int max_age_ms = 300000;
+
+    connect_options connect;
+  };
+
+  struct stats
+  {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t dropped = 0;
+    size_t idle = 0;
+  };
+
+  typedef std::function<ptr<basic_tcp_client>(const std::string &, int, const connect_options &)> factory;
 
+  virtual ~basic_connection_pool();
+
+  // Closes idle connections past their limits, hosts not checked out from anymore keep them until then
+  void prune();
+  void clear();
+
+  stats statistics() const;
+
+protected:
+  basic_connection_pool(const options &opts, factory create);
+
+  ptr<basic_tcp_client> checkout_client(const std::string &address, int port);
+  void checkin_client(ptr<basic_tcp_client> client);
+
+  std::unique_ptr<detail::connection_pool_impl> _p;
+
+private:
+  bool is_expired(basic_tcp_client &client, uint64_t idleSince, uint64_t now) const;
+
+  // Connected, nothing unread and nothing arriving (an idle peer has nothing to say, so readable means closed)
+  static bool is_reusable(basic_tcp_client &client);
+
+  void drop(std::vector<ptr<basic_tcp_client>> &clients);
+};
+
+// Checked out clients are connected and not in use by anyone else, newly connected when no idle one is left (check
+// is_connected() still). Check them in only after the whole exchange, with nothing left to read; clients which are
+// disconnected or have unread data by then are closed instead. Clients never checked in simply close when released.
+template <typename T>
+class connection_pool : public basic_connection_pool
+{
 public:
-  ~http_server()
+  connection_pool(const options &opts = options())
+    : basic_connection_pool(opts, [](const std::string &address, int port, const connect_options &connect)
+      {
+        return std::static_pointer_cast<basic_tcp_client>(T::create(address, port, connect));
+      })
   {
-    stop();
+
   }
 
+  ptr<T> checkout(const std::string &address, int port) { return std::static_pointer_cast<T>(checkout_client(address, port)); }
+  void checkin(ptr<T> client) { checkin_client(client); }
+
+private:
+  enum { needs_basic_tcp_client = T::is_basic_tcp_client };
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Shared fan-out buffer for Server-Sent Events, see http_server::serve_events
+class event_stream
+{
+public:
+  static ptr<event_stream> create(size_t bufferLimit = 1024 * 1024);
+
+  ~event_stream();
+
+  // Formats event once and queues it for all subscribers, multi-line 'data' is sent as several data fields
+  void publish(const std::string_view &data, const std::string_view &event = std::string_view(), const std::string_view &id = std::string_view());
+
+  // Comment lines are ignored by browsers, useful as a heartbeat through proxies
+  void comment(const std::string_view &text);
+
+  size_t subscribers() const;
+
+private:
+  friend class http_server;
+  friend class detail::event_stream_client;
+
+  event_stream(size_t bufferLimit);
+
+  void append(const std::string &text);
+
+  std::unique_ptr<detail::event_stream_impl> _p;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+class http_server : public tcp_server<tcp_client>
+{
+  HEADSOCKET_SERVER_BASE(http_server, tcp_server<tcp_client>)
+
+public:
+  virtual ~http_server();
+
+  // Also waits for serving threads still running (except the calling one)
+  void stop();
+
+  class deferred;
+
   struct response
   {
+    static const size_t unknown_length = static_cast<size_t>(-1);
+
     std::string content_type = "text/html";
     std::string message = "";
+
+    // Streamed body, used instead of 'message' when set. Called repeatedly to fill at most 'length' bytes into 'ptr'
+    // and returning number of bytes written, 0 ends the stream. Sent chunked unless 'content_length' is known.
+    std::function<size_t(char *ptr, size_t length)> producer;
+    size_t content_length = unknown_length;
+
+    // Seconds to keep this response in response cache, keyed by path and query parameters. Cached responses are
+    // served without calling the handler, 0 disables caching. Only GET and HEAD responses with 'message' are cached.
+    int cache_ttl = 0;
+
+    // Answers later, handler returns true and the response is sent once returned handle gets completed
+    ptr<deferred> defer();
+
+    ptr<deferred> deferred_handle;
+  };
+
+  // Completion handle of deferred response. Parked connection is not tied to any thread until the handle is completed
+  // (from any thread, just once). Handle released without completion answers with 500 Internal Server Error.
+  class deferred
+  {
+  public:
+    ~deferred();
+
+    bool complete(response resp, bool found = true);
+    bool is_pending() const;
+
+  private:
+    friend class http_server;
+    friend struct response;
+
+    deferred();
+    bool finish(response &resp, const char *status);
+
+    std::unique_ptr<detail::deferred_state> _p;
   };
 
+  static const size_t request_size_limit = 16 * 1024;
+  static const size_t stream_chunk_size = 64 * 1024;
+
+  // Seconds a connection may stay silent while its request is read when keep-alive is off
+  static const int request_timeout = 5;
+
+  // Name and value point into connection buffer, numbers are converted on demand
   struct parameter
   {
-    std::string name;
-    std::string value;
-    bool boolean;
-    int integer;
-    double real;
+    std::string_view name;
+    std::string_view value;
+
+    bool boolean() const { return integer() != 0 || value == "true"; }
+    int integer() const;
+    double real() const;
+  };
+
+  struct header
+  {
+    std::string_view name;
+    std::string_view value;
   };
 
-  typedef std::map<std::string, parameter, detail::less_comparator> parameters_t;
+  typedef detail::flat_table<parameter, 64> parameters_t;
+  typedef detail::flat_table<header, 64> headers_t;
+  typedef std::function<bool(const std::string_view &path, const parameters_t &params, response &resp)> handler_t;
 
 protected:
-  virtual bool request(const std::string &path, const parameters_t &params, response &resp) { return false; }
+  // Fallback for requests not matching any route
+  virtual bool request(const std::string_view &path, const parameters_t &params, response &resp) { return false; }
+
+  // Registers handler for exact ("api/status"), parameterised ("users/:id") or prefix ("files/*") paths. Captured
+  // segments are passed as parameters ("id", "*"). Handler can be limited to space or comma separated list of
+  // 'methods' ("GET POST", any method name is compared exactly), empty string matches any method. Register all routes
+  // in your init().
+  void route(const std::string &methods, const std::string &pattern, handler_t handler);
+
+  // Serves files from 'directory' for all paths starting with 'prefix'
+  void serve_files(const std::string &prefix, const std::string &directory);
+
+  // GET requests to 'path' subscribe to Server-Sent Events published to 'stream'
+  void serve_events(const std::string &path, ptr<event_stream> stream);
+
+  // GET requests to 'path' are answered with metrics::snapshot() in Prometheus text format
+  void serve_metrics(const std::string &path = "metrics");
+
+  // WebSocket upgrade support, see web_server<T>
+  virtual ptr<basic_tcp_client> upgrade(connection &conn) { return nullptr; }
+  virtual void upgraded(ptr<basic_tcp_client> client) { }
+
+  // Persistent connection limits, set these in your init(). Idle connections are closed after 'keep_alive_timeout'
+  // seconds, 0 (or less) turns keep-alive off and every connection is closed after its first response.
+  int keep_alive_timeout = 5;
+  size_t keep_alive_max_requests = 100;
+
+  // Every served connection takes a thread of its own, including idle keep-alive ones. Connections over this limit
+  // are answered with 503 Service Unavailable and closed.
+  size_t max_serving_threads = 256;
+
+  // Small static files are kept memory mapped, bigger ones are streamed directly from disk
+  size_t file_cache_size = 64 * 1024 * 1024;
+  size_t file_cache_max_file_size = 256 * 1024;
+
+  // Memory limit for responses with 'cache_ttl', including their compressed variants
+  size_t response_cache_size = 16 * 1024 * 1024;
+
+  std::unique_ptr<detail::http_server_impl> _hp;
 
 private:
   bool handshake(connection &conn) final override;
-
-  ptr<basic_tcp_client> accept(connection &conn) final override { return nullptr; }
-  void client_connected(client_ptr client) final override { }
+  bool serve(const client_ptr &clientPtr, ptr<detail::http_buffer> &bufferPtr, size_t served);
+  bool park(const client_ptr &clientPtr, ptr<detail::http_buffer> &bufferPtr, size_t headSize, const detail::http_request &req, response &resp, bool keepAlive, size_t served);
+  bool resume(detail::deferred_state &state, response &resp, const char *status);
+  bool send_response(tcp_client &client, const detail::http_request &req, response &resp, const char *status, bool &keepAlive, size_t served);
+  bool serve_file(tcp_client &client, const detail::http_request &req, const std::string &fileName, bool keepAlive, size_t served);
+  bool stream_response(tcp_client &client, const detail::http_request &req, response &resp, bool keepAlive, size_t served);
+  bool send_cached(tcp_client &client, const detail::http_request &req, const detail::cached_response &cached, bool keepAlive, size_t served);
+  bool upgrade_connection(tcp_client &client, detail::http_buffer &buffer, size_t headSize, const detail::http_request &req);
+  bool subscribe(tcp_client &client, detail::http_buffer &buffer, size_t headSize, ptr<event_stream> stream);
+  bool hand_over(tcp_client &client, detail::http_buffer &buffer, size_t headSize, ptr<basic_tcp_client> newClient, const std::string &response);
+  bool skip_body(tcp_client &client, detail::http_buffer &buffer, size_t headSize, size_t contentLength);
+  std::string begin_response(const detail::http_request &req, const char *status, bool keepAlive, size_t served) const;
+
+  void serve_connection(client_ptr client, ptr<detail::http_buffer> buffer, size_t served);
+
+  void client_connected(client_ptr client) final override;
   void client_disconnected(client_ptr client) final override { }
 };
 
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+template <typename T>
+class web_server : public http_server
+{
+  HEADSOCKET_SERVER(web_server, http_server) { }
+
+public:
+  typedef T web_socket_client_t;
+
+  virtual ~web_server()
+  {
+    stop();
+  }
+
+protected:
+  virtual void web_socket_connected(ptr<T> client) { }
+  virtual void web_socket_disconnected(ptr<T> client) { }
+
+private:
+  enum { needs_web_socket_client = T::is_web_socket_client };
+
+  ptr<basic_tcp_client> upgrade(connection &conn) override
+  {
+    // Server being destroyed may still finish a handshake in progress, the connection is dropped then
+    auto self = weak_from_this().lock();
+
+    if (!self)
+      return nullptr;
+
+    auto newClient = T::create(self, conn);
+    return newClient->is_connected() ? newClient : nullptr;
+  }
+
+  void upgraded(ptr<basic_tcp_client> client) override
+  {
+    web_socket_connected(std::static_pointer_cast<T>(client));
+  }
+
+  void client_disconnected(ptr<basic_tcp_client> client) override
+  {
+    if (auto webSocketClient = std::dynamic_pointer_cast<T>(client))
+      web_socket_disconnected(webSocketClient);
+  }
+};
+
 }
 
 #endif // __HEADSOCKET_H__
@@ -491,6 +1049,16 @@ private:
 #include <condition_variable>
 #include <memory>
 #include <sstream>
+#include <functional>
+#include <list>
+#include <deque>
+#include <unordered_map>
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <cerrno>
+#include <chrono>
+#include <random>
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -523,1678 +1091,6207 @@ private:
 #include <WinSock2.h>
 #include <Windows.h>
 #include <ws2tcpip.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #elif defined(HEADSOCKET_PLATFORM_ANDROID) || defined(HEADSOCKET_PLATFORM_NIX)
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/ip.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <pthread.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#define HEADSOCKET_SENDFILE
+#endif
 #endif
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-#define HEADSOCKET_LOCK_SUFFIX(var, suffix) std::lock_guard<decltype(var)> __scope_lock##suffix(var);
-#define HEADSOCKET_LOCK_SUFFIX2(var, suffix) HEADSOCKET_LOCK_SUFFIX(var, suffix)
-#define HEADSOCKET_LOCK(var) HEADSOCKET_LOCK_SUFFIX2(var, __LINE__)
-
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#ifndef HEADSOCKET_NO_SIMD
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HEADSOCKET_SSE2
+#endif
+#endif
 
-namespace headsocket {
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
-namespace detail {
-#if defined(HEADSOCKET_PLATFORM_WINDOWS)
-typedef SOCKET socket_type;
-static const int socket_error = SOCKET_ERROR;
-static const SOCKET invalid_socket = INVALID_SOCKET;
-void close_socket(socket_type s) { closesocket(s); }
-#define HEADSOCKET_SPRINTF sprintf_s
-#elif defined(HEADSOCKET_PLATFORM_ANDROID) || defined(HEADSOCKET_PLATFORM_NIX)
-typedef int socket_type;
-static const int socket_error = -1;
-static const int invalid_socket = -1;
-void close_socket(socket_type s) { close(s); }
-#define HEADSOCKET_SPRINTF sprintf
+// Wider x86 instruction sets (SSSE3, AVX2, SHA) are detected at runtime and only used by functions carrying their own
+// target attribute, ARMv8 SHA-1 instructions have to be enabled for the whole build
+#if !defined(HEADSOCKET_NO_SIMD) && (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86))
+#if defined(_MSC_VER)
+#define HEADSOCKET_TARGET(isa)
+#define HEADSOCKET_X86_DISPATCH
+#elif defined(__GNUC__) && (defined(__clang__) || __GNUC__ >= 5)
+#include <immintrin.h>
+#include <cpuid.h>
+#define HEADSOCKET_TARGET(isa) __attribute__((target(isa)))
+#define HEADSOCKET_X86_DISPATCH
+#endif
+#elif !defined(HEADSOCKET_NO_SIMD) && (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_SHA2))
+#include <arm_neon.h>
+#define HEADSOCKET_SHA_ARM
 #endif
-}
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+namespace headsocket {
 namespace detail {
 
-class sha1
+// Counters of every thread live in their own slots, written only by that thread (relaxed load and store, no locked
+// instructions). Readers sum all live slots under the registry lock, slots of finished threads are folded into 'retired'.
+// Plain std::mutex, so the lock profiler can count with it as well.
+template <typename Registry, typename T, size_t Count>
+struct thread_slot_registry
 {
-public:
-  typedef uint32_t digest32_t[5];
-  typedef uint8_t digest8_t[20];
+  struct slots
+  {
+    std::atomic<T> values[Count];
 
-  inline static uint32_t rotate_left(uint32_t value, size_t count) { return (value << count) ^ (value >> (32 - count)); }
+    slots() { for (auto &value : values) value = 0; }
+  };
 
-  sha1()
+  struct thread_slots : slots
   {
-    _digest[0] = 0x67452301;
-    _digest[1] = 0xEFCDAB89;
-    _digest[2] = 0x98BADCFE;
-    _digest[3] = 0x10325476;
-    _digest[4] = 0xC3D2E1F0;
+    thread_slots()
+    {
+      Registry &registry = get();
+      std::lock_guard<std::mutex> lock(registry.mutex);
+      registry.live.push_back(this);
+    }
+
+    ~thread_slots()
+    {
+      Registry &registry = get();
+      std::lock_guard<std::mutex> lock(registry.mutex);
+
+      for (size_t i = 0; i < Count; ++i)
+        registry.retired[i] += this->values[i].load(std::memory_order_relaxed);
+
+      registry.live.erase(std::find(registry.live.begin(), registry.live.end(), this));
+      finished() = true;
+    }
+  };
+
+  std::mutex mutex;
+  std::vector<slots *> live;
+  T retired[Count] = { };
+
+  // Never destroyed: detached threads (serving, connecting, async clients) may still run while statics are being
+  // destroyed at exit. The same holds for the other process-wide registries (trace_registry, dns_cache), which are
+  // leaked the same way.
+  static Registry &get()
+  {
+    static Registry *registry = new Registry();
+    return *registry;
   }
 
-  ~sha1()
+  // Slots of the calling thread, nullptr once its thread_local objects are being destroyed (counts are dropped then)
+  static slots *local()
   {
+    if (finished())
+      return nullptr;
 
+    static thread_local thread_slots owner;
+    return &owner;
   }
 
-  void process_byte(uint8_t octet)
+  static void add(size_t index, T delta)
   {
-    _block[_block_byte_index++] = octet;
-    ++_byte_count;
-
-    if (_block_byte_index == 64)
+    if (slots *s = local())
     {
-      _block_byte_index = 0;
-      process_block();
+      std::atomic<T> &value = s->values[index];
+      value.store(value.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
     }
   }
 
-  void process_block(const void *start, const void *end)
+  void sum(T totals[Count])
   {
-    const uint8_t *begin = static_cast<const uint8_t *>(start);
+    std::lock_guard<std::mutex> lock(mutex);
 
-    while (begin != end)
-      process_byte(*begin++);
-  }
+    for (size_t i = 0; i < Count; ++i)
+      totals[i] = retired[i];
 
-  void process_bytes(const void *data, size_t len)
-  {
-    process_block(data, static_cast<const uint8_t *>(data) + len);
+    for (slots *s : live)
+      for (size_t i = 0; i < Count; ++i)
+        totals[i] += s->values[i].load(std::memory_order_relaxed);
   }
 
-  const uint32_t *get_digest(digest32_t digest)
-  {
-    size_t bitCount = _byte_count * 8;
-    process_byte(0x80);
+private:
+  static bool &finished() { static thread_local bool f = false; return f; }
+};
 
-    if (_block_byte_index > 56)
-    {
-      while (_block_byte_index != 0)
-        process_byte(0);
+}
+}
 
-      while (_block_byte_index < 56)
-        process_byte(0);
-    }
-    else
-      while (_block_byte_index < 56)
-        process_byte(0);
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifdef HEADSOCKET_LOCK_PROFILE
+#ifndef HEADSOCKET_LOCK_SITES
+#define HEADSOCKET_LOCK_SITES 128
+#endif
 
-    process_byte(0);
-    process_byte(0);
-    process_byte(0);
-    process_byte(0);
+namespace headsocket {
+namespace detail {
 
-    for (int i = 24; i >= 0; i -= 8)
-      process_byte(static_cast<unsigned char>((bitCount >> i) & 0xFF));
+struct semaphore;
+uint64_t timestamp();
 
-    memcpy(digest, _digest, 5 * sizeof(uint32_t));
-    return digest;
-  }
+struct lock_counters
+{
+  enum counter : size_t { acquisitions, contended, wait, hold, counter_count };
+};
 
-  const uint8_t *get_digest_bytes(digest8_t digest)
+// Counters of every lock site live in per-thread slots (HEADSOCKET_LOCK_SITES rows of counter_count), so profiling
+// does not add shared cache lines to the locks it measures. Sites register once, on their first use.
+struct lock_profiler : lock_counters, thread_slot_registry<lock_profiler, uint64_t, HEADSOCKET_LOCK_SITES * lock_counters::counter_count>
+{
+  struct site
   {
-    digest32_t d32;
-    get_digest(d32);
-    size_t s[] = { 24, 16, 8, 0 };
+    const char *file;
+    int line;
+    const char *lock;
+    bool signal;
+    size_t index;
+
+    site(const char *f, int l, const char *name, bool s)
+      : file(f)
+      , line(l)
+      , lock(name)
+      , signal(s)
+    {
+      index = get().add_site(this);
+    }
+  };
 
-    for (size_t i = 0, j = 0; i < 20; ++i, j = i % 4)
-      digest[i] = ((d32[i >> 2] >> s[j]) & 0xFF);
+  std::vector<site *> sites;
 
-    return digest;
+  // Sites beyond HEADSOCKET_LOCK_SITES are not measured
+  size_t add_site(site *s)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    sites.push_back(s);
+    return sites.size() - 1;
   }
 
-private:
-  void process_block()
+  static void record(const site &s, bool wasContended, uint64_t waitTime, uint64_t holdTime)
   {
-    uint32_t w[80], s[] = { 24, 16, 8, 0 };
-
-    for (size_t i = 0, j = 0; i < 64; ++i, j = i % 4)
-      w[i / 4] = j ? (w[i / 4] | (_block[i] << s[j])) : (_block[i] << s[j]);
+    if (s.index >= HEADSOCKET_LOCK_SITES)
+      return;
 
-    for (size_t i = 16; i < 80; i++)
-      w[i] = rotate_left((w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16]), 1);
+    size_t row = s.index * counter_count;
+    add(row + acquisitions, 1);
+    add(row + contended, wasContended ? 1 : 0);
+    add(row + wait, waitTime);
+    add(row + hold, holdTime);
+  }
+};
 
-    digest32_t dig = { _digest[0], _digest[1], _digest[2], _digest[3], _digest[4] };
+// lock_guard that tries first, so only contended acquisitions pay for timing the wait
+template <typename M>
+class profiled_lock
+{
+public:
+  profiled_lock(M &m, const lock_profiler::site &s)
+    : _m(m)
+    , _site(s)
+  {
+    _contended = !_m.try_lock();
 
-    for (size_t f, k, i = 0; i < 80; ++i)
+    if (_contended)
     {
-      if (i < 20)
-        f = (dig[1] & dig[2]) | (~dig[1] & dig[3]), k = 0x5A827999;
-      else if (i < 40)
-        f = dig[1] ^ dig[2] ^ dig[3], k = 0x6ED9EBA1;
-      else if (i < 60)
-        f = (dig[1] & dig[2]) | (dig[1] & dig[3]) | (dig[2] & dig[3]), k = 0x8F1BBCDC;
-      else
-        f = dig[1] ^ dig[2] ^ dig[3], k = 0xCA62C1D6;
-
-      uint32_t temp = static_cast<uint32_t>(rotate_left(dig[0], 5) + f + dig[4] + k + w[i]);
-      dig[4] = dig[3];
-      dig[3] = dig[2];
-      dig[2] = rotate_left(dig[1], 30);
-      dig[1] = dig[0];
-      dig[0] = temp;
+      uint64_t start = timestamp();
+      _m.lock();
+      _acquired = timestamp();
+      _wait = _acquired - start;
     }
+    else
+      _acquired = timestamp();
+  }
 
-    for (size_t i = 0; i < 5; ++i)
-      _digest[i] += dig[i];
+  ~profiled_lock()
+  {
+    uint64_t hold = timestamp() - _acquired;
+    _m.unlock();
+    lock_profiler::record(_site, _contended, _wait, hold);
   }
 
-  digest32_t _digest;
-  uint8_t _block[64];
-  size_t _block_byte_index = 0;
-  size_t _byte_count = 0;
+  profiled_lock(const profiled_lock &) = delete;
+  profiled_lock &operator=(const profiled_lock &) = delete;
+
+private:
+  M &_m;
+  const lock_profiler::site &_site;
+  bool _contended;
+  uint64_t _acquired;
+  uint64_t _wait = 0;
 };
 
+}
+}
+
+#define HEADSOCKET_LOCK_SUFFIX(var, suffix) \
+  static const headsocket::detail::lock_profiler::site __lock_site##suffix(__FILE__, __LINE__, #var, \
+    std::is_same<std::remove_cv_t<decltype(var)>, headsocket::detail::semaphore>::value); \
+  headsocket::detail::profiled_lock<decltype(var)> __scope_lock##suffix(var, __lock_site##suffix);
+#else
+#define HEADSOCKET_LOCK_SUFFIX(var, suffix) std::lock_guard<decltype(var)> __scope_lock##suffix(var);
+#endif
+#define HEADSOCKET_LOCK_SUFFIX2(var, suffix) HEADSOCKET_LOCK_SUFFIX(var, suffix)
+#define HEADSOCKET_LOCK(var) HEADSOCKET_LOCK_SUFFIX2(var, __LINE__)
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-struct utils
+namespace headsocket {
+
+namespace detail {
+#if defined(HEADSOCKET_PLATFORM_WINDOWS)
+typedef SOCKET socket_type;
+static const int socket_error = SOCKET_ERROR;
+static const SOCKET invalid_socket = INVALID_SOCKET;
+static const int send_flags = 0;
+void close_socket(socket_type s) { shutdown(s, SD_BOTH); closesocket(s); }
+void set_socket_timeout(socket_type s, int seconds)
 {
-  static std::string base64_encode(const void *ptr, size_t length)
-  {
-    static const char *encoding_table = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-    static size_t mod_table[] = { 0, 2, 1 };
+  DWORD timeout = static_cast<DWORD>(seconds * 1000);
+  setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char *>(&timeout), sizeof(timeout));
+}
+void set_socket_blocking(socket_type s, bool blocking)
+{
+  u_long mode = blocking ? 0 : 1;
+  ioctlsocket(s, FIONBIO, &mode);
+}
+bool connect_in_progress() { return WSAGetLastError() == WSAEWOULDBLOCK; }
+int poll_sockets(pollfd *fds, size_t count, int timeoutMs) { return WSAPoll(fds, static_cast<ULONG>(count), timeoutMs); }
+#define HEADSOCKET_SPRINTF sprintf_s
+#elif defined(HEADSOCKET_PLATFORM_ANDROID) || defined(HEADSOCKET_PLATFORM_NIX)
+typedef int socket_type;
+static const int socket_error = -1;
+static const int invalid_socket = -1;
+#ifdef MSG_NOSIGNAL
+// Peer closing connection should fail the send, not kill the process with SIGPIPE
+static const int send_flags = MSG_NOSIGNAL;
+#else
+static const int send_flags = 0;
+#endif
+void close_socket(socket_type s) { shutdown(s, SHUT_RDWR); close(s); }
+void set_socket_timeout(socket_type s, int seconds)
+{
+  timeval timeout = { seconds, 0 };
+  setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char *>(&timeout), sizeof(timeout));
+}
+void set_socket_blocking(socket_type s, bool blocking)
+{
+  int flags = fcntl(s, F_GETFL, 0);
+  fcntl(s, F_SETFL, blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK));
+}
+bool connect_in_progress() { return errno == EINPROGRESS; }
+int poll_sockets(pollfd *fds, size_t count, int timeoutMs) { return poll(fds, static_cast<nfds_t>(count), timeoutMs); }
+#define HEADSOCKET_SPRINTF sprintf
+#endif
 
-    std::string result(4 * ((length + 2) / 3), '=');
+struct metrics_counters
+{
+  enum counter : size_t
+  {
+    accepts, handshakes_failed, connects, connect_failures, bytes_in, bytes_out, http_requests, clients, queued_bytes,
+    frames_in, frames_out = frames_in + 16, counter_count = frames_out + 16
+  };
+};
 
-    if (ptr && length)
-    {
-      const uint8_t *input = reinterpret_cast<const uint8_t *>(ptr);
+// Process-wide counters behind metrics::snapshot()
+struct metrics_registry : metrics_counters, thread_slot_registry<metrics_registry, int64_t, metrics_counters::counter_count>
+{
+  static void add(counter c, int64_t delta = 1) { thread_slot_registry::add(c, delta); }
 
-      for (size_t i = 0, j = 0, triplet = 0; i < length; triplet = 0)
-      {
-        for (size_t k = 0; k < 3; ++k)
-          triplet = (triplet << 8) | (i < length ? static_cast<uint8_t>(input[i++]) : 0);
+  static void add_frame(counter direction, opcode op) { add(static_cast<counter>(direction + (static_cast<size_t>(op) & 15))); }
+};
 
-        for (size_t k = 4; k--;)
-          result[j++] = encoding_table[(triplet >> k * 6) & 0x3F];
-      }
+// Monotonic nanoseconds, only differences make sense
+uint64_t timestamp()
+{
+  return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count());
+}
 
-      for (size_t i = 0; i < mod_table[length % 3]; i++)
-        result[result.length() - 1 - i] = '=';
-    }
+// Live counterpart of latency_histogram, any number of threads record into it without locks
+struct latency_recorder
+{
+  std::atomic<uint64_t> counts[latency_histogram::bucket_count];
+  std::atomic<uint64_t> sum = { 0 };
+  std::atomic<uint64_t> max = { 0 };
 
-    return result;
-  }
+  latency_recorder() { for (auto &count : counts) count = 0; }
 
-  static size_t xor32(uint32_t key, void *ptr, size_t length)
+  void record(uint64_t value)
   {
-    uint8_t *data = reinterpret_cast<uint8_t *>(ptr);
-    uint8_t *mask = reinterpret_cast<uint8_t *>(&key);
+    counts[latency_histogram::bucket(value)].fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(value, std::memory_order_relaxed);
 
-    for (size_t i = 0; i < length; ++i, ++data)
-      *data = (*data) ^ mask[i % 4];
-
-    return length;
+    uint64_t current = max.load(std::memory_order_relaxed);
+    while (value > current && !max.compare_exchange_weak(current, value, std::memory_order_relaxed)) { }
   }
 
-  static std::string url_encode(const std::string &str)
+  void snapshot(latency_histogram &histogram) const
   {
-    std::ostringstream result;
-    result.fill('0');
-    result << std::hex;
+    for (size_t i = 0; i < latency_histogram::bucket_count; ++i)
+      histogram.count += (histogram.counts[i] = counts[i].load(std::memory_order_relaxed));
 
-    for (std::string::const_iterator i = str.begin(), n = str.end(); i != n; ++i)
-    {
-      auto c = (*i);
+    histogram.sum = sum.load(std::memory_order_relaxed);
+    histogram.max = max.load(std::memory_order_relaxed);
+  }
+};
 
-      if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~')
-        result << c;
-      else
-        result << '%' << std::setw(2) << static_cast<int>(c);
-    }
+struct latency_recorders
+{
+  latency_recorder receive_to_callback;
+  latency_recorder push_to_wire;
 
-    return result.str();
+  latency_metrics snapshot() const
+  {
+    latency_metrics result;
+    receive_to_callback.snapshot(result.receive_to_callback);
+    push_to_wire.snapshot(result.push_to_wire);
+    return result;
   }
+};
 
-  static std::string url_decode(const std::string &str)
+#ifdef HEADSOCKET_TRACE
+#ifndef HEADSOCKET_TRACE_EVENTS
+#define HEADSOCKET_TRACE_EVENTS 4096
+#endif
+#ifndef HEADSOCKET_TRACE_RETIRED
+#define HEADSOCKET_TRACE_RETIRED 256
+#endif
+
+// Every thread owns a ring of 24 byte events, allocated on its first event while tracing, only the owner writes it
+// (relaxed stores, head published last). Rings of finished threads are kept, the oldest ones beyond a limit dropped.
+struct trace_registry
+{
+  enum event_type : uint64_t
   {
-    std::ostringstream result;
+    accept, handshake_begin, handshake_end, frame_in, callback_begin, callback_end, push, send_begin, send_end,
+    lock_wait, disconnect
+  };
 
-    for (size_t i = 0, S = str.length(); i < S; ++i)
-    {
-      auto c = str[i];
+  // Type in the top 8 bits of 'data', value (bytes or nanoseconds) in the rest
+  struct event
+  {
+    std::atomic<uint64_t> time;
+    std::atomic<uint64_t> id;
+    std::atomic<uint64_t> data;
+  };
 
-      if (c == '%')
-      {
-        char hexBuff[3] = { 0, 0, 0 };
-        hexBuff[0] = str[++i];
-        hexBuff[1] = str[++i];
+  struct ring
+  {
+    event events[HEADSOCKET_TRACE_EVENTS];
+    std::atomic<uint64_t> head = { 0 };
+    std::atomic<uint64_t> cleared = { 0 };
+    uint64_t tid = 0;
+    std::string name;
+  };
 
-        int value;
-        sscanf(hexBuff, "%x", &value);
-        result << static_cast<char>(value);
-      }
-      else if (c == '+')
-        result << ' ';
-      else
-        result << c;
-    }
+  struct thread_ring
+  {
+    std::string name;
+    ring *r = nullptr;
 
-    return result.str();
-  }
+    ~thread_ring()
+    {
+      if (r)
+        get().retire(r);
+    }
+  };
 
-  static uint16_t swap16bits(uint16_t x) { return ((x & 0x00FF) << 8) | ((x & 0xFF00) >> 8); }
+  std::atomic_bool running = { false };
+  std::mutex mutex;
+  std::vector<ring *> live;
+  std::deque<ring *> retired;
+  uint64_t nextTid = 1;
 
-  static uint32_t swap32bits(uint32_t x)
+  static trace_registry &get()
   {
-    return ((x & 0x000000FF) << 24) | ((x & 0x0000FF00) << 8) | ((x & 0x00FF0000) >> 8) | ((x & 0xFF000000) >> 24);
+    static trace_registry *registry = new trace_registry();
+    return *registry;
   }
 
-  static uint64_t swap64bits(uint64_t x)
+  static thread_ring &local()
   {
-    return
-      ((x & 0x00000000000000FFULL) << 56) | ((x & 0x000000000000FF00ULL) << 40) | ((x & 0x0000000000FF0000ULL) << 24) |
-      ((x & 0x00000000FF000000ULL) << 8) | ((x & 0x000000FF00000000ULL) >> 8) | ((x & 0x0000FF0000000000ULL) >> 24) |
-      ((x & 0x00FF000000000000ULL) >> 40) | ((x & 0xFF00000000000000ULL) >> 56);
+    static thread_local thread_ring t;
+    return t;
   }
 
-  static std::string trim(const std::string &str)
+  static void record(event_type type, uint64_t id, uint64_t value, uint64_t time = 0)
   {
-    size_t trimLeft = 0, trimRight = str.length() - 1;
+    trace_registry &registry = get();
 
-    while (trimLeft < str.length() && isspace(str[trimLeft]))
-      ++trimLeft;
+    if (!registry.running.load(std::memory_order_relaxed))
+      return;
 
-    while (trimRight < str.length() && isspace(str[trimRight]))
-      --trimRight;
+    thread_ring &t = local();
 
-    return (trimRight >= str.length() || trimLeft >= str.length() || trimRight < trimLeft)
-      ? std::string("")
-      : str.substr(trimLeft, trimRight - trimLeft + 1);
+    if (!t.r)
+      t.r = registry.create(t.name);
+
+    uint64_t head = t.r->head.load(std::memory_order_relaxed);
+    event &e = t.r->events[head % HEADSOCKET_TRACE_EVENTS];
+    e.time.store(time ? time : timestamp(), std::memory_order_relaxed);
+    e.id.store(id, std::memory_order_relaxed);
+    e.data.store((static_cast<uint64_t>(type) << 56) | (value & 0x00FFFFFFFFFFFFFFull), std::memory_order_relaxed);
+    t.r->head.store(head + 1, std::memory_order_release);
   }
 
-  static std::string cut_front(std::string &str, char delimiter = ' ', bool first = true, bool hungry = true)
+  static void set_name(const char *name)
   {
-    std::string result;
+    thread_ring &t = local();
+    t.name = name;
 
-    auto pos = first ? str.find(delimiter) : str.rfind(delimiter);
-    if (pos == std::string::npos)
+    if (t.r)
     {
-      if (hungry)
-      {
-        result = str;
-        str = "";
-      }
+      HEADSOCKET_LOCK(get().mutex);
+      t.r->name = name;
     }
-    else
+  }
+
+  ring *create(const std::string &name)
+  {
+    // Events are not initialized, only those below head are ever read
+    ring *r = new ring;
+    r->name = name;
+
+    HEADSOCKET_LOCK(mutex);
+    r->tid = nextTid++;
+    live.push_back(r);
+    return r;
+  }
+
+  void retire(ring *r)
+  {
+    HEADSOCKET_LOCK(mutex);
+    live.erase(std::find(live.begin(), live.end(), r));
+    retired.push_back(r);
+
+    if (retired.size() > HEADSOCKET_TRACE_RETIRED)
     {
-      result = str.substr(0, pos);
-      str = str.substr(pos + 1);
+      delete retired.front();
+      retired.pop_front();
     }
-
-    return result;
   }
 
-  static std::string cut_back(std::string &str, char delimiter = ' ', bool first = true, bool hungry = true)
+  // Events of live rings may be overwritten while copied, those are left out
+  template <typename F>
+  void for_each_event(F &&callback)
   {
-    std::string result;
+    HEADSOCKET_LOCK(mutex);
 
-    auto pos = first ? str.rfind(delimiter) : str.find(delimiter);
-    if (pos == std::string::npos)
+    auto visit = [&callback](const ring &r)
     {
-      if (hungry)
+      uint64_t end = r.head.load(std::memory_order_acquire);
+      uint64_t begin = end > HEADSOCKET_TRACE_EVENTS ? end - HEADSOCKET_TRACE_EVENTS : 0;
+      begin = begin > r.cleared ? begin : r.cleared.load();
+      std::vector<uint64_t> copy;
+      copy.reserve((end - begin) * 3);
+
+      for (uint64_t i = begin; i < end; ++i)
       {
-        result = str;
-        str = "";
+        const event &e = r.events[i % HEADSOCKET_TRACE_EVENTS];
+        copy.push_back(e.time.load(std::memory_order_relaxed));
+        copy.push_back(e.id.load(std::memory_order_relaxed));
+        copy.push_back(e.data.load(std::memory_order_relaxed));
       }
-    }
-    else
-    {
-      result = str.substr(pos + 1);
-      str = str.substr(0, pos);
-    }
 
-    return result;
-  }
-};
+      uint64_t overwritten = r.head.load(std::memory_order_acquire) + 1;
+      overwritten = overwritten > HEADSOCKET_TRACE_EVENTS ? overwritten - HEADSOCKET_TRACE_EVENTS : 0;
 
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+      for (uint64_t i = begin > overwritten ? begin : overwritten; i < end; ++i)
+      {
+        const uint64_t *e = copy.data() + (i - begin) * 3;
+        callback(r, e[0], e[1], static_cast<event_type>(e[2] >> 56), e[2] & 0x00FFFFFFFFFFFFFFull);
+      }
+    };
 
-struct critical_section
-{
-  mutable std::atomic_bool consumer_lock;
+    for (ring *r : retired)
+      visit(*r);
 
-  critical_section()
-  {
-    consumer_lock = false;
+    for (ring *r : live)
+      visit(*r);
   }
 
-  void lock() const { while (consumer_lock.exchange(true)); }
-  void unlock() const { consumer_lock = false; }
-};
+  void clear()
+  {
+    HEADSOCKET_LOCK(mutex);
 
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    for (ring *r : retired)
+      delete r;
 
-template <typename T, typename M = critical_section>
-struct lockable_value : M
-{
-  T value;
+    retired.clear();
 
-  T *operator->() { return &value; }
-  const T *operator->() const { return &value; }
+    // Live rings belong to their threads, readers just skip what was there before
+    for (ring *r : live)
+      r->cleared = r->head.load(std::memory_order_acquire);
+  }
 };
 
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-struct semaphore
+// Begin and end events around a scope
+struct trace_scope
 {
-  mutable std::atomic_size_t count;
-  mutable std::mutex mutex;
-  mutable std::condition_variable cv;
+  trace_registry::event_type type;
+  uint64_t id;
 
-  semaphore()
+  trace_scope(trace_registry::event_type t, uint64_t i, uint64_t value)
+    : type(t)
+    , id(i)
   {
-    count = 0;
+    trace_registry::record(type, id, value);
   }
 
-  void lock(size_t minCount = 0) const
-  {
-    std::unique_lock<std::mutex> lock(mutex);
-    cv.wait(lock, [&]()->bool { return count > minCount; });
-    lock.release();
-  }
+  ~trace_scope() { trace_registry::record(static_cast<trace_registry::event_type>(type + 1), id, 0); }
+};
 
-  void unlock()
-  {
-    mutex.unlock();
-  }
+#define HEADSOCKET_TRACE_EVENT(type, id, value) headsocket::detail::trace_registry::record(headsocket::detail::trace_registry::type, id, value);
+#define HEADSOCKET_TRACE_SCOPE_SUFFIX(type, id, value, suffix) headsocket::detail::trace_scope __trace_scope##suffix(headsocket::detail::trace_registry::type, id, value);
+#define HEADSOCKET_TRACE_SCOPE_SUFFIX2(type, id, value, suffix) HEADSOCKET_TRACE_SCOPE_SUFFIX(type, id, value, suffix)
+#define HEADSOCKET_TRACE_SCOPE(type, id, value) HEADSOCKET_TRACE_SCOPE_SUFFIX2(type, id, value, __LINE__)
+#else
+#define HEADSOCKET_TRACE_EVENT(type, id, value)
+#define HEADSOCKET_TRACE_SCOPE(type, id, value)
+#endif
 
-  void notify()
-  {
-    {
-      std::lock_guard<std::mutex> lock(mutex);
-      ++count;
-    }
+// Sends all bytes, 'more' hints that another send follows immediately, so both can share a packet
+bool send_all(socket_type s, const void *ptr, size_t length, bool more = false)
+{
+#ifdef MSG_MORE
+  int flags = send_flags | (more ? MSG_MORE : 0);
+#else
+  int flags = send_flags;
+#endif
 
-    cv.notify_one();
-  }
+  const char *cursor = static_cast<const char *>(ptr);
 
-  void consume() const
-  {
-    if (count)
-      --count;
-  }
-};
-
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-struct data_block_buffer
-{
-  std::vector<data_block> blocks;
-  std::vector<uint8_t> buffer;
-
-  data_block_buffer()
+  while (length)
   {
-    buffer.reserve(65536);
-  }
+    int result = send(s, cursor, static_cast<int>(length), flags);
 
-  data_block &block_begin(opcode op)
-  {
-    blocks.emplace_back(op, buffer.size());
-    return blocks.back();
-  }
+    if (!result || result == socket_error)
+      return false;
 
-  data_block &block_end()
-  {
-    blocks.back().is_completed = true;
-    return blocks.back();
+    metrics_registry::add(metrics_registry::bytes_out, result);
+    cursor += result;
+    length -= static_cast<size_t>(result);
   }
 
-  void block_remove()
-  {
-    if (blocks.empty())
-      return;
+  return true;
+}
 
-    buffer.resize(blocks.back().offset);
-    blocks.pop_back();
-  }
+// Sends two buffers with a single call, falls back to send_all for whatever a partial send left behind
+bool send_all(socket_type s, const void *head, size_t headLength, const void *body, size_t bodyLength)
+{
+#if defined(HEADSOCKET_PLATFORM_WINDOWS)
+  WSABUF buffers[2] = {
+    { static_cast<ULONG>(headLength), static_cast<CHAR *>(const_cast<void *>(head)) },
+    { static_cast<ULONG>(bodyLength), static_cast<CHAR *>(const_cast<void *>(body)) } };
 
-  void write(const void *ptr, size_t length)
-  {
-    if (!length)
-      return;
+  DWORD sent = 0;
+  if (WSASend(s, buffers, 2, &sent, 0, nullptr, nullptr) == socket_error || !sent)
+    return false;
 
-    buffer.resize(buffer.size() + length);
-    memcpy(buffer.data() + buffer.size() - length, reinterpret_cast<const char *>(ptr), length);
-    blocks.back().length += length;
-  }
+  size_t result = static_cast<size_t>(sent);
+#else
+  iovec buffers[2] = { { const_cast<void *>(head), headLength }, { const_cast<void *>(body), bodyLength } };
+  msghdr message = { };
+  message.msg_iov = buffers;
+  message.msg_iovlen = 2;
 
-  size_t read(void *ptr, size_t length)
-  {
-    if (!ptr || blocks.empty() || !blocks.front().is_completed)
-      return 0;
+  ssize_t sent = sendmsg(s, &message, send_flags);
+  if (sent <= 0)
+    return false;
 
-    data_block &db = blocks.front();
-    size_t result = db.length >= length ? length : db.length;
+  size_t result = static_cast<size_t>(sent);
+#endif
 
-    if (result)
-    {
-      memcpy(ptr, buffer.data() + db.offset, result);
-      buffer.erase(buffer.begin(), buffer.begin() + result);
-    }
+  metrics_registry::add(metrics_registry::bytes_out, static_cast<int64_t>(result));
 
-    if (!(db.length -= result))
-      blocks.erase(blocks.begin());
-    else
-      blocks.front().op = opcode::continuation;
+  if (result < headLength)
+    return send_all(s, static_cast<const char *>(head) + result, headLength - result, true) && send_all(s, body, bodyLength);
 
-    if (result) for (auto &block : blocks) if (block.offset > db.offset)
-          block.offset -= result;
+  result -= headLength;
+  return send_all(s, static_cast<const char *>(body) + result, bodyLength - result);
+}
+}
 
-    return result;
-  }
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-  size_t peek(opcode *op = nullptr) const
+//---------------------------------------------------------------------------------------------------------------------
+metrics metrics::snapshot()
+{
+  typedef detail::metrics_registry registry;
+  int64_t totals[registry::counter_count];
+  registry::get().sum(totals);
+
+  metrics result;
+  result.accepts = static_cast<uint64_t>(totals[registry::accepts]);
+  result.handshakes_failed = static_cast<uint64_t>(totals[registry::handshakes_failed]);
+  result.connects = static_cast<uint64_t>(totals[registry::connects]);
+  result.connect_failures = static_cast<uint64_t>(totals[registry::connect_failures]);
+  result.bytes_in = static_cast<uint64_t>(totals[registry::bytes_in]);
+  result.bytes_out = static_cast<uint64_t>(totals[registry::bytes_out]);
+  result.http_requests = static_cast<uint64_t>(totals[registry::http_requests]);
+  result.clients = totals[registry::clients];
+  result.queued_bytes = totals[registry::queued_bytes];
+
+  for (size_t i = 0; i < 16; ++i)
   {
-    if (blocks.empty() || !blocks.front().is_completed)
-      return 0;
-
-    if (op)
-      *op = blocks.front().op;
-
-    return blocks.front().length;
+    result.frames_in[i] = static_cast<uint64_t>(totals[registry::frames_in + i]);
+    result.frames_out[i] = static_cast<uint64_t>(totals[registry::frames_out + i]);
   }
-};
 
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+  return result;
+}
 
 //---------------------------------------------------------------------------------------------------------------------
-bool handshake_websocket(connection &conn)
+std::string metrics::prometheus() const
 {
-  std::string line, key;
+  std::string result;
 
-  while (conn.read_line(line))
+  auto metric = [&result](const char *name, const char *type, const char *help, int64_t value)
   {
-    if (line.empty())
-      break;
-
-    if (!memcmp(line.c_str(), "Sec-WebSocket-Key: ", 19))
-      key = line.substr(19);
-  }
-
-  if (key.empty())
-    return false;
+    result += "# HELP headsocket_" + std::string(name) + " " + help + "\n";
+    result += "# TYPE headsocket_" + std::string(name) + " " + type + "\n";
+    result += "headsocket_" + std::string(name) + " " + std::to_string(value) + "\n";
+  };
 
-  key += "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+  metric("accepts_total", "counter", "Accepted connections", static_cast<int64_t>(accepts));
+  metric("handshakes_failed_total", "counter", "Accepted connections rejected by handshake", static_cast<int64_t>(handshakes_failed));
+  metric("connects_total", "counter", "Outgoing connections established", static_cast<int64_t>(connects));
+  metric("connect_failures_total", "counter", "Outgoing connections failed", static_cast<int64_t>(connect_failures));
+  metric("received_bytes_total", "counter", "Bytes received from sockets", static_cast<int64_t>(bytes_in));
+  metric("sent_bytes_total", "counter", "Bytes sent to sockets", static_cast<int64_t>(bytes_out));
+  metric("http_requests_total", "counter", "HTTP requests parsed", static_cast<int64_t>(http_requests));
+  metric("clients", "gauge", "Open connections", clients);
+  metric("queued_bytes", "gauge", "Bytes pushed, but not written to sockets yet", queued_bytes);
+
+  static const std::pair<opcode, const char *> opcodes[] = {
+    { opcode::continuation, "continuation" }, { opcode::text, "text" }, { opcode::binary, "binary" },
+    { opcode::connection_close, "close" }, { opcode::ping, "ping" }, { opcode::pong, "pong" } };
+
+  for (int direction = 0; direction < 2; ++direction)
+  {
+    const char *name = direction ? "headsocket_sent_frames_total" : "headsocket_received_frames_total";
+    const uint64_t *frames = direction ? frames_out : frames_in;
 
-  detail::sha1 sha;
-  detail::sha1::digest8_t digest;
-  sha.process_bytes(key.c_str(), key.length());
+    result += std::string("# HELP ") + name + " WebSocket frames by opcode\n";
+    result += std::string("# TYPE ") + name + " counter\n";
 
-  std::string response = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: ";
-  response += detail::utils::base64_encode(sha.get_digest_bytes(digest), 20);
-  response += "\r\n\r\n";
+    for (auto &op : opcodes)
+      result += std::string(name) + "{opcode=\"" + op.second + "\"} " + std::to_string(frames[static_cast<size_t>(op.first)]) + "\n";
+  }
 
-  return conn.force_write(response.c_str(), response.length());
+  return result;
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-#ifdef HEADSOCKET_PLATFORM_WINDOWS
-void set_thread_name(const char *name)
+//---------------------------------------------------------------------------------------------------------------------
+size_t latency_histogram::bucket(uint64_t value)
 {
-#pragma pack(push,8)
-  typedef struct tagTHREADNAME_INFO
-  {
-    DWORD dwType;
-    LPCSTR szName;
-    DWORD dwThreadID;
-    DWORD dwFlags;
-  } THREADNAME_INFO;
-#pragma pack(pop)
-  THREADNAME_INFO info = { 0x1000, name, static_cast<DWORD>(-1), 0 };
+  if (value < 64)
+    return static_cast<size_t>(value);
 
-  __try
-  {
-    RaiseException(0x406D1388, 0, sizeof(info) / sizeof(ULONG_PTR), reinterpret_cast<ULONG_PTR *>(&info));
-  }
-  __except (EXCEPTION_EXECUTE_HANDLER)
-  {
+#if defined(_MSC_VER)
+  unsigned long msb;
+  if (_BitScanReverse(&msb, static_cast<unsigned long>(value >> 32)))
+    msb += 32;
+  else
+    _BitScanReverse(&msb, static_cast<unsigned long>(value));
+#else
+  unsigned msb = 63 - static_cast<unsigned>(__builtin_clzll(value));
+#endif
 
-  }
+  // Top 6 bits of the value pick one of 32 buckets within its power of two
+  size_t shift = msb - 5;
+  size_t index = (shift + 1) * 32 + static_cast<size_t>(value >> shift) - 32;
+  return index < bucket_count ? index : bucket_count - 1;
 }
-#else
-void set_thread_name(const char *name)
+
+//---------------------------------------------------------------------------------------------------------------------
+uint64_t latency_histogram::bucket_max(size_t index)
 {
+  if (index < 64)
+    return index;
 
+  size_t shift = index / 32 - 1;
+  return ((33 + static_cast<uint64_t>(index % 32)) << shift) - 1;
 }
-#endif
 
-} // namespace detail;
+//---------------------------------------------------------------------------------------------------------------------
+uint64_t latency_histogram::percentile(double p) const
+{
+  if (!count)
+    return 0;
 
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+  double exact = static_cast<double>(count) * p / 100.0;
+  uint64_t rank = static_cast<uint64_t>(exact);
+  rank += rank < exact ? 1 : 0;
+  rank = rank < 1 ? 1 : (rank > count ? count : rank);
 
-namespace detail {
-  
-struct connection_impl
+  uint64_t seen = 0;
+
+  for (size_t i = 0; i < bucket_count; ++i)
+    if ((seen += counts[i]) >= rank)
+      return bucket_max(i) < max ? bucket_max(i) : max;
+
+  return max;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+std::string latency_metrics::prometheus() const
 {
-  detail::socket_type socket = detail::invalid_socket;
-  sockaddr_in from;
-  size_t id = 0;
+  std::string result;
 
-  void assign(const connection_impl &impl)
+  auto seconds = [](uint64_t nanoseconds)
   {
-    socket = impl.socket;
-    from = impl.from;
-    id = impl.id;
-  }
+    char buff[32];
+    HEADSOCKET_SPRINTF(buff, "%.9f", static_cast<double>(nanoseconds) / 1e9);
+    return std::string(buff);
+  };
 
-  void close()
+  auto summary = [&result, &seconds](const char *name, const char *help, const latency_histogram &histogram)
   {
-    if (socket != detail::invalid_socket)
-    {
-      detail::close_socket(socket);
-      socket = detail::invalid_socket;
-    }
-  }
-};
+    std::string metric = "headsocket_" + std::string(name) + "_seconds";
+    result += "# HELP " + metric + " " + help + "\n";
+    result += "# TYPE " + metric + " summary\n";
+    result += metric + "{quantile=\"0.5\"} " + seconds(histogram.p50()) + "\n";
+    result += metric + "{quantile=\"0.99\"} " + seconds(histogram.p99()) + "\n";
+    result += metric + "{quantile=\"0.999\"} " + seconds(histogram.p999()) + "\n";
+    result += metric + "_sum " + seconds(histogram.sum) + "\n";
+    result += metric + "_count " + std::to_string(histogram.count) + "\n";
+  };
 
+  summary("receive_to_callback", "From recv() returning a message to its callback", receive_to_callback);
+  summary("push_to_wire", "From push() to send() returning the last bytes of a message", push_to_wire);
+  return result;
 }
 
-//---------------------------------------------------------------------------------------------------------------------
-connection::connection(const detail::connection_impl &impl)
-  : _p(std::make_unique<detail::connection_impl>())
-{
-  _p->assign(impl);
-}
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+#ifdef HEADSOCKET_TRACE
 //---------------------------------------------------------------------------------------------------------------------
-connection::~connection()
-{
-  
-}
+void trace::start() { detail::trace_registry::get().running = true; }
 
 //---------------------------------------------------------------------------------------------------------------------
-bool connection::is_valid() const { return _p->socket != detail::invalid_socket; }
+void trace::stop() { detail::trace_registry::get().running = false; }
 
 //---------------------------------------------------------------------------------------------------------------------
-size_t connection::id() const { return _p->id; }
+bool trace::is_running() { return detail::trace_registry::get().running; }
 
 //---------------------------------------------------------------------------------------------------------------------
-size_t connection::write(const void *ptr, size_t length)
-{
-  if (!is_valid())
-    return detail::socket_error;
-
-  if (!ptr || !length)
-    return 0;
-
-  int result = send(_p->socket, static_cast<const char *>(ptr), static_cast<int>(length), 0);
-
-  if (!result || result == detail::socket_error)
-    return 0;
-
-  return static_cast<size_t>(result);
-}
+void trace::clear() { detail::trace_registry::get().clear(); }
 
 //---------------------------------------------------------------------------------------------------------------------
-bool connection::force_write(const void *ptr, size_t length)
+std::string trace::chrome_json()
 {
-  if (!is_valid())
-    return false;
+  typedef detail::trace_registry registry;
 
-  if (!ptr)
-    return true;
+  static const struct { const char *name; const char *phase; const char *value; } events[] = {
+    { "accept", "i", nullptr }, { "handshake", "B", nullptr }, { "handshake", "E", nullptr },
+    { "frame in", "i", "bytes" }, { "callback", "B", "bytes" }, { "callback", "E", nullptr }, { "push", "i", "bytes" },
+    { "send", "B", "bytes" }, { "send", "E", nullptr }, { "lock wait", "X", nullptr }, { "disconnect", "i", nullptr } };
 
-  const char *chPtr = static_cast<const char *>(ptr);
+  std::string result = "{\"traceEvents\":[";
+  const registry::ring *named = nullptr;
+  char buff[256];
 
-  while (length)
+  registry::get().for_each_event([&](const registry::ring &r, uint64_t time, uint64_t id, registry::event_type type, uint64_t value)
   {
-    int result = send(_p->socket, chPtr, static_cast<int>(length), 0);
+    // Events come ring by ring, thread name goes first
+    if (named != &r)
+    {
+      std::string name;
+
+      for (char ch : r.name.empty() ? std::string("thread") : r.name)
+        if (ch == '"' || ch == '\\')
+          (name += '\\') += ch;
+        else if (static_cast<unsigned char>(ch) >= 0x20)
+          name += ch;
+
+      HEADSOCKET_SPRINTF(buff, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%llu,\"args\":{\"name\":\"",
+        static_cast<unsigned long long>(r.tid));
+      result += (named ? ",\n" : "\n") + std::string(buff) + name + "\"}}";
+      named = &r;
+    }
 
-    if (!result || result == detail::socket_error)
-      return false;
+    auto &e = events[type];
+    HEADSOCKET_SPRINTF(buff, ",\n{\"name\":\"%s\",\"cat\":\"headsocket\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":1,\"tid\":%llu",
+      e.name, e.phase, time / 1e3, static_cast<unsigned long long>(r.tid));
+    result += buff;
+
+    if (type == registry::lock_wait)
+      HEADSOCKET_SPRINTF(buff, ",\"dur\":%.3f,\"args\":{\"lock\":\"0x%llx\"}}", value / 1e3, static_cast<unsigned long long>(id));
+    else if (e.value)
+      HEADSOCKET_SPRINTF(buff, ",\"args\":{\"client\":%llu,\"%s\":%llu}}", static_cast<unsigned long long>(id), e.value,
+        static_cast<unsigned long long>(value));
+    else if (*e.phase != 'E')
+      HEADSOCKET_SPRINTF(buff, ",\"args\":{\"client\":%llu}}", static_cast<unsigned long long>(id));
+    else
+      HEADSOCKET_SPRINTF(buff, "}");
 
-    length -= static_cast<size_t>(result);
-    chPtr += result;
-  }
+    result += buff;
+  });
 
-  return true;
+  return result + "\n],\"displayTimeUnit\":\"ns\"}\n";
 }
+#else
+void trace::start() { }
+void trace::stop() { }
+bool trace::is_running() { return false; }
+void trace::clear() { }
+std::string trace::chrome_json() { return "{\"traceEvents\":[]}\n"; }
+#endif
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 //---------------------------------------------------------------------------------------------------------------------
-size_t connection::read(void *ptr, size_t length)
+lock_profile lock_profile::snapshot()
 {
-  if (!is_valid())
-    return detail::socket_error;
-
-  if (!ptr || !length)
-    return 0;
+  lock_profile result;
 
-  int result = recv(_p->socket, static_cast<char *>(ptr), static_cast<int>(length), 0);
-
-  if (!result || result == detail::socket_error)
-    return 0;
+#ifdef HEADSOCKET_LOCK_PROFILE
+  typedef detail::lock_profiler profiler;
+  profiler &p = profiler::get();
 
-  return static_cast<size_t>(result);
-}
-
-//---------------------------------------------------------------------------------------------------------------------
-bool connection::force_read(void *ptr, size_t length)
-{
-  if (!is_valid())
-    return false;
+  std::vector<uint64_t> totals(HEADSOCKET_LOCK_SITES * profiler::counter_count);
+  p.sum(totals.data());
 
-  if (!ptr)
-    return true;
+  std::lock_guard<std::mutex> lock(p.mutex);
 
-  char *chPtr = static_cast<char *>(ptr);
+  // Templates instantiate one site per type, those with the same file and line add up
+  std::map<std::pair<std::string, int>, size_t> merged;
 
-  while (length)
+  for (size_t i = 0; i < p.sites.size() && i < HEADSOCKET_LOCK_SITES; ++i)
   {
-    int result = recv(_p->socket, chPtr, static_cast<int>(length), 0);
+    const profiler::site &s = *p.sites[i];
+    auto it = merged.emplace(std::make_pair(std::string(s.file), s.line), result.sites.size()).first;
 
-    if (!result || result == detail::socket_error)
-      return false;
+    if (it->second == result.sites.size())
+    {
+      result.sites.emplace_back();
+      result.sites.back().file = s.file;
+      result.sites.back().line = s.line;
+      result.sites.back().lock = s.lock;
+      result.sites.back().signal = s.signal;
+    }
 
-    length -= static_cast<size_t>(result);
-    chPtr += result;
+    const uint64_t *row = totals.data() + i * profiler::counter_count;
+    site &target = result.sites[it->second];
+    target.acquisitions += row[profiler::acquisitions];
+    target.contended += row[profiler::contended];
+    target.wait_ns += row[profiler::wait];
+    target.hold_ns += row[profiler::hold];
   }
 
-  return true;
+  std::stable_sort(result.sites.begin(), result.sites.end(), [](const site &a, const site &b) { return a.wait_ns > b.wait_ns; });
+#endif
+
+  return result;
 }
 
 //---------------------------------------------------------------------------------------------------------------------
-bool connection::read_line(std::string &output)
+std::string lock_profile::report() const
 {
-  if (!is_valid())
-    return false;
+  char buff[512];
+  HEADSOCKET_SPRINTF(buff, "%-28s %-28s %12s %10s %12s %12s %12s %12s\n", "site", "lock", "acquired", "contended",
+    "wait ms", "ns/wait", "hold ms", "ns/hold");
 
-  output = "";
+  std::string result = buff;
 
-  while (true)
+  for (auto &s : sites)
   {
-    char ch;
-    int r = recv(_p->socket, &ch, 1, 0);
+    if (!s.acquisitions)
+      continue;
 
-    if (!r || r == detail::socket_error)
-      return false;
+    size_t slash = s.file.find_last_of("/\\");
+    std::string where = (slash == std::string::npos ? s.file : s.file.substr(slash + 1)) + ":" + std::to_string(s.line);
 
-    if (ch == '\n')
-      break;
-    else if (ch != '\r')
-      output += ch;
+    HEADSOCKET_SPRINTF(buff, "%-28s %-28s %12llu %9.1f%% %12.3f %12.0f %12.3f %12.0f%s\n", where.c_str(), s.lock.c_str(),
+      static_cast<unsigned long long>(s.acquisitions), s.contended * 100.0 / s.acquisitions, s.wait_ns / 1e6,
+      s.contended ? static_cast<double>(s.wait_ns) / s.contended : 0.0, s.hold_ns / 1e6,
+      static_cast<double>(s.hold_ns) / s.acquisitions, s.signal ? "  (wait includes idle)" : "");
+
+    result += buff;
   }
 
-  return true;
+  return result;
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 namespace detail {
 
-struct basic_tcp_client_ref
+struct cpu_features
 {
-  size_t refCount = 0;
-  ptr<basic_tcp_client> client;
+  bool ssse3 = false;
+  bool avx2 = false;
+  bool sha = false;
 
-  basic_tcp_client_ref(ptr<basic_tcp_client> c)
-    : client(c)
+  cpu_features()
   {
-  
+#if defined(HEADSOCKET_X86_DISPATCH)
+    unsigned basic[4], extended[4] = { };
+    cpuid(0, basic);
+
+    if (basic[0] >= 7)
+      cpuid(7, extended);
+
+    cpuid(1, basic);
+
+    // Leaf 1 ECX: SSSE3 (9), SSE4.1 (19), OSXSAVE (27), AVX (28); leaf 7 EBX: AVX2 (5), SHA (29)
+    bool sse41 = (basic[2] & (1u << 19)) != 0;
+    bool ymmState = (basic[2] & (1u << 27)) && (basic[2] & (1u << 28)) && (xgetbv() & 6) == 6;
+
+    ssse3 = (basic[2] & (1u << 9)) != 0;
+    avx2 = ymmState && (extended[1] & (1u << 5));
+    sha = ssse3 && sse41 && (extended[1] & (1u << 29));
+#endif
   }
-};
 
-struct basic_tcp_server_impl
-{
-  std::atomic_bool isRunning;
-  std::atomic_bool disconnectThreadQuit;
-  sockaddr_in local;
-  detail::lockable_value<std::vector<basic_tcp_client_ref>> connections;
-  detail::semaphore disconnectSemaphore;
-  int port = 0;
-  detail::socket_type serverSocket = invalid_socket;
-  std::unique_ptr<std::thread> acceptThread;
-  std::unique_ptr<std::thread> disconnectThread;
-  id_t nextClientID = 1;
+  static const cpu_features &get()
+  {
+    static const cpu_features features;
+    return features;
+  }
 
-  basic_tcp_server_impl()
+#if defined(HEADSOCKET_X86_DISPATCH)
+private:
+  static void cpuid(unsigned leaf, unsigned regs[4])
   {
-    isRunning = false;
-    disconnectThreadQuit = false;
+#if defined(_MSC_VER)
+    __cpuidex(reinterpret_cast<int *>(regs), static_cast<int>(leaf), 0);
+#else
+    __cpuid_count(leaf, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+  }
+
+  static uint64_t xgetbv()
+  {
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    unsigned lo, hi;
+    __asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return (static_cast<uint64_t>(hi) << 32) | lo;
+#endif
   }
+#endif
 };
 
-}
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+class sha1
+{
+public:
+  typedef uint32_t digest32_t[5];
+  typedef uint8_t digest8_t[20];
+
+  inline static uint32_t rotate_left(uint32_t value, size_t count) { return (value << count) ^ (value >> (32 - count)); }
+
+  sha1()
+  {
+    _digest[0] = 0x67452301;
+    _digest[1] = 0xEFCDAB89;
+    _digest[2] = 0x98BADCFE;
+    _digest[3] = 0x10325476;
+    _digest[4] = 0xC3D2E1F0;
+  }
+
+  ~sha1()
+  {
+
+  }
+
+  void process_byte(uint8_t octet) { process_bytes(&octet, 1); }
+
+  void process_block(const void *start, const void *end)
+  {
+    process_bytes(start, static_cast<const uint8_t *>(end) - static_cast<const uint8_t *>(start));
+  }
+
+  // Whole blocks are hashed straight from 'data', only the tail is buffered
+  void process_bytes(const void *data, size_t len)
+  {
+    const uint8_t *input = static_cast<const uint8_t *>(data);
+    _byte_count += len;
+
+    if (_block_byte_index)
+    {
+      size_t toCopy = 64 - _block_byte_index < len ? 64 - _block_byte_index : len;
+      memcpy(_block + _block_byte_index, input, toCopy);
+      _block_byte_index += toCopy;
+      input += toCopy;
+      len -= toCopy;
+
+      if (_block_byte_index < 64)
+        return;
+
+      compress(_digest, _block, 1);
+      _block_byte_index = 0;
+    }
+
+    if (len >= 64)
+    {
+      compress(_digest, input, len / 64);
+      input += len & ~static_cast<size_t>(63);
+      len &= 63;
+    }
+
+    memcpy(_block, input, len);
+    _block_byte_index = len;
+  }
+
+  const uint32_t *get_digest(digest32_t digest)
+  {
+    uint64_t bitCount = static_cast<uint64_t>(_byte_count) * 8;
+
+    // Padding and length go into one or two final blocks
+    uint8_t tail[128] = { };
+    memcpy(tail, _block, _block_byte_index);
+    tail[_block_byte_index] = 0x80;
+
+    size_t tailLength = _block_byte_index < 56 ? 64 : 128;
+
+    for (size_t i = 0; i < 8; ++i)
+      tail[tailLength - 1 - i] = static_cast<uint8_t>(bitCount >> (i * 8));
+
+    compress(_digest, tail, tailLength / 64);
+    _block_byte_index = 0;
+
+    memcpy(digest, _digest, 5 * sizeof(uint32_t));
+    return digest;
+  }
+
+  const uint8_t *get_digest_bytes(digest8_t digest)
+  {
+    digest32_t d32;
+    get_digest(d32);
+
+    for (size_t i = 0; i < 20; ++i)
+      digest[i] = static_cast<uint8_t>(d32[i >> 2] >> (24 - (i & 3) * 8));
+
+    return digest;
+  }
+
+  // Hashes 'blocks' 64 byte blocks with the fastest implementation this CPU supports
+  static void compress(uint32_t state[5], const uint8_t *data, size_t blocks)
+  {
+#if defined(HEADSOCKET_X86_DISPATCH)
+    if (cpu_features::get().sha)
+    {
+      compress_sha_ni(state, data, blocks);
+      return;
+    }
+#elif defined(HEADSOCKET_SHA_ARM)
+    compress_arm(state, data, blocks);
+    return;
+#endif
+
+    compress_generic(state, data, blocks);
+  }
+
+  static void compress_generic(uint32_t state[5], const uint8_t *data, size_t blocks)
+  {
+    for (; blocks--; data += 64)
+    {
+      uint32_t w[16];
+
+      for (size_t i = 0; i < 16; ++i)
+        w[i] = (uint32_t(data[i * 4]) << 24) | (uint32_t(data[i * 4 + 1]) << 16) | (uint32_t(data[i * 4 + 2]) << 8) | data[i * 4 + 3];
+
+      uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+
+      // Message schedule lives in a 16 word ring, variables rotate their roles instead of being shifted
+#define HEADSOCKET_SHA1_W(i) ((i) < 16 ? w[(i) & 15] : (w[(i) & 15] = rotate_left(w[((i) + 13) & 15] ^ w[((i) + 8) & 15] ^ w[((i) + 2) & 15] ^ w[(i) & 15], 1)))
+#define HEADSOCKET_SHA1_ROUND(a, b, c, d, e, f, k, i) e += rotate_left(a, 5) + (f) + (k) + HEADSOCKET_SHA1_W(i); b = rotate_left(b, 30);
+#define HEADSOCKET_SHA1_R0(a, b, c, d, e, i) HEADSOCKET_SHA1_ROUND(a, b, c, d, e, d ^ (b & (c ^ d)), 0x5A827999, i)
+#define HEADSOCKET_SHA1_R1(a, b, c, d, e, i) HEADSOCKET_SHA1_ROUND(a, b, c, d, e, b ^ c ^ d, 0x6ED9EBA1, i)
+#define HEADSOCKET_SHA1_R2(a, b, c, d, e, i) HEADSOCKET_SHA1_ROUND(a, b, c, d, e, (b & c) | (d & (b | c)), 0x8F1BBCDC, i)
+#define HEADSOCKET_SHA1_R3(a, b, c, d, e, i) HEADSOCKET_SHA1_ROUND(a, b, c, d, e, b ^ c ^ d, 0xCA62C1D6, i)
+#define HEADSOCKET_SHA1_R5(R, i) R(a, b, c, d, e, i) R(e, a, b, c, d, i + 1) R(d, e, a, b, c, i + 2) R(c, d, e, a, b, i + 3) R(b, c, d, e, a, i + 4)
+
+      HEADSOCKET_SHA1_R5(HEADSOCKET_SHA1_R0, 0) HEADSOCKET_SHA1_R5(HEADSOCKET_SHA1_R0, 5)
+      HEADSOCKET_SHA1_R5(HEADSOCKET_SHA1_R0, 10) HEADSOCKET_SHA1_R5(HEADSOCKET_SHA1_R0, 15)
+      HEADSOCKET_SHA1_R5(HEADSOCKET_SHA1_R1, 20) HEADSOCKET_SHA1_R5(HEADSOCKET_SHA1_R1, 25)
+      HEADSOCKET_SHA1_R5(HEADSOCKET_SHA1_R1, 30) HEADSOCKET_SHA1_R5(HEADSOCKET_SHA1_R1, 35)
+      HEADSOCKET_SHA1_R5(HEADSOCKET_SHA1_R2, 40) HEADSOCKET_SHA1_R5(HEADSOCKET_SHA1_R2, 45)
+      HEADSOCKET_SHA1_R5(HEADSOCKET_SHA1_R2, 50) HEADSOCKET_SHA1_R5(HEADSOCKET_SHA1_R2, 55)
+      HEADSOCKET_SHA1_R5(HEADSOCKET_SHA1_R3, 60) HEADSOCKET_SHA1_R5(HEADSOCKET_SHA1_R3, 65)
+      HEADSOCKET_SHA1_R5(HEADSOCKET_SHA1_R3, 70) HEADSOCKET_SHA1_R5(HEADSOCKET_SHA1_R3, 75)
+
+#undef HEADSOCKET_SHA1_R5
+#undef HEADSOCKET_SHA1_R3
+#undef HEADSOCKET_SHA1_R2
+#undef HEADSOCKET_SHA1_R1
+#undef HEADSOCKET_SHA1_R0
+#undef HEADSOCKET_SHA1_ROUND
+#undef HEADSOCKET_SHA1_W
+
+      state[0] += a;
+      state[1] += b;
+      state[2] += c;
+      state[3] += d;
+      state[4] += e;
+    }
+  }
+
+#if defined(HEADSOCKET_X86_DISPATCH)
+  // Four rounds per instruction, message schedule words are expanded four at a time as well
+  HEADSOCKET_TARGET("sha,ssse3,sse4.1") static void compress_sha_ni(uint32_t state[5], const uint8_t *data, size_t blocks)
+  {
+    const __m128i byteSwap = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(state)), 0x1B);
+    __m128i e0 = _mm_set_epi32(static_cast<int>(state[4]), 0, 0, 0);
+
+    for (; blocks--; data += 64)
+    {
+      __m128i abcdSaved = abcd, e0Saved = e0, previous = abcd, msg[4];
+
+      for (int g = 0; g < 20; ++g)
+      {
+        __m128i &w = msg[g & 3];
+
+        if (g < 4)
+          w = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + g * 16)), byteSwap);
+
+        __m128i e = g ? _mm_sha1nexte_epu32(previous, w) : _mm_add_epi32(e0, w);
+        previous = abcd;
+
+        switch (g / 5)
+        {
+        case 0: abcd = _mm_sha1rnds4_epu32(abcd, e, 0); break;
+        case 1: abcd = _mm_sha1rnds4_epu32(abcd, e, 1); break;
+        case 2: abcd = _mm_sha1rnds4_epu32(abcd, e, 2); break;
+        default: abcd = _mm_sha1rnds4_epu32(abcd, e, 3); break;
+        }
+
+        if (g >= 3 && g <= 18) msg[(g + 1) & 3] = _mm_sha1msg2_epu32(msg[(g + 1) & 3], w);
+        if (g >= 1 && g <= 16) msg[(g - 1) & 3] = _mm_sha1msg1_epu32(msg[(g - 1) & 3], w);
+        if (g >= 2 && g <= 17) msg[(g - 2) & 3] = _mm_xor_si128(msg[(g - 2) & 3], w);
+      }
+
+      e0 = _mm_sha1nexte_epu32(previous, e0Saved);
+      abcd = _mm_add_epi32(abcd, abcdSaved);
+    }
+
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(state), _mm_shuffle_epi32(abcd, 0x1B));
+    state[4] = static_cast<uint32_t>(_mm_extract_epi32(e0, 3));
+  }
+#endif
+
+#if defined(HEADSOCKET_SHA_ARM)
+  static void compress_arm(uint32_t state[5], const uint8_t *data, size_t blocks)
+  {
+    static const uint32_t k[] = { 0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6 };
+    uint32x4_t abcd = vld1q_u32(state);
+    uint32_t e0 = state[4];
+
+    for (; blocks--; data += 64)
+    {
+      uint32x4_t abcdSaved = abcd, msg[4];
+      uint32_t e = e0;
+
+      for (int i = 0; i < 4; ++i)
+        msg[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + i * 16)));
+
+      for (int g = 0; g < 20; ++g)
+      {
+        uint32x4_t wk = vaddq_u32(msg[g & 3], vdupq_n_u32(k[g / 5]));
+        uint32_t nextE = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+
+        switch (g / 5)
+        {
+        case 0: abcd = vsha1cq_u32(abcd, e, wk); break;
+        case 2: abcd = vsha1mq_u32(abcd, e, wk); break;
+        default: abcd = vsha1pq_u32(abcd, e, wk); break;
+        }
+
+        e = nextE;
+
+        if (g < 16)
+          msg[g & 3] = vsha1su1q_u32(vsha1su0q_u32(msg[g & 3], msg[(g + 1) & 3], msg[(g + 2) & 3]), msg[(g + 3) & 3]);
+      }
+
+      abcd = vaddq_u32(abcd, abcdSaved);
+      e0 += e;
+    }
+
+    vst1q_u32(state, abcd);
+    state[4] = e0;
+  }
+#endif
+
+private:
+  digest32_t _digest;
+  uint8_t _block[64];
+  size_t _block_byte_index = 0;
+  size_t _byte_count = 0;
+};
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-//---------------------------------------------------------------------------------------------------------------------
-basic_tcp_server::basic_tcp_server(int port)
-  : _p(std::make_unique<detail::basic_tcp_server_impl>())
+struct utils
 {
-#ifdef HEADSOCKET_PLATFORM_WINDOWS
-  WSADATA wsaData;
-  WSAStartup(0x101, &wsaData);
+  // Alphabet and its reverse mapping (or -1)
+  struct base64_tables
+  {
+    char encode[64];
+    int8_t decode[256];
+
+    base64_tables()
+    {
+      memcpy(encode, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/", 64);
+      memset(decode, -1, sizeof(decode));
+
+      for (int i = 0; i < 64; ++i)
+        decode[static_cast<uint8_t>(encode[i])] = static_cast<int8_t>(i);
+    }
+
+    static const base64_tables &get()
+    {
+      static const base64_tables tables;
+      return tables;
+    }
+  };
+
+  static const size_t base64_invalid = static_cast<size_t>(-1);
+
+  static size_t base64_encoded_length(size_t length) { return 4 * ((length + 2) / 3); }
+  static size_t base64_decoded_length(size_t length) { return 3 * ((length + 3) / 4); }
+
+  // Writes exactly base64_encoded_length('length') characters (padded with '=') into 'output', returns that length
+  static size_t base64_encode(const void *ptr, size_t length, char *output)
+  {
+    const char *table = base64_tables::get().encode;
+    const uint8_t *input = reinterpret_cast<const uint8_t *>(ptr);
+    char *cursor = output;
+    size_t i = 0;
+
+#if defined(HEADSOCKET_X86_DISPATCH)
+    if (cpu_features::get().avx2)
+      i = base64_encode_avx2(input, length, cursor);
+
+    if (cpu_features::get().ssse3)
+      i += base64_encode_ssse3(input + i, length - i, cursor + i / 3 * 4);
+
+    cursor += i / 3 * 4;
 #endif
 
-  _p->local.sin_family = AF_INET;
-  _p->local.sin_addr.s_addr = INADDR_ANY;
-  _p->local.sin_port = htons(static_cast<unsigned short>(port));
+    for (; i + 3 <= length; i += 3, cursor += 4)
+    {
+      uint32_t triplet = (uint32_t(input[i]) << 16) | (uint32_t(input[i + 1]) << 8) | input[i + 2];
+      cursor[0] = table[triplet >> 18];
+      cursor[1] = table[(triplet >> 12) & 63];
+      cursor[2] = table[(triplet >> 6) & 63];
+      cursor[3] = table[triplet & 63];
+    }
 
-  _p->serverSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if (i < length)
+    {
+      uint32_t triplet = (uint32_t(input[i]) << 16) | (i + 1 < length ? uint32_t(input[i + 1]) << 8 : 0);
+      cursor[0] = table[triplet >> 18];
+      cursor[1] = table[(triplet >> 12) & 63];
+      cursor[2] = i + 1 < length ? table[(triplet >> 6) & 63] : '=';
+      cursor[3] = '=';
+      cursor += 4;
+    }
 
-  if (bind(_p->serverSocket, reinterpret_cast<sockaddr *>(&_p->local), sizeof(_p->local)) != 0)
-    return;
+    return cursor - output;
+  }
+
+  static std::string base64_encode(const void *ptr, size_t length)
+  {
+    std::string result(base64_encoded_length(length), 0);
+
+    if (length)
+      base64_encode(ptr, length, &result[0]);
+
+    return result;
+  }
+
+  // Writes at most base64_decoded_length('length') bytes into 'output', returns number of bytes written or
+  // base64_invalid. Padding is optional, but must not appear anywhere but at the very end.
+  static size_t base64_decode(const char *input, size_t length, void *output)
+  {
+    const int8_t *table = base64_tables::get().decode;
+    uint8_t *cursor = reinterpret_cast<uint8_t *>(output);
+    size_t i = 0;
+
+#if defined(HEADSOCKET_X86_DISPATCH)
+    // Vector loops stop at the first block containing padding or invalid characters, the rest is left to scalar code
+    if (cpu_features::get().avx2)
+      i = base64_decode_avx2(input, length, cursor);
+
+    if (cpu_features::get().ssse3)
+      i += base64_decode_ssse3(input + i, length - i, cursor + i / 4 * 3);
+
+    cursor += i / 4 * 3;
+#endif
+
+    for (; i + 4 <= length; i += 4)
+    {
+      int8_t a = table[static_cast<uint8_t>(input[i])], b = table[static_cast<uint8_t>(input[i + 1])];
+      int8_t c = table[static_cast<uint8_t>(input[i + 2])], d = table[static_cast<uint8_t>(input[i + 3])];
+
+      if ((a | b | c | d) >= 0)
+      {
+        uint32_t triplet = (uint32_t(a) << 18) | (uint32_t(b) << 12) | (uint32_t(c) << 6) | uint32_t(d);
+        cursor[0] = static_cast<uint8_t>(triplet >> 16);
+        cursor[1] = static_cast<uint8_t>(triplet >> 8);
+        cursor[2] = static_cast<uint8_t>(triplet);
+        cursor += 3;
+        continue;
+      }
+
+      if (i + 4 != length || (a | b) < 0 || input[i + 3] != '=' || (c < 0 && input[i + 2] != '='))
+        return base64_invalid;
+
+      *cursor++ = static_cast<uint8_t>((a << 2) | (b >> 4));
+
+      if (c >= 0)
+        *cursor++ = static_cast<uint8_t>((b << 4) | (c >> 2));
+
+      return cursor - reinterpret_cast<uint8_t *>(output);
+    }
+
+    // Unpadded tail
+    if (i + 1 == length)
+      return base64_invalid;
+
+    if (i + 2 <= length)
+    {
+      int8_t a = table[static_cast<uint8_t>(input[i])], b = table[static_cast<uint8_t>(input[i + 1])];
+      int8_t c = i + 3 == length ? table[static_cast<uint8_t>(input[i + 2])] : 0;
+
+      if ((a | b | c) < 0)
+        return base64_invalid;
+
+      *cursor++ = static_cast<uint8_t>((a << 2) | (b >> 4));
+
+      if (i + 3 == length)
+        *cursor++ = static_cast<uint8_t>((b << 4) | (c >> 2));
+    }
+
+    return cursor - reinterpret_cast<uint8_t *>(output);
+  }
+
+  // Returns false (leaving 'result' untouched) on invalid input
+  static bool base64_decode(const std::string_view &str, std::string &result)
+  {
+    std::string decoded(base64_decoded_length(str.length()), 0);
+    size_t length = str.empty() ? 0 : base64_decode(str.data(), str.length(), &decoded[0]);
+
+    if (length == base64_invalid)
+      return false;
+
+    decoded.resize(length);
+    result.swap(decoded);
+    return true;
+  }
+
+#if defined(HEADSOCKET_X86_DISPATCH)
+  // 12 bytes are spread into 16 lanes of 6 bits each, which are then offset into the alphabet by a small lookup
+  // (W. Mula, D. Lemire: "Faster Base64 Encoding and Decoding Using AVX2 Instructions")
+  HEADSOCKET_TARGET("ssse3") static size_t base64_encode_ssse3(const uint8_t *input, size_t length, char *output)
+  {
+    const __m128i spread = _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+    const __m128i offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    size_t i = 0;
+
+    // Loads 16 bytes, but only consumes 12
+    for (; i + 16 <= length; i += 12, output += 16)
+    {
+      __m128i in = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(input + i)), spread);
+      __m128i high = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0FC0FC00)), _mm_set1_epi32(0x04000040));
+      __m128i low = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003F03F0)), _mm_set1_epi32(0x01000010));
+      __m128i indices = _mm_or_si128(high, low);
+
+      __m128i offsetIndex = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+      offsetIndex = _mm_or_si128(offsetIndex, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), indices), _mm_set1_epi8(13)));
+
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(output), _mm_add_epi8(_mm_shuffle_epi8(offsets, offsetIndex), indices));
+    }
+
+    return i;
+  }
+
+  HEADSOCKET_TARGET("avx2") static size_t base64_encode_avx2(const uint8_t *input, size_t length, char *output)
+  {
+    const __m256i spread = _mm256_broadcastsi128_si256(_mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    const __m256i offsets = _mm256_broadcastsi128_si256(_mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0));
+    size_t i = 0;
+
+    for (; i + 28 <= length; i += 24, output += 32)
+    {
+      __m256i in = _mm256_inserti128_si256(_mm256_castsi128_si256(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(input + i))),
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(input + i + 12)), 1);
+
+      in = _mm256_shuffle_epi8(in, spread);
+      __m256i high = _mm256_mulhi_epu16(_mm256_and_si256(in, _mm256_set1_epi32(0x0FC0FC00)), _mm256_set1_epi32(0x04000040));
+      __m256i low = _mm256_mullo_epi16(_mm256_and_si256(in, _mm256_set1_epi32(0x003F03F0)), _mm256_set1_epi32(0x01000010));
+      __m256i indices = _mm256_or_si256(high, low);
+
+      __m256i offsetIndex = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+      offsetIndex = _mm256_or_si256(offsetIndex,
+        _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices), _mm256_set1_epi8(13)));
+
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(output), _mm256_add_epi8(_mm256_shuffle_epi8(offsets, offsetIndex), indices));
+    }
+
+    return i;
+  }
+
+  // Characters are validated and mapped back to 6 bit values by nibble lookups, then packed with multiply-adds
+  HEADSOCKET_TARGET("ssse3") static size_t base64_decode_ssse3(const char *input, size_t length, uint8_t *output)
+  {
+    const __m128i lowLut = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m128i highLut = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i rollLut = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i nibbleMask = _mm_set1_epi8(0x2F);
+    size_t i = 0;
+
+    // Stores 16 bytes, but only produces 12, so at least 8 more characters have to follow
+    for (; i + 24 <= length; i += 16, output += 12)
+    {
+      __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i *>(input + i));
+      __m128i highNibbles = _mm_and_si128(_mm_srli_epi32(in, 4), nibbleMask);
+      __m128i invalid = _mm_and_si128(_mm_shuffle_epi8(lowLut, _mm_and_si128(in, nibbleMask)), _mm_shuffle_epi8(highLut, highNibbles));
+
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(invalid, _mm_setzero_si128())) != 0xFFFF)
+        break;
+
+      __m128i roll = _mm_shuffle_epi8(rollLut, _mm_add_epi8(_mm_cmpeq_epi8(in, nibbleMask), highNibbles));
+      __m128i values = _mm_add_epi8(in, roll);
+      values = _mm_madd_epi16(_mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140)), _mm_set1_epi32(0x00011000));
+      values = _mm_shuffle_epi8(values, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(output), values);
+    }
+
+    return i;
+  }
+
+  HEADSOCKET_TARGET("avx2") static size_t base64_decode_avx2(const char *input, size_t length, uint8_t *output)
+  {
+    const __m256i lowLut = _mm256_broadcastsi128_si256(_mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A));
+    const __m256i highLut = _mm256_broadcastsi128_si256(_mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10));
+    const __m256i rollLut = _mm256_broadcastsi128_si256(_mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0));
+    const __m256i pack = _mm256_broadcastsi128_si256(_mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    const __m256i nibbleMask = _mm256_set1_epi8(0x2F);
+    size_t i = 0;
+
+    // Stores 32 bytes, but only produces 24, so at least 16 more characters have to follow
+    for (; i + 48 <= length; i += 32, output += 24)
+    {
+      __m256i in = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(input + i));
+      __m256i highNibbles = _mm256_and_si256(_mm256_srli_epi32(in, 4), nibbleMask);
+      __m256i invalid = _mm256_and_si256(_mm256_shuffle_epi8(lowLut, _mm256_and_si256(in, nibbleMask)), _mm256_shuffle_epi8(highLut, highNibbles));
+
+      if (!_mm256_testz_si256(invalid, invalid))
+        break;
+
+      __m256i roll = _mm256_shuffle_epi8(rollLut, _mm256_add_epi8(_mm256_cmpeq_epi8(in, nibbleMask), highNibbles));
+      __m256i values = _mm256_add_epi8(in, roll);
+      values = _mm256_madd_epi16(_mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140)), _mm256_set1_epi32(0x00011000));
+      values = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(values, pack), _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(output), values);
+    }
+
+    return i;
+  }
+#endif
+
+  // WebSocket masking fused with copying, 'output' may be 'input' itself. Key bytes are applied in memory order,
+  // blocks keep multiples of 4 bytes, so the tail still starts with the first key byte.
+  static size_t xor32_copy(uint32_t key, const void *input, void *output, size_t length)
+  {
+    const uint8_t *in = reinterpret_cast<const uint8_t *>(input);
+    uint8_t *out = reinterpret_cast<uint8_t *>(output);
+    const uint8_t *mask = reinterpret_cast<const uint8_t *>(&key);
+    size_t i = 0;
+
+#if defined(HEADSOCKET_SSE2)
+    __m128i mask128 = _mm_set1_epi32(static_cast<int>(key));
+
+    for (; i + 16 <= length; i += 16)
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i),
+        _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i)), mask128));
+#endif
+
+    uint64_t mask64 = (static_cast<uint64_t>(key) << 32) | key;
+
+    for (; i + 8 <= length; i += 8)
+    {
+      uint64_t block;
+      memcpy(&block, in + i, 8);
+      block ^= mask64;
+      memcpy(out + i, &block, 8);
+    }
+
+    for (; i < length; ++i)
+      out[i] = in[i] ^ mask[i % 4];
+
+    return length;
+  }
+
+  static size_t xor32(uint32_t key, void *ptr, size_t length) { return xor32_copy(key, ptr, ptr, length); }
+
+  static unsigned lowest_bit(uint32_t mask)
+  {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return static_cast<unsigned>(index);
+#else
+    return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+  }
+
+  // Hex digit values (or -1) and characters passing url_encode unescaped
+  struct url_tables
+  {
+    int8_t hex[256];
+    bool unreserved[256];
+
+    url_tables()
+    {
+      for (int i = 0; i < 256; ++i)
+      {
+        hex[i] = i >= '0' && i <= '9' ? static_cast<int8_t>(i - '0') :
+          i >= 'a' && i <= 'f' ? static_cast<int8_t>(i - 'a' + 10) :
+          i >= 'A' && i <= 'F' ? static_cast<int8_t>(i - 'A' + 10) : -1;
+
+        unreserved[i] = (i >= '0' && i <= '9') || (i >= 'a' && i <= 'z') || (i >= 'A' && i <= 'Z') ||
+          i == '-' || i == '_' || i == '.' || i == '~';
+      }
+    }
+
+    static const url_tables &get()
+    {
+      static const url_tables tables;
+      return tables;
+    }
+  };
+
+  // Writes at most 3 * 'length' bytes into 'output', returns number of bytes written
+  static size_t url_encode(const void *ptr, size_t length, char *output)
+  {
+    static const char *digits = "0123456789ABCDEF";
+    const url_tables &tables = url_tables::get();
+    const uint8_t *input = reinterpret_cast<const uint8_t *>(ptr);
+    char *cursor = output;
+    size_t i = 0;
+
+#if defined(HEADSOCKET_SSE2)
+    // Whole blocks of unreserved characters are copied as they are
+    for (; i + 16 <= length; i += 16)
+    {
+      __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(input + i));
+      auto between = [&block](char lo, char hi)
+      {
+        return _mm_and_si128(_mm_cmpgt_epi8(block, _mm_set1_epi8(lo - 1)), _mm_cmplt_epi8(block, _mm_set1_epi8(hi + 1)));
+      };
+
+      __m128i plain = _mm_or_si128(_mm_or_si128(between('0', '9'), between('a', 'z')), between('A', 'Z'));
+      plain = _mm_or_si128(plain, _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('-')), _mm_cmpeq_epi8(block, _mm_set1_epi8('_'))),
+        _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('.')), _mm_cmpeq_epi8(block, _mm_set1_epi8('~')))));
+
+      if (_mm_movemask_epi8(plain) == 0xFFFF)
+      {
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(cursor), block);
+        cursor += 16;
+        continue;
+      }
+
+      for (size_t k = i; k < i + 16; ++k)
+        if (tables.unreserved[input[k]])
+          *cursor++ = static_cast<char>(input[k]);
+        else
+        {
+          cursor[0] = '%';
+          cursor[1] = digits[input[k] >> 4];
+          cursor[2] = digits[input[k] & 15];
+          cursor += 3;
+        }
+    }
+#endif
+
+    for (; i < length; ++i)
+      if (tables.unreserved[input[i]])
+        *cursor++ = static_cast<char>(input[i]);
+      else
+      {
+        cursor[0] = '%';
+        cursor[1] = digits[input[i] >> 4];
+        cursor[2] = digits[input[i] & 15];
+        cursor += 3;
+      }
+
+    return cursor - output;
+  }
+
+  static std::string url_encode(const std::string &str)
+  {
+    std::string result(str.length() * 3, 0);
+    result.resize(url_encode(str.data(), str.length(), &result[0]));
+    return result;
+  }
+
+  // Decodes '%XX' escapes and '+' into 'output' (at most 'length' bytes, may be the same as 'input'), invalid escapes
+  // are copied as they are. Returns number of bytes written.
+  static size_t url_decode(const char *input, size_t length, char *output)
+  {
+    const url_tables &tables = url_tables::get();
+    char *cursor = output;
+    size_t i = 0;
+
+    while (i < length)
+    {
+      // Find next character needing attention, everything before it is copied in one go
+      size_t next = i;
+
+#if defined(HEADSOCKET_SSE2)
+      for (; next + 16 <= length; next += 16)
+      {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(input + next));
+        int mask = _mm_movemask_epi8(_mm_or_si128(
+          _mm_cmpeq_epi8(block, _mm_set1_epi8('%')), _mm_cmpeq_epi8(block, _mm_set1_epi8('+'))));
+
+        if (mask)
+        {
+          next += lowest_bit(static_cast<uint32_t>(mask));
+          break;
+        }
+      }
+#endif
+
+      while (next < length && input[next] != '%' && input[next] != '+')
+        ++next;
+
+      if (next != i)
+      {
+        if (cursor != input + i)
+          memmove(cursor, input + i, next - i);
+
+        cursor += next - i;
+        i = next;
+      }
+
+      if (i == length)
+        break;
+
+      if (input[i] == '+')
+      {
+        *cursor++ = ' ';
+        ++i;
+        continue;
+      }
+
+      int8_t high = i + 2 < length ? tables.hex[static_cast<uint8_t>(input[i + 1])] : -1;
+      int8_t low = high >= 0 ? tables.hex[static_cast<uint8_t>(input[i + 2])] : -1;
+
+      if (low >= 0)
+      {
+        *cursor++ = static_cast<char>((high << 4) | low);
+        i += 3;
+      }
+      else
+        *cursor++ = input[i++];
+    }
+
+    return cursor - output;
+  }
+
+  static std::string url_decode(const std::string &str)
+  {
+    std::string result(str.length(), 0);
+    result.resize(url_decode(str.data(), str.length(), &result[0]));
+    return result;
+  }
+
+  // Decodes in place, returns new length
+  static size_t url_decode(char *ptr, size_t length) { return url_decode(ptr, length, ptr); }
+
+  static uint16_t swap16bits(uint16_t x)
+  {
+#if defined(_MSC_VER)
+    return _byteswap_ushort(x);
+#else
+    return __builtin_bswap16(x);
+#endif
+  }
+
+  static uint32_t swap32bits(uint32_t x)
+  {
+#if defined(_MSC_VER)
+    return _byteswap_ulong(x);
+#else
+    return __builtin_bswap32(x);
+#endif
+  }
+
+  static uint64_t swap64bits(uint64_t x)
+  {
+#if defined(_MSC_VER)
+    return _byteswap_uint64(x);
+#else
+    return __builtin_bswap64(x);
+#endif
+  }
+
+  static uint16_t swap_bits(uint16_t x) { return swap16bits(x); }
+  static uint32_t swap_bits(uint32_t x) { return swap32bits(x); }
+  static uint64_t swap_bits(uint64_t x) { return swap64bits(x); }
+
+  // Network byte order loads and stores, 'ptr' does not need to be aligned
+  template <typename T>
+  static T load_be(const void *ptr)
+  {
+    T value;
+    memcpy(&value, ptr, sizeof(T));
+    return swap_bits(value);
+  }
+
+  template <typename T>
+  static void store_be(void *ptr, T value)
+  {
+    value = swap_bits(value);
+    memcpy(ptr, &value, sizeof(T));
+  }
+
+  static std::string trim(const std::string &str)
+  {
+    size_t trimLeft = 0, trimRight = str.length() - 1;
+
+    while (trimLeft < str.length() && isspace(str[trimLeft]))
+      ++trimLeft;
+
+    while (trimRight < str.length() && isspace(str[trimRight]))
+      --trimRight;
+
+    return (trimRight >= str.length() || trimLeft >= str.length() || trimRight < trimLeft)
+      ? std::string("")
+      : str.substr(trimLeft, trimRight - trimLeft + 1);
+  }
+
+  static bool icontains(const std::string_view &str, const std::string_view &token)
+  {
+    return std::search(str.begin(), str.end(), token.begin(), token.end(), [](char c1, char c2)->bool
+    {
+      return tolower(c1) == tolower(c2);
+    }) != str.end();
+  }
+
+  static std::string cut_front(std::string &str, char delimiter = ' ', bool first = true, bool hungry = true)
+  {
+    std::string result;
+
+    auto pos = first ? str.find(delimiter) : str.rfind(delimiter);
+    if (pos == std::string::npos)
+    {
+      if (hungry)
+      {
+        result = str;
+        str = "";
+      }
+    }
+    else
+    {
+      result = str.substr(0, pos);
+      str = str.substr(pos + 1);
+    }
+
+    return result;
+  }
+
+  static std::string cut_back(std::string &str, char delimiter = ' ', bool first = true, bool hungry = true)
+  {
+    std::string result;
+
+    auto pos = first ? str.rfind(delimiter) : str.find(delimiter);
+    if (pos == std::string::npos)
+    {
+      if (hungry)
+      {
+        result = str;
+        str = "";
+      }
+    }
+    else
+    {
+      result = str.substr(pos + 1);
+      str = str.substr(0, pos);
+    }
+
+    return result;
+  }
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Incremental base64 over data arriving in arbitrary pieces (ie. WebSocket frames), up to 2 trailing bytes are held back
+// until the next update or finish
+struct base64_encoder
+{
+  // Writes at most utils::base64_encoded_length('length' + 2) characters into 'output', returns number written
+  size_t update(const void *ptr, size_t length, char *output)
+  {
+    const uint8_t *input = reinterpret_cast<const uint8_t *>(ptr);
+    size_t written = 0;
+
+    if (_pending_length)
+    {
+      while (_pending_length < 3 && length)
+      {
+        _pending[_pending_length++] = *input++;
+        --length;
+      }
+
+      if (_pending_length < 3)
+        return 0;
+
+      written = utils::base64_encode(_pending, 3, output);
+      _pending_length = 0;
+    }
+
+    size_t whole = length - length % 3;
+    written += utils::base64_encode(input, whole, output + written);
+
+    memcpy(_pending, input + whole, length - whole);
+    _pending_length = length - whole;
+    return written;
+  }
+
+  // Flushes held back bytes with padding (at most 4 characters), the encoder can be reused afterwards
+  size_t finish(char *output)
+  {
+    size_t written = utils::base64_encode(_pending, _pending_length, output);
+    _pending_length = 0;
+    return written;
+  }
+
+private:
+  uint8_t _pending[3];
+  size_t _pending_length = 0;
+};
+
+// Incremental counterpart of base64_encoder, up to 3 trailing characters are held back
+struct base64_decoder
+{
+  // Writes at most utils::base64_decoded_length('length' + 3) bytes into 'output', returns number written or
+  // utils::base64_invalid (the decoder is unusable until reset then)
+  size_t update(const char *input, size_t length, void *output)
+  {
+    uint8_t *cursor = reinterpret_cast<uint8_t *>(output);
+
+    if (_failed || (_padded && length))
+      return fail();
+
+    if (_pending_length)
+    {
+      while (_pending_length < 4 && length)
+      {
+        _pending[_pending_length++] = *input++;
+        --length;
+      }
+
+      if (_pending_length < 4)
+        return 0;
+
+      if (!consume(_pending, 4, cursor) || (_padded && length))
+        return fail();
+
+      _pending_length = 0;
+    }
+
+    size_t whole = length & ~static_cast<size_t>(3);
+
+    if (whole && !consume(input, whole, cursor))
+      return fail();
+
+    if (_padded && whole != length)
+      return fail();
+
+    memcpy(_pending, input + whole, length - whole);
+    _pending_length = length - whole;
+    return cursor - reinterpret_cast<uint8_t *>(output);
+  }
+
+  // Decodes held back unpadded characters (at most 2 bytes), returns number written or utils::base64_invalid.
+  // The decoder is reset afterwards.
+  size_t finish(void *output)
+  {
+    size_t written = _failed ? utils::base64_invalid : utils::base64_decode(_pending, _pending_length, output);
+    reset();
+    return written;
+  }
+
+  void reset()
+  {
+    _pending_length = 0;
+    _padded = _failed = false;
+  }
+
+private:
+  bool consume(const char *input, size_t length, uint8_t *&cursor)
+  {
+    size_t written = utils::base64_decode(input, length, cursor);
+
+    if (written == utils::base64_invalid)
+      return false;
+
+    cursor += written;
+    _padded = input[length - 1] == '=';
+    return true;
+  }
+
+  size_t fail()
+  {
+    _failed = true;
+    return utils::base64_invalid;
+  }
+
+  char _pending[4];
+  size_t _pending_length = 0;
+  bool _padded = false;
+  bool _failed = false;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct critical_section
+{
+  mutable std::atomic_bool consumer_lock;
+
+  critical_section()
+  {
+    consumer_lock = false;
+  }
+
+  // Spins briefly, then yields, so a holder preempted by more runnable threads than cores gets to finish
+  void lock() const
+  {
+    if (!consumer_lock.exchange(true, std::memory_order_acquire))
+      return;
+
+#ifdef HEADSOCKET_TRACE
+    uint64_t waitStart = timestamp();
+#endif
+
+    for (int spins = 0; consumer_lock.exchange(true, std::memory_order_acquire); )
+      if (++spins > 64)
+        std::this_thread::yield();
+
+#ifdef HEADSOCKET_TRACE
+    trace_registry::record(trace_registry::lock_wait, reinterpret_cast<uintptr_t>(this), timestamp() - waitStart, waitStart);
+#endif
+  }
+
+  bool try_lock() const { return !consumer_lock.exchange(true, std::memory_order_acquire); }
+  void unlock() const { consumer_lock.store(false, std::memory_order_release); }
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+template <typename T, typename M = critical_section>
+struct lockable_value : M
+{
+  T value;
+
+  T *operator->() { return &value; }
+  const T *operator->() const { return &value; }
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct semaphore
+{
+  mutable std::atomic_size_t count;
+  mutable std::mutex mutex;
+  mutable std::condition_variable cv;
+
+  semaphore()
+  {
+    count = 0;
+  }
+
+  void lock(size_t minCount = 0) const
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&]()->bool { return count > minCount; });
+    lock.release();
+  }
+
+  // Fails when the mutex is taken or there is nothing signaled yet
+  bool try_lock() const
+  {
+    if (!mutex.try_lock())
+      return false;
+
+    if (count > 0)
+      return true;
+
+    mutex.unlock();
+    return false;
+  }
+
+  void unlock()
+  {
+    mutex.unlock();
+  }
+
+  void notify()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      ++count;
+    }
+
+    cv.notify_one();
+  }
+
+  // Signals are consumed with the semaphore locked, notify() then cannot slip in between
+  void consume() const
+  {
+    if (count)
+      --count;
+  }
+
+  void consume_all() const
+  {
+    count = 0;
+  }
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct data_block_buffer
+{
+  std::deque<data_block> blocks;
+  std::vector<uint8_t> buffer;
+
+  // Push times of timed blocks read to the end, the writing thread takes them once their bytes are sent
+  std::vector<uint64_t> drained;
+
+  data_block_buffer()
+  {
+    buffer.reserve(65536);
+  }
+
+  data_block &block_begin(opcode op)
+  {
+    blocks.emplace_back(op, buffer.size());
+    return blocks.back();
+  }
+
+  data_block &block_end()
+  {
+    blocks.back().is_completed = true;
+    return blocks.back();
+  }
+
+  void block_remove()
+  {
+    if (blocks.empty())
+      return;
+
+    buffer.resize(blocks.back().offset);
+    blocks.pop_back();
+  }
+
+  void write(const void *ptr, size_t length)
+  {
+    if (!length)
+      return;
+
+    buffer.resize(buffer.size() + length);
+    memcpy(buffer.data() + buffer.size() - length, reinterpret_cast<const char *>(ptr), length);
+    blocks.back().length += length;
+  }
+
+  // Non-zero 'mask' masks bytes while copying them out (masking with zero would change nothing anyway)
+  size_t read(void *ptr, size_t length, uint32_t mask = 0)
+  {
+    if (!ptr || blocks.empty() || !blocks.front().is_completed)
+      return 0;
+
+    data_block &db = blocks.front();
+    size_t result = db.length >= length ? length : db.length;
+
+    if (result && mask)
+      utils::xor32_copy(mask, buffer.data() + db.offset, ptr, result);
+    else if (result)
+      memcpy(ptr, buffer.data() + db.offset, result);
+
+    db.offset += result;
+
+    if (!(db.length -= result))
+    {
+      if (db.pushed_at)
+        drained.push_back(db.pushed_at);
+
+      blocks.pop_front();
+    }
+    else
+      db.op = opcode::continuation;
+
+    // Read bytes stay at the front of the buffer until they make up half of it, so draining many small blocks
+    // is not quadratic
+    size_t consumed = blocks.empty() ? buffer.size() : blocks.front().offset;
+
+    if (consumed == buffer.size() || (consumed >= 4096 && consumed * 2 >= buffer.size()))
+    {
+      buffer.erase(buffer.begin(), buffer.begin() + consumed);
+
+      for (auto &block : blocks)
+        block.offset -= consumed;
+    }
+
+    return result;
+  }
+
+  // Bytes of all blocks not read yet
+  size_t size() const { return blocks.empty() ? 0 : buffer.size() - blocks.front().offset; }
+
+  size_t peek(opcode *op = nullptr) const
+  {
+    if (blocks.empty() || !blocks.front().is_completed)
+      return 0;
+
+    if (op)
+      *op = blocks.front().op;
+
+    return blocks.front().length;
+  }
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//---------------------------------------------------------------------------------------------------------------------
+bool handshake_websocket(connection &conn)
+{
+  std::string line, key;
+
+  while (conn.read_line(line))
+  {
+    if (line.empty())
+      break;
+
+    if (line.length() > 19 && iequals(std::string_view(line).substr(0, 19), "Sec-WebSocket-Key: "))
+      key = line.substr(19);
+  }
+
+  if (key.empty())
+    return false;
+
+  std::string response = web_socket_response(key);
+  return conn.force_write(response.c_str(), response.length());
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+std::string web_socket_accept(const std::string_view &key)
+{
+  static const char *guid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+  detail::sha1 sha;
+  detail::sha1::digest8_t digest;
+  sha.process_bytes(key.data(), key.length());
+  sha.process_bytes(guid, 36);
+
+  char accept[28];
+  return std::string(accept, detail::utils::base64_encode(sha.get_digest_bytes(digest), 20, accept));
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+std::string web_socket_response(const std::string_view &key)
+{
+  return "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: " +
+    web_socket_accept(key) + "\r\n\r\n";
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifdef HEADSOCKET_PLATFORM_WINDOWS
+void set_thread_name(const char *name)
+{
+#pragma pack(push,8)
+  typedef struct tagTHREADNAME_INFO
+  {
+    DWORD dwType;
+    LPCSTR szName;
+    DWORD dwThreadID;
+    DWORD dwFlags;
+  } THREADNAME_INFO;
+#pragma pack(pop)
+  THREADNAME_INFO info = { 0x1000, name, static_cast<DWORD>(-1), 0 };
+
+  __try
+  {
+    RaiseException(0x406D1388, 0, sizeof(info) / sizeof(ULONG_PTR), reinterpret_cast<ULONG_PTR *>(&info));
+  }
+  __except (EXCEPTION_EXECUTE_HANDLER)
+  {
+
+  }
+
+#ifdef HEADSOCKET_TRACE
+  trace_registry::set_name(name);
+#endif
+}
+#else
+void set_thread_name(const char *name)
+{
+  // Names are limited to 15 characters, "Class::memberThread" keeps just its member part then
+  const char *member = strrchr(name, ':');
+  char shortName[16] = { };
+  strncpy(shortName, strlen(name) > 15 && member ? member + 1 : name, 15);
+
+#if defined(HEADSOCKET_PLATFORM_MAC)
+  pthread_setname_np(shortName);
+#else
+  pthread_setname_np(pthread_self(), shortName);
+#endif
+
+#ifdef HEADSOCKET_TRACE
+  trace_registry::set_name(name);
+#endif
+}
+#endif
+
+} // namespace detail;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace detail {
+  
+struct connection_impl
+{
+  static const size_t read_ahead_size = 4096;
+
+  detail::socket_type socket = detail::invalid_socket;
+  sockaddr_in from;
+  size_t id = 0;
+  std::vector<char> readAhead;
+  size_t readBegin = 0;
+  size_t readEnd = 0;
+
+  void assign(const connection_impl &impl)
+  {
+    socket = impl.socket;
+    from = impl.from;
+    id = impl.id;
+
+    // Unread bytes are handed over as well, so nothing received during handshake gets lost
+    readAhead.assign(impl.readAhead.begin() + impl.readBegin, impl.readAhead.begin() + impl.readEnd);
+    readBegin = 0;
+    readEnd = readAhead.size();
+  }
+
+  size_t buffered() const { return readEnd - readBegin; }
+
+  void consume(size_t length)
+  {
+    readBegin += length;
+
+    if (readBegin == readEnd)
+      readBegin = readEnd = 0;
+  }
+
+  size_t take(void *ptr, size_t length)
+  {
+    size_t result = length < buffered() ? length : buffered();
+
+    if (result)
+    {
+      memcpy(ptr, readAhead.data() + readBegin, result);
+      consume(result);
+    }
+
+    return result;
+  }
+
+  // Puts bytes back in front of the read-ahead buffer
+  void unread(const void *ptr, size_t length)
+  {
+    const char *bytes = static_cast<const char *>(ptr);
+    readAhead.erase(readAhead.begin() + readEnd, readAhead.end());
+    readAhead.erase(readAhead.begin(), readAhead.begin() + readBegin);
+    readAhead.insert(readAhead.begin(), bytes, bytes + length);
+    readBegin = 0;
+    readEnd = readAhead.size();
+  }
+
+  bool fill()
+  {
+    if (readAhead.size() < read_ahead_size)
+      readAhead.resize(read_ahead_size);
+
+    int result = recv(socket, readAhead.data() + readEnd, static_cast<int>(readAhead.size() - readEnd), 0);
+
+    if (!result || result == detail::socket_error)
+      return false;
+
+    metrics_registry::add(metrics_registry::bytes_in, result);
+    readEnd += static_cast<size_t>(result);
+    return true;
+  }
+
+  void close()
+  {
+    if (socket != detail::invalid_socket)
+    {
+      detail::close_socket(socket);
+      socket = detail::invalid_socket;
+    }
+  }
+};
+
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+connection::connection(const detail::connection_impl &impl)
+  : _p(std::make_unique<detail::connection_impl>())
+{
+  _p->assign(impl);
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+connection::~connection()
+{
+  
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+bool connection::is_valid() const { return _p->socket != detail::invalid_socket; }
+
+//---------------------------------------------------------------------------------------------------------------------
+size_t connection::id() const { return _p->id; }
+
+//---------------------------------------------------------------------------------------------------------------------
+size_t connection::write(const void *ptr, size_t length)
+{
+  if (!is_valid())
+    return detail::socket_error;
+
+  if (!ptr || !length)
+    return 0;
+
+  int result = send(_p->socket, static_cast<const char *>(ptr), static_cast<int>(length), detail::send_flags);
+
+  if (!result || result == detail::socket_error)
+    return 0;
+
+  detail::metrics_registry::add(detail::metrics_registry::bytes_out, result);
+  return static_cast<size_t>(result);
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+bool connection::force_write(const void *ptr, size_t length)
+{
+  if (!is_valid())
+    return false;
+
+  if (!ptr)
+    return true;
+
+  const char *chPtr = static_cast<const char *>(ptr);
+
+  while (length)
+  {
+    int result = send(_p->socket, chPtr, static_cast<int>(length), detail::send_flags);
+
+    if (!result || result == detail::socket_error)
+      return false;
+
+    detail::metrics_registry::add(detail::metrics_registry::bytes_out, result);
+    length -= static_cast<size_t>(result);
+    chPtr += result;
+  }
+
+  return true;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+size_t connection::read(void *ptr, size_t length)
+{
+  if (!is_valid())
+    return detail::socket_error;
+
+  if (!ptr || !length)
+    return 0;
+
+  if (_p->buffered())
+    return _p->take(ptr, length);
+
+  int result = recv(_p->socket, static_cast<char *>(ptr), static_cast<int>(length), 0);
+
+  if (!result || result == detail::socket_error)
+    return 0;
+
+  detail::metrics_registry::add(detail::metrics_registry::bytes_in, result);
+  return static_cast<size_t>(result);
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+bool connection::force_read(void *ptr, size_t length)
+{
+  if (!is_valid())
+    return false;
+
+  if (!ptr)
+    return true;
+
+  size_t buffered = _p->take(ptr, length);
+  char *chPtr = static_cast<char *>(ptr) + buffered;
+  length -= buffered;
+
+  while (length)
+  {
+    int result = recv(_p->socket, chPtr, static_cast<int>(length), 0);
+
+    if (!result || result == detail::socket_error)
+      return false;
+
+    detail::metrics_registry::add(detail::metrics_registry::bytes_in, result);
+    length -= static_cast<size_t>(result);
+    chPtr += result;
+  }
+
+  return true;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+bool connection::read_line(std::string &output)
+{
+  if (!is_valid())
+    return false;
+
+  output.clear();
+
+  while (true)
+  {
+    if (!_p->buffered() && !_p->fill())
+      return false;
+
+    const char *begin = _p->readAhead.data() + _p->readBegin;
+    const char *lf = static_cast<const char *>(memchr(begin, '\n', _p->buffered()));
+    size_t length = lf ? lf - begin : _p->buffered();
+
+    output.append(begin, length);
+    _p->consume(lf ? length + 1 : length);
+
+    if (lf)
+      break;
+  }
+
+  output.erase(std::remove(output.begin(), output.end(), '\r'), output.end());
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace detail {
+
+struct basic_tcp_client_ref
+{
+  size_t refCount = 0;
+  ptr<basic_tcp_client> client;
+
+  basic_tcp_client_ref(ptr<basic_tcp_client> c)
+    : client(c)
+  {
+  
+  }
+};
+
+struct basic_tcp_server_impl
+{
+  std::atomic_bool isRunning;
+  std::atomic_bool disconnectThreadQuit;
+  sockaddr_in local;
+  detail::lockable_value<std::vector<basic_tcp_client_ref>> connections;
+  detail::lockable_value<std::vector<ptr<basic_tcp_client>>> released;
+  detail::semaphore disconnectSemaphore;
+  int port = 0;
+  detail::socket_type serverSocket = invalid_socket;
+  std::unique_ptr<std::thread> acceptThread;
+  std::unique_ptr<std::thread> disconnectThread;
+  id_t nextClientID = 1;
+  ptr<detail::latency_recorders> latency = std::make_shared<detail::latency_recorders>();
+
+  basic_tcp_server_impl()
+  {
+    isRunning = false;
+    disconnectThreadQuit = false;
+  }
+};
+
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//---------------------------------------------------------------------------------------------------------------------
+basic_tcp_server::basic_tcp_server(int port)
+  : _p(std::make_unique<detail::basic_tcp_server_impl>())
+{
+#ifdef HEADSOCKET_PLATFORM_WINDOWS
+  WSADATA wsaData;
+  WSAStartup(0x101, &wsaData);
+#endif
+
+  _p->local.sin_family = AF_INET;
+  _p->local.sin_addr.s_addr = INADDR_ANY;
+  _p->local.sin_port = htons(static_cast<unsigned short>(port));
+
+  _p->serverSocket = socket(AF_INET, SOCK_STREAM, 0);
+
+  if (bind(_p->serverSocket, reinterpret_cast<sockaddr *>(&_p->local), sizeof(_p->local)) != 0)
+    return;
+
+  if (listen(_p->serverSocket, SOMAXCONN))
+    return;
+
+  _p->isRunning = true;
+  _p->port = port;
+  _p->acceptThread = std::make_unique<std::thread>(std::bind(&basic_tcp_server::accept_thread, this));
+  _p->disconnectThread = std::make_unique<std::thread>(std::bind(&basic_tcp_server::disconnect_thread, this));
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+basic_tcp_server::~basic_tcp_server()
+{
+  stop();
+
+#ifdef HEADSOCKET_PLATFORM_WINDOWS
+  WSACleanup();
+#endif
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+int basic_tcp_server::port() const { return _p->port; }
+
+//---------------------------------------------------------------------------------------------------------------------
+void basic_tcp_server::stop()
+{
+  if (_p->isRunning.exchange(false))
+  {
+    detail::close_socket(_p->serverSocket);
+
+    {
+      acquire_clients();
+
+      for (size_t i = 0, S = num_clients(); i < S; ++i)
+        client_at(i)->disconnect();
+
+      release_clients();
+    }
+
+    if (_p->acceptThread)
+    {
+      _p->acceptThread->join();
+      _p->acceptThread = nullptr;
+    }
+
+    if (_p->disconnectThread)
+    {
+      _p->disconnectThreadQuit = true;
+      _p->disconnectSemaphore.notify();
+
+      _p->disconnectThread->join();
+      _p->disconnectThread = nullptr;
+    }
+  }
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+bool basic_tcp_server::is_running() const { return _p->isRunning; }
+
+//---------------------------------------------------------------------------------------------------------------------
+latency_metrics basic_tcp_server::latency() const { return _p->latency->snapshot(); }
+
+//---------------------------------------------------------------------------------------------------------------------
+bool basic_tcp_server::disconnect(ptr<basic_tcp_client> client)
+{
+  bool found = false;
+
+  if (client)
+  {
+    {
+      HEADSOCKET_LOCK(_p->connections);
+      for (size_t i = 0, S = _p->connections->size(); i < S; ++i)
+        if (_p->connections->at(i).client == client)
+        {
+          found = true;
+          break;
+        }
+    }
+
+    if (found && !client->disconnect())
+    {
+      client_disconnected(client);
+      _p->disconnectSemaphore.notify();
+    }
+  }
+
+  return found;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+bool basic_tcp_server::disconnect(id_t id)
+{
+  bool found = false;
+
+  if (id)
+  {
+    ptr<basic_tcp_client> client;
+
+    {
+      HEADSOCKET_LOCK(_p->connections);
+      for (size_t i = 0, S = _p->connections->size(); i < S; ++i)
+        if (_p->connections->at(i).client->id() == id)
+        {
+          client = _p->connections->at(i).client;
+          found = true;
+          break;
+        }
+    }
+
+    if (found)
+    {
+      if (!client->disconnect())
+        client_disconnected(client);
+
+      // Caller may be the client's own thread and this the last reference, disconnect thread lets it go instead
+      {
+        HEADSOCKET_LOCK(_p->released);
+        _p->released->push_back(std::move(client));
+      }
+
+      _p->disconnectSemaphore.notify();
+    }
+  }
+
+  return found;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+bool basic_tcp_server::replace_client(const basic_tcp_client *oldClient, ptr<basic_tcp_client> newClient)
+{
+  HEADSOCKET_LOCK(_p->connections);
+
+  for (auto &clientRef : _p->connections.value)
+    if (clientRef.client.get() == oldClient)
+    {
+      clientRef.client = newClient;
+      return true;
+    }
+
+  return false;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+ptr<basic_tcp_client> basic_tcp_server::client_at(size_t index) const
+{
+  HEADSOCKET_LOCK(_p->connections);
+  return index < _p->connections->size() ? _p->connections->at(index).client : nullptr;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+size_t basic_tcp_server::num_clients() const
+{
+  HEADSOCKET_LOCK(_p->connections);
+  return _p->connections->size();
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+size_t basic_tcp_server::acquire_clients() const
+{
+  HEADSOCKET_LOCK(_p->connections);
+
+  for (auto &clientRef : _p->connections.value)
+    ++clientRef.refCount;
+
+  return _p->connections->size();
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+void basic_tcp_server::release_clients() const
+{
+  bool removed = false;
+  {
+    HEADSOCKET_LOCK(_p->connections);
+
+    for (auto &clientRef : _p->connections.value)
+      --clientRef.refCount;
+
+    removed = remove_disconnected();
+  }
+
+  // Disconnect thread takes the semaphore first and 'connections' after it, notifying under 'connections' would deadlock
+  if (removed)
+    _p->disconnectSemaphore.notify();
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+bool basic_tcp_server::remove_disconnected() const
+{
+  size_t i = 0;
+  bool removed = false;
+
+  while (i < _p->connections->size())
+  {
+    auto &clientRef = _p->connections.value[i];
+
+    if (!clientRef.client->is_connected() && clientRef.refCount == 0)
+    {
+      clientRef.client->on_disconnect();
+
+      // Destroying the client joins its threads, which may still wait for 'connections', disconnect thread does it later
+      {
+        HEADSOCKET_LOCK(_p->released);
+        _p->released->push_back(std::move(clientRef.client));
+      }
+
+      _p->connections->erase(_p->connections->begin() + i);
+      removed = true;
+    }
+    else
+      ++i;
+  }
+
+  return removed;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+void basic_tcp_server::accept_thread()
+{
+  detail::set_thread_name("BaseTcpServer::acceptThread");
+
+  while (_p->isRunning)
+  {
+    detail::connection_impl conn_impl;
+    socklen_t fromLength = sizeof(conn_impl.from);
+    conn_impl.socket = ::accept(_p->serverSocket, reinterpret_cast<struct sockaddr *>(&conn_impl.from), &fromLength);
+    conn_impl.id = _p->nextClientID++;
+
+    if (!_p->nextClientID)
+      ++_p->nextClientID;
+
+    if (!_p->isRunning)
+      break;
+
+    if (conn_impl.socket != detail::invalid_socket)
+    {
+      detail::metrics_registry::add(detail::metrics_registry::accepts);
+      connection conn(conn_impl);
+
+      ptr<basic_tcp_client> newClient;
+      bool failed = false;
+
+      HEADSOCKET_TRACE_EVENT(accept, conn_impl.id, 0);
+      HEADSOCKET_TRACE_EVENT(handshake_begin, conn_impl.id, 0);
+      bool handshaken = handshake(conn);
+      HEADSOCKET_TRACE_EVENT(handshake_end, conn_impl.id, 0);
+
+      if (handshaken)
+      {
+        if (newClient = accept(conn))
+        {
+          newClient->on_accept();
+
+          {
+            HEADSOCKET_LOCK(_p->connections);
+            _p->connections->push_back(newClient);
+          }
+
+          // Client that has already gone was not found by its own disconnect, it has to be removed here (outside
+          // of 'connections', see release_clients)
+          if (!newClient->is_connected())
+            _p->disconnectSemaphore.notify();
+        }
+        else
+          failed = true;
+      }
+      else
+        failed = true;
+
+      if (failed)
+      {
+        detail::metrics_registry::add(detail::metrics_registry::handshakes_failed);
+        conn_impl.close();
+        --_p->nextClientID;
+
+        if (!_p->nextClientID)
+          --_p->nextClientID;
+      }
+      else
+        client_connected(newClient);
+    }
+  }
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+void basic_tcp_server::disconnect_thread()
+{
+  detail::set_thread_name("BaseTcpServer::disconnectThread");
+
+  while (!_p->disconnectThreadQuit)
+  {
+    std::vector<ptr<basic_tcp_client>> released;
+    {
+      HEADSOCKET_LOCK(_p->disconnectSemaphore);
+      HEADSOCKET_LOCK(_p->connections);
+
+      remove_disconnected();
+      _p->disconnectSemaphore.consume();
+
+      HEADSOCKET_LOCK(_p->released);
+      released.swap(_p->released.value);
+    }
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace detail {
+
+// Resolved addresses of outgoing connections by "host:port", shared by all threads
+struct dns_cache
+{
+  struct address
+  {
+    sockaddr_storage storage;
+    socklen_t length;
+    int family;
+  };
+
+  struct entry
+  {
+    std::vector<address> addresses;
+    uint64_t expires;
+  };
+
+  std::mutex mutex;
+  std::unordered_map<std::string, entry> entries;
+
+  static dns_cache &get()
+  {
+    static dns_cache *cache = new dns_cache();
+    return *cache;
+  }
+
+  static std::string key(const std::string &host, int port) { return host + ":" + std::to_string(port); }
+
+  // Empty result when the host does not resolve
+  std::vector<address> resolve(const std::string &host, int port, int ttlMs)
+  {
+    std::string k = key(host, port);
+    uint64_t now = timestamp();
+
+    if (ttlMs > 0)
+    {
+      HEADSOCKET_LOCK(mutex);
+      auto it = entries.find(k);
+
+      if (it != entries.end() && it->second.expires > now)
+        return it->second.addresses;
+    }
+
+    // Resolving is blocking, so it runs without the lock and concurrent misses of one host simply resolve twice
+    addrinfo hints = { }, *result = nullptr;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+
+    std::vector<address> addresses;
+
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &result))
+      return addresses;
+
+    for (addrinfo *ptr = result; ptr != nullptr; ptr = ptr->ai_next)
+    {
+      if (ptr->ai_addrlen > sizeof(sockaddr_storage))
+        continue;
+
+      address a = { };
+      memcpy(&a.storage, ptr->ai_addr, ptr->ai_addrlen);
+      a.length = static_cast<socklen_t>(ptr->ai_addrlen);
+      a.family = ptr->ai_family;
+      addresses.push_back(a);
+    }
+
+    freeaddrinfo(result);
+
+    if (ttlMs > 0 && !addresses.empty())
+    {
+      HEADSOCKET_LOCK(mutex);
+
+      // Hosts nobody connects to anymore would pile up otherwise
+      if (entries.size() >= 256)
+        for (auto it = entries.begin(); it != entries.end();)
+          it = it->second.expires <= now ? entries.erase(it) : std::next(it);
+
+      entries[k] = { addresses, now + static_cast<uint64_t>(ttlMs) * 1000000 };
+    }
+
+    return addresses;
+  }
+
+  void drop(const std::string &host, int port)
+  {
+    HEADSOCKET_LOCK(mutex);
+    entries.erase(key(host, port));
+  }
+
+  void clear()
+  {
+    HEADSOCKET_LOCK(mutex);
+    entries.clear();
+  }
+};
+
+// Happy Eyeballs (RFC 8305) over non-blocking sockets, returns connected blocking socket or invalid_socket
+static socket_type race_connect(const std::vector<dns_cache::address> &addresses, const connect_options &options)
+{
+  // Families alternate, starting with the first one resolved (getaddrinfo sorts by RFC 6724 preference)
+  std::vector<const dns_cache::address *> order, first, other;
+
+  for (auto &a : addresses)
+    (a.family == addresses.front().family ? first : other).push_back(&a);
+
+  for (size_t i = 0; i < first.size() || i < other.size(); ++i)
+  {
+    if (i < first.size()) order.push_back(first[i]);
+    if (i < other.size()) order.push_back(other[i]);
+  }
+
+  auto now_ms = []() { return timestamp() / 1000000; };
+
+  // Zero (or negative) timeouts mean no limit, 'never' keeps every comparison below working
+  const uint64_t never = static_cast<uint64_t>(-1);
+  auto deadline = [&](uint64_t from, int ms) { return ms > 0 ? from + static_cast<uint64_t>(ms) : never; };
+
+  std::vector<pollfd> pending;
+  std::vector<uint64_t> deadlines;
+  socket_type winner = invalid_socket;
+  size_t next = 0;
+  uint64_t now = now_ms(), end = deadline(now, options.timeout_ms), nextStart = now;
+
+  auto give_up = [&](size_t i)
+  {
+    close_socket(static_cast<socket_type>(pending[i].fd));
+    pending.erase(pending.begin() + i);
+    deadlines.erase(deadlines.begin() + i);
+
+    // Failed attempt lets the next one start right away
+    nextStart = now;
+  };
+
+  while (winner == invalid_socket && now < end)
+  {
+    if (next < order.size() && (now >= nextStart || pending.empty()))
+    {
+      const dns_cache::address &a = *order[next++];
+      socket_type s = socket(a.family, SOCK_STREAM, IPPROTO_TCP);
+      nextStart = now + std::max(0, options.attempt_delay_ms);
+
+      if (s == invalid_socket)
+        continue;
+
+      set_socket_blocking(s, false);
+
+      if (connect(s, reinterpret_cast<const sockaddr *>(&a.storage), a.length) != socket_error)
+        winner = s;
+      else if (connect_in_progress())
+      {
+        pollfd fd = { };
+        fd.fd = s;
+        fd.events = POLLOUT;
+        pending.push_back(fd);
+        deadlines.push_back(deadline(now, options.attempt_timeout_ms));
+      }
+      else
+        close_socket(s);
+
+      continue;
+    }
+
+    if (pending.empty())
+      break;
+
+    uint64_t wake = end;
+
+    if (next < order.size())
+      wake = std::min(wake, nextStart);
+
+    for (uint64_t deadline : deadlines)
+      wake = std::min(wake, deadline);
+
+    int timeout = wake == never ? -1 : static_cast<int>(std::min<uint64_t>(wake > now ? wake - now : 0, INT32_MAX));
+    poll_sockets(pending.data(), pending.size(), timeout);
+    now = now_ms();
+
+    for (size_t i = 0; i < pending.size() && winner == invalid_socket;)
+    {
+      if (pending[i].revents)
+      {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        socket_type s = static_cast<socket_type>(pending[i].fd);
+
+        if (!getsockopt(s, SOL_SOCKET, SO_ERROR, reinterpret_cast<char *>(&error), &length) && !error)
+        {
+          winner = s;
+          pending.erase(pending.begin() + i);
+          deadlines.erase(deadlines.begin() + i);
+        }
+        else
+          give_up(i);
+      }
+      else if (now >= deadlines[i])
+        give_up(i);
+      else
+        ++i;
+    }
+  }
+
+  for (auto &fd : pending)
+    close_socket(static_cast<socket_type>(fd.fd));
+
+  if (winner != invalid_socket)
+    set_socket_blocking(winner, true);
+
+  return winner;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+void run_detached(std::function<void()> task)
+{
+  std::thread([task]()
+  {
+    set_thread_name("BaseTcpClient::connectThread");
+    task();
+  }).detach();
+}
+
+struct basic_tcp_client_impl
+{
+  std::atomic_int refCount;
+  std::atomic_bool isConnected;
+  std::weak_ptr<basic_tcp_server> server;
+  connection conn { detail::connection_impl() };
+  std::string address = "";
+  int port = 0;
+  uint64_t connectedAt = 0;
+
+  basic_tcp_client_impl()
+  {
+    refCount = 0;
+    isConnected = false;
+  }
+};
+
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//---------------------------------------------------------------------------------------------------------------------
+void connect_options::clear_dns_cache() { detail::dns_cache::get().clear(); }
+
+//---------------------------------------------------------------------------------------------------------------------
+basic_tcp_client::basic_tcp_client(const std::string &address, int port, const connect_options &options)
+  : _p(std::make_unique<detail::basic_tcp_client_impl>())
+{
+  detail::dns_cache &cache = detail::dns_cache::get();
+  auto addresses = cache.resolve(address, port, options.dns_ttl_ms);
+
+  if (!addresses.empty())
+    _p->conn.impl()->socket = detail::race_connect(addresses, options);
+
+  if (!_p->conn.is_valid())
+  {
+    // Cached addresses might be stale, next attempt resolves again
+    cache.drop(address, port);
+    detail::metrics_registry::add(detail::metrics_registry::connect_failures);
+    return;
+  }
+
+  _p->address = address;
+  _p->port = port;
+  _p->connectedAt = detail::timestamp();
+  _p->isConnected = true;
+
+  detail::metrics_registry::add(detail::metrics_registry::connects);
+  detail::metrics_registry::add(detail::metrics_registry::clients);
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+basic_tcp_client::basic_tcp_client(ptr<basic_tcp_server> server, connection &conn)
+  : _p(std::make_unique<detail::basic_tcp_client_impl>())
+{
+  _p->server = server;
+  _p->conn.impl()->assign(*(conn.impl()));
+  _p->isConnected = true;
+
+  detail::metrics_registry::add(detail::metrics_registry::clients);
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+basic_tcp_client::~basic_tcp_client()
+{
+  disconnect();
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+bool basic_tcp_client::disconnect()
+{
+  bool wasConnected = _p->isConnected.exchange(false);
+
+  if (wasConnected)
+  {
+    HEADSOCKET_TRACE_EVENT(disconnect, _p->conn.id(), 0);
+    detail::metrics_registry::add(detail::metrics_registry::clients, -1);
+    _p->conn.impl()->close();
+
+    ptr<basic_tcp_server> s = server();
+
+    if (s)
+      s->disconnect(_p->conn.id());
+  }
+
+  return wasConnected;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+bool basic_tcp_client::is_connected() const { return _p->isConnected; }
+
+//---------------------------------------------------------------------------------------------------------------------
+ptr<basic_tcp_server> basic_tcp_client::server() const { return _p->server.lock(); }
+
+//---------------------------------------------------------------------------------------------------------------------
+id_t basic_tcp_client::id() const { return _p->conn.id(); }
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//---------------------------------------------------------------------------------------------------------------------
+tcp_client::tcp_client(const std::string &address, int port, const connect_options &options)
+  : base_t(address, port, options)
+{
+
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+tcp_client::tcp_client(ptr<basic_tcp_server> server, connection &conn)
+  : base_t(server, conn)
+{
+
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+tcp_client::~tcp_client()
+{
+
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+size_t tcp_client::write(const void *ptr, size_t length) { return _p->conn.write(ptr, length); }
+
+//---------------------------------------------------------------------------------------------------------------------
+size_t tcp_client::read(void *ptr, size_t length) { return _p->conn.read(ptr, length); }
+
+//---------------------------------------------------------------------------------------------------------------------
+bool tcp_client::force_write(const void *ptr, size_t length) { return _p->conn.force_write(ptr, length); }
+
+//---------------------------------------------------------------------------------------------------------------------
+bool tcp_client::force_read(void *ptr, size_t length) { return _p->conn.force_read(ptr, length); }
+
+//---------------------------------------------------------------------------------------------------------------------
+bool tcp_client::read_line(std::string &output) { return _p->conn.read_line(output); }
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace detail {
+
+struct async_tcp_client_impl
+{
+  detail::semaphore writeSemaphore;
+  detail::lockable_value<detail::data_block_buffer> writeBlocks;
+  detail::lockable_value<detail::data_block_buffer> readBlocks;
+  std::unique_ptr<std::thread> writeThread;
+  std::unique_ptr<std::thread> readThread;
+  std::atomic_int threadCounter = { 0 };
+
+  // Histograms of the server (none for outgoing clients) and of this client, created by track_latency()
+  ptr<detail::latency_recorders> serverLatency;
+  std::atomic<detail::latency_recorders *> clientLatency = { nullptr };
+
+  // When the read thread's last recv() returned, set only while timing
+  uint64_t receivedAt = 0;
+
+  ~async_tcp_client_impl() { delete clientLatency.load(); }
+
+  bool timed() const { return serverLatency || clientLatency.load(std::memory_order_relaxed); }
+
+  void record(detail::latency_recorder detail::latency_recorders::*which, uint64_t since)
+  {
+    uint64_t elapsed = detail::timestamp() - since;
+
+    if (serverLatency)
+      (serverLatency.get()->*which).record(elapsed);
+
+    if (detail::latency_recorders *client = clientLatency.load(std::memory_order_acquire))
+      (client->*which).record(elapsed);
+  }
+};
+
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//---------------------------------------------------------------------------------------------------------------------
+async_tcp_client::async_tcp_client(const std::string &address, int port, const connect_options &options)
+  : base_t(address, port, options)
+  , _ap(std::make_unique<detail::async_tcp_client_impl>())
+{
+  
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+async_tcp_client::async_tcp_client(ptr<basic_tcp_server> server, connection &conn)
+  : base_t(server, conn)
+  , _ap(new detail::async_tcp_client_impl())
+{
+  if (server)
+    _ap->serverLatency = server->_p->latency;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+async_tcp_client::~async_tcp_client()
+{
+  disconnect();
+
+  _ap->writeSemaphore.notify();
+
+  if (_ap->writeThread)
+    _ap->writeThread->join();
+
+  if (_ap->readThread)
+    _ap->readThread->join();
+
+  // Whatever was never written leaves the queue now
+  detail::metrics_registry::add(detail::metrics_registry::queued_bytes, -static_cast<int64_t>(_ap->writeBlocks->size()));
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+void async_tcp_client::push(const void *ptr, size_t length, opcode opcode)
+{
+  if (!ptr)
+    return;
+
+  uint64_t pushedAt = _ap->timed() ? detail::timestamp() : 0;
+
+  {
+    HEADSOCKET_LOCK(_ap->writeBlocks);
+    _ap->writeBlocks->block_begin(opcode).pushed_at = pushedAt;
+    _ap->writeBlocks->write(ptr, length);
+    _ap->writeBlocks->block_end();
+  }
+
+  detail::metrics_registry::add(detail::metrics_registry::queued_bytes, static_cast<int64_t>(length));
+  HEADSOCKET_TRACE_EVENT(push, id(), length);
+
+  _ap->writeSemaphore.notify();
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+void async_tcp_client::push(const void *ptr, size_t length)
+{
+  push(ptr, length, opcode::binary);
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+void async_tcp_client::push(const std::string &text)
+{
+  push(text.c_str(), text.length(), opcode::text);
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+size_t async_tcp_client::peek() const
+{
+  HEADSOCKET_LOCK(_ap->readBlocks);
+  return _ap->readBlocks->peek(nullptr);
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+size_t async_tcp_client::pop(void *ptr, size_t length)
+{
+  if (!ptr)
+    return invalid_operation;
+
+  if (!length)
+    return 0;
+
+  HEADSOCKET_LOCK(_ap->readBlocks);
+  return _ap->readBlocks->read(ptr, length);
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+void async_tcp_client::track_latency()
+{
+  auto recorders = new detail::latency_recorders();
+  detail::latency_recorders *expected = nullptr;
+
+  if (!_ap->clientLatency.compare_exchange_strong(expected, recorders))
+    delete recorders;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+latency_metrics async_tcp_client::latency() const
+{
+  detail::latency_recorders *recorders = _ap->clientLatency.load(std::memory_order_acquire);
+  return recorders ? recorders->snapshot() : latency_metrics();
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+void async_tcp_client::init_threads()
+{
+  _ap->threadCounter = 0;
+  _ap->writeThread = std::make_unique<std::thread>(std::bind(&async_tcp_client::write_thread, this));
+  _ap->readThread = std::make_unique<std::thread>(std::bind(&async_tcp_client::read_thread, this));
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+void async_tcp_client::write_thread()
+{
+  ++_ap->threadCounter;
+  detail::set_thread_name("AsyncTcpClient::writeThread");
+
+  std::vector<uint8_t> buffer(1024 * 1024);
+  std::vector<uint64_t> drained;
+
+  while (_p->isConnected)
+  {
+    size_t written = 0;
+    bool starving = false;
+    {
+      HEADSOCKET_LOCK(_ap->writeSemaphore);
+
+      if (!_p->isConnected)
+        break;
+
+      written = async_write_handler(buffer.data(), buffer.size());
+
+      // Handler wrote nothing and kept its signal, next block does not fit into the buffer
+      starving = !written && _ap->writeSemaphore.count;
+
+      // Push times of messages completed by this buffer
+      if (_ap->timed())
+      {
+        HEADSOCKET_LOCK(_ap->writeBlocks);
+        drained.swap(_ap->writeBlocks->drained);
+      }
+    }
+
+    if (written == invalid_operation)
+      break;
+
+    if (!written)
+    {
+      if (starving)
+        buffer.resize(buffer.size() * 2);
+    }
+    else
+    {
+      const char *cursor = reinterpret_cast<const char *>(buffer.data());
+      HEADSOCKET_TRACE_SCOPE(send_begin, id(), written);
+
+      while (written)
+      {
+        int result = send(_p->conn.impl()->socket, cursor, static_cast<int>(written), detail::send_flags);
+
+        if (!result || result == detail::socket_error)
+          break;
+
+        detail::metrics_registry::add(detail::metrics_registry::bytes_out, result);
+        cursor += result;
+        written -= static_cast<size_t>(result);
+      }
+
+      if (!written)
+        for (uint64_t pushedAt : drained)
+          _ap->record(&detail::latency_recorders::push_to_wire, pushedAt);
+    }
+
+    drained.clear();
+  }
+
+  kill_threads();
+  --_ap->threadCounter;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+size_t async_tcp_client::async_write_handler(uint8_t *ptr, size_t length)
+{
+  HEADSOCKET_LOCK(_ap->writeBlocks);
+ 
+  size_t toWrite = _ap->writeBlocks->peek(nullptr);
+  size_t toConsume = length > toWrite ? toWrite : length;
+  _ap->writeBlocks->read(ptr, toConsume);
+  detail::metrics_registry::add(detail::metrics_registry::queued_bytes, -static_cast<int64_t>(toConsume));
+
+  if (toWrite == toConsume)
+    _ap->writeSemaphore.consume();
+
+  return toConsume;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+size_t async_tcp_client::async_read_handler(uint8_t *ptr, size_t length)
+{
+  HEADSOCKET_LOCK(_ap->readBlocks);
+
+  _ap->readBlocks->block_begin(opcode::binary);
+  _ap->readBlocks->write(ptr, length);
+  _ap->readBlocks->block_end();
+
+  return length;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+void async_tcp_client::read_thread()
+{
+  ++_ap->threadCounter;
+  detail::set_thread_name("AsyncTcpClient::readThread");
+
+  std::vector<uint8_t> buffer(1024 * 1024);
+
+  // Start with whatever was read ahead during handshake, non-zero 'consumed' skips the first recv
+  size_t bufferBytes = _p->conn.impl()->take(buffer.data(), buffer.size()), consumed = bufferBytes;
+  _ap->receivedAt = _ap->timed() ? detail::timestamp() : 0;
+
+  while (_p->isConnected)
+  {
+    while (true)
+    {
+      int result = static_cast<int>(bufferBytes);
+
+      if (!result || !consumed)
+      {
+        result = recv(
+          _p->conn.impl()->socket,
+          reinterpret_cast<char *>(buffer.data() + bufferBytes),
+          static_cast<int>(buffer.size() - bufferBytes),
+          0);
+
+        if (!result || result == detail::socket_error)
+        {
+          consumed = invalid_operation;
+          break;
+        }
+
+        detail::metrics_registry::add(detail::metrics_registry::bytes_in, result);
+        bufferBytes += static_cast<size_t>(result);
+
+        if (_ap->timed())
+          _ap->receivedAt = detail::timestamp();
+      }
+
+      consumed = async_read_handler(buffer.data(), bufferBytes);
+
+      if (!consumed)
+      {
+        if (bufferBytes == buffer.size())
+          buffer.resize(buffer.size() * 2);
+      }
+      else
+        break;
+    }
+
+    if (consumed == invalid_operation)
+      break;
+
+    bufferBytes -= consumed;
+
+    if (bufferBytes)
+      memmove(buffer.data(), buffer.data() + consumed, bufferBytes);
+  }
+
+  kill_threads();
+  --_ap->threadCounter;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+void async_tcp_client::kill_threads()
+{
+  // Threads may not be stored yet (or at all), waking the writing thread up after disconnect is enough for both
+  disconnect();
+  _ap->writeSemaphore.notify();
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//---------------------------------------------------------------------------------------------------------------------
+web_socket_client::web_socket_client(const std::string &address, int port, const connect_options &options)
+  : base_t(address, port, options)
+{
+  // Masking keys only have to be unpredictable to whatever sits between client and server, not cryptographically
+  std::random_device seed;
+  _masking_state = (seed() ^ static_cast<uint32_t>(detail::timestamp()) ^ static_cast<uint32_t>(reinterpret_cast<uintptr_t>(this))) | 1;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+web_socket_client::web_socket_client(ptr<basic_tcp_server> server, connection &conn)
+  : base_t(server, conn)
+{
+
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+web_socket_client::~web_socket_client()
+{
+
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+void web_socket_client::on_connect()
+{
+  if (handshake())
+    base_t::on_connect();
+  else
+    disconnect();
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+bool web_socket_client::handshake()
+{
+  // Nonce goes out in plain text, taking it from the masking state would let anyone seeing it predict every mask
+  std::random_device random;
+  uint8_t nonce[16];
+
+  for (size_t i = 0; i < 16; i += 4)
+  {
+    uint32_t value = static_cast<uint32_t>(random());
+    memcpy(nonce + i, &value, 4);
+  }
+
+  char key[24];
+  std::string_view keyView(key, detail::utils::base64_encode(nonce, 16, key));
+
+  // IPv6 literals need brackets in Host header
+  std::string host = _p->address.find(':') != std::string::npos ? "[" + _p->address + "]" : _p->address;
+  std::string request = "GET " + upgrade_path() + " HTTP/1.1\r\nHost: " + host + ":" + std::to_string(_p->port) +
+    "\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: " + std::string(keyView) +
+    "\r\nSec-WebSocket-Version: 13\r\n\r\n";
+
+  // Server that never answers must not block create() forever
+  detail::set_socket_timeout(_p->conn.impl()->socket, 10);
+
+  std::string line, expected = detail::web_socket_accept(keyView);
+  bool switched = false, upgrade = false, connectionUpgrade = false, accepted = false;
+
+  auto trim = [](std::string_view text)
+  {
+    while (!text.empty() && (text.front() == ' ' || text.front() == '\t')) text.remove_prefix(1);
+    while (!text.empty() && (text.back() == ' ' || text.back() == '\t')) text.remove_suffix(1);
+    return text;
+  };
+
+  if (_p->conn.force_write(request.c_str(), request.length()) && _p->conn.read_line(line))
+  {
+    // Status line is "HTTP/<version> 101 <reason>", any amount of spaces between the parts
+    std::string_view status = line;
+    size_t space = status.find(' ');
+
+    if (status.substr(0, 5) == "HTTP/" && space != std::string_view::npos)
+    {
+      status = trim(status.substr(space));
+      switched = status.substr(0, 3) == "101" && (status.length() == 3 || status[3] == ' ');
+    }
+
+    // RFC 6455 4.1: the connection fails without "Upgrade: websocket" and "Connection: Upgrade" in the response
+    while (_p->conn.read_line(line) && !line.empty())
+    {
+      size_t colon = line.find(':');
+
+      if (colon == std::string::npos)
+        continue;
+
+      std::string_view name = trim(std::string_view(line).substr(0, colon));
+      std::string_view value = trim(std::string_view(line).substr(colon + 1));
+
+      if (detail::iequals(name, "Upgrade"))
+        upgrade = detail::iequals(value, "websocket");
+      else if (detail::iequals(name, "Connection"))
+      {
+        // Comma separated list of tokens
+        for (size_t pos = 0; pos <= value.length();)
+        {
+          size_t comma = value.find(',', pos);
+          comma = comma == std::string_view::npos ? value.length() : comma;
+          connectionUpgrade = connectionUpgrade || detail::iequals(trim(value.substr(pos, comma - pos)), "Upgrade");
+          pos = comma + 1;
+        }
+      }
+      else if (detail::iequals(name, "Sec-WebSocket-Accept"))
+        accepted = value == expected;
+    }
+  }
+
+  detail::set_socket_timeout(_p->conn.impl()->socket, 0);
+  return switched && upgrade && connectionUpgrade && accepted;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+uint32_t web_socket_client::next_masking_key()
+{
+  _masking_state ^= _masking_state << 13;
+  _masking_state ^= _masking_state >> 17;
+  _masking_state ^= _masking_state << 5;
+  return _masking_state;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+size_t web_socket_client::peek(opcode *op) const
+{
+  HEADSOCKET_LOCK(_ap->readBlocks);
+  return _ap->readBlocks->peek(op);
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+size_t web_socket_client::async_write_handler(uint8_t *ptr, size_t length)
+{
+  uint8_t *cursor = ptr;
+  HEADSOCKET_LOCK(_ap->writeBlocks);
+
+  while (length >= 16)
+  {
+    // Signal of a block already written before push() got to notify, there is nothing to frame
+    if (_ap->writeBlocks->blocks.empty())
+    {
+      _ap->writeSemaphore.consume();
+      break;
+    }
+
+    opcode op = opcode::continuation;
+    size_t toWrite = _ap->writeBlocks->peek(&op);
+    size_t toConsume = (length - 15) > frame_size_limit ? frame_size_limit : (length - 15);
+    toConsume = toConsume > toWrite ? toWrite : toConsume;
+
+    frame_header header;
+    header.fin = (toWrite - toConsume) == 0;
+    header.op = op;
+    header.masked = _masking_state != 0;
+    header.payload_length = toConsume;
+    header.masking_key = header.masked ? next_masking_key() : 0;
+
+    size_t headerSize = header.write(cursor, length);
+    cursor += headerSize;
+    length -= headerSize;
+    _ap->writeBlocks->read(cursor, toConsume, header.masking_key);
+    cursor += toConsume;
+    length -= toConsume;
+
+    detail::metrics_registry::add_frame(detail::metrics_registry::frames_out, op);
+    detail::metrics_registry::add(detail::metrics_registry::queued_bytes, -static_cast<int64_t>(toConsume));
+
+    if (header.fin)
+      _ap->writeSemaphore.consume();
+
+    if (!_ap->writeBlocks->peek(&op))
+      break;
+  }
+
+  return cursor - ptr;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+size_t web_socket_client::async_read_handler(uint8_t *ptr, size_t length)
+{
+  uint8_t *cursor = ptr, *end = ptr + length;
+  HEADSOCKET_LOCK(_ap->readBlocks);
+
+  // Every complete frame in the buffer is handled in one pass, only an incomplete one is left for the next call
+  while (true)
+  {
+    if (!_payload_size)
+    {
+      frame_header header;
+      size_t headerSize = header.read(cursor, end - cursor);
+
+      if (!headerSize)
+        break;
+
+      detail::metrics_registry::add_frame(detail::metrics_registry::frames_in, header.op);
+      HEADSOCKET_TRACE_EVENT(frame_in, id(), header.payload_length);
+
+      // Continuation frames inherit the opcode of the message being assembled (control frames never stay in the buffer)
+      if (header.op != opcode::continuation)
+        _ap->readBlocks->block_begin(header.op);
+      else if (_ap->readBlocks->blocks.empty() || _ap->readBlocks->blocks.back().is_completed)
+        return invalid_operation;
+      else
+        header.op = _ap->readBlocks->blocks.back().op;
+
+      _current_header = header;
+      _payload_size = header.payload_length;
+      cursor += headerSize;
+    }
+
+    size_t available = end - cursor;
+    size_t toConsume = available >= _payload_size ? _payload_size : available;
+    _ap->readBlocks->write(cursor, toConsume);
+    _payload_size -= toConsume;
+    cursor += toConsume;
+
+    if (_payload_size)
+      break;
+
+    if (_current_header.masked)
+    {
+      size_t len = _current_header.payload_length;
+      detail::utils::xor32(_current_header.masking_key, _ap->readBlocks->buffer.data() + _ap->readBlocks->buffer.size() - len, len);
+    }
+
+    if (!_current_header.fin)
+      continue;
+
+    data_block &db = _ap->readBlocks->blocks.back();
+
+    switch (_current_header.op)
+    {
+      case opcode::text:
+        _ap->readBlocks->buffer.push_back(0);
+        ++db.length;
+        // fall through
+
+      case opcode::binary:
+        _ap->readBlocks->block_end();
+
+        if (_ap->receivedAt)
+          _ap->record(&detail::latency_recorders::receive_to_callback, _ap->receivedAt);
+
+        {
+          HEADSOCKET_TRACE_SCOPE(callback_begin, id(), db.length);
+
+          if (!async_received_data(db, _ap->readBlocks->buffer.data() + db.offset, db.length))
+            break;
+        }
+
+        _ap->readBlocks->block_remove();
+        break;
+
+      case opcode::ping:
+        push(_ap->readBlocks->buffer.data() + db.offset, db.length, opcode::pong);
+        _ap->readBlocks->block_remove();
+        break;
+
+      case opcode::connection_close:
+        _ap->readBlocks->block_remove();
+        kill_threads();
+        return cursor - ptr;
+
+      default:
+        _ap->readBlocks->block_remove();
+        break;
+    }
+  }
+
+  return cursor - ptr;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+size_t web_socket_client::frame_header::read(const uint8_t *ptr, size_t length)
+{
+  if (length < 2)
+    return 0;
+
+  uint16_t head = detail::utils::load_be<uint16_t>(ptr);
+  size_t lengthCode = head & 0x7F;
+
+  this->fin = (head & 0x8000) != 0;
+  this->op = static_cast<opcode>((head >> 8) & 0x0F);
+  this->masked = (head & 0x80) != 0;
+
+  // Small masked frames (everything a chat-like client sends) have a fixed 6 byte header
+  if (this->masked && lengthCode < 126 && length >= 6)
+  {
+    this->payload_length = lengthCode;
+    memcpy(&this->masking_key, ptr + 2, 4);
+    return 6;
+  }
+
+  size_t extendedSize = lengthCode < 126 ? 0 : (lengthCode == 126 ? 2 : 8);
+  size_t headerSize = 2 + extendedSize + (this->masked ? 4 : 0);
+
+  if (length < headerSize)
+    return 0;
+
+  if (lengthCode < 126)
+    this->payload_length = lengthCode;
+  else if (lengthCode == 126)
+    this->payload_length = detail::utils::load_be<uint16_t>(ptr + 2);
+  else
+    this->payload_length = static_cast<size_t>(detail::utils::load_be<uint64_t>(ptr + 2) & 0x7FFFFFFFFFFFFFFFULL);
+
+  if (this->masked)
+    memcpy(&this->masking_key, ptr + 2 + extendedSize, 4);
+
+  return headerSize;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+size_t web_socket_client::frame_header::write(uint8_t *ptr, size_t length) const
+{
+  size_t extendedSize = this->payload_length < 126 ? 0 : (this->payload_length < 65536 ? 2 : 8);
+  size_t headerSize = 2 + extendedSize + (this->masked ? 4 : 0);
+
+  if (length < headerSize)
+    return 0;
+
+  ptr[0] = (this->fin ? 0x80 : 0x00) | static_cast<uint8_t>(this->op);
+  ptr[1] = (this->masked ? 0x80 : 0x00) |
+    static_cast<uint8_t>(extendedSize == 0 ? this->payload_length : (extendedSize == 2 ? 126 : 127));
+
+  if (extendedSize == 2)
+    detail::utils::store_be(ptr + 2, static_cast<uint16_t>(this->payload_length));
+  else if (extendedSize == 8)
+    detail::utils::store_be(ptr + 2, static_cast<uint64_t>(this->payload_length));
+
+  if (this->masked)
+    memcpy(ptr + 2 + extendedSize, &this->masking_key, 4);
+
+  return headerSize;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace detail {
+
+struct connection_pool_impl
+{
+  struct idle_client
+  {
+    ptr<basic_tcp_client> client;
+    uint64_t since;
+  };
+
+  mutable std::mutex mutex;
+  basic_connection_pool::options options;
+  basic_connection_pool::factory create;
+
+  // Most recently checked in last, checkouts take those (still warm, older ones age out)
+  std::unordered_map<std::string, std::deque<idle_client>> idle;
+  basic_connection_pool::stats counters;
+};
+
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+basic_connection_pool::basic_connection_pool(const options &opts, factory create)
+  : _p(std::make_unique<detail::connection_pool_impl>())
+{
+  _p->options = opts;
+  _p->create = create;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+basic_connection_pool::~basic_connection_pool()
+{
+  clear();
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+ptr<basic_tcp_client> basic_connection_pool::checkout_client(const std::string &address, int port)
+{
+  std::string key = detail::dns_cache::key(address, port);
+
+  while (true)
+  {
+    ptr<basic_tcp_client> client;
+    uint64_t since = 0;
+    {
+      HEADSOCKET_LOCK(_p->mutex);
+      auto it = _p->idle.find(key);
+
+      if (it == _p->idle.end())
+      {
+        ++_p->counters.misses;
+        break;
+      }
+
+      client = std::move(it->second.back().client);
+      since = it->second.back().since;
+      it->second.pop_back();
+
+      if (it->second.empty())
+        _p->idle.erase(it);
+    }
+
+    // Liveness check polls the socket, so it runs without the lock
+    if (!is_expired(*client, since, detail::timestamp()) && is_reusable(*client))
+    {
+      HEADSOCKET_LOCK(_p->mutex);
+      ++_p->counters.hits;
+      return client;
+    }
+
+    std::vector<ptr<basic_tcp_client>> dropped(1, client);
+    drop(dropped);
+  }
+
+  return _p->create(address, port, _p->options.connect);
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+void basic_connection_pool::checkin_client(ptr<basic_tcp_client> client)
+{
+  if (!client)
+    return;
+
+  std::vector<ptr<basic_tcp_client>> dropped;
+  uint64_t now = detail::timestamp();
+
+  // Accepted clients have no host to be checked out for
+  if (!client->_p->connectedAt || is_expired(*client, now, now) || !is_reusable(*client))
+    dropped.push_back(client);
+  else
+  {
+    HEADSOCKET_LOCK(_p->mutex);
+    auto &idle = _p->idle[detail::dns_cache::key(client->_p->address, client->_p->port)];
+    idle.push_back({ client, now });
+
+    while (idle.size() > _p->options.max_idle)
+    {
+      dropped.push_back(std::move(idle.front().client));
+      idle.pop_front();
+    }
+  }
+
+  drop(dropped);
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+void basic_connection_pool::prune()
+{
+  std::vector<ptr<basic_tcp_client>> dropped;
+  uint64_t now = detail::timestamp();
+  {
+    HEADSOCKET_LOCK(_p->mutex);
+
+    for (auto it = _p->idle.begin(); it != _p->idle.end();)
+    {
+      auto &idle = it->second;
+
+      for (auto entry = idle.begin(); entry != idle.end();)
+      {
+        if (is_expired(*entry->client, entry->since, now) || !entry->client->is_connected())
+        {
+          dropped.push_back(std::move(entry->client));
+          entry = idle.erase(entry);
+        }
+        else
+          ++entry;
+      }
+
+      it = idle.empty() ? _p->idle.erase(it) : std::next(it);
+    }
+  }
+
+  drop(dropped);
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+void basic_connection_pool::clear()
+{
+  std::vector<ptr<basic_tcp_client>> dropped;
+  {
+    HEADSOCKET_LOCK(_p->mutex);
+
+    for (auto &idle : _p->idle)
+      for (auto &entry : idle.second)
+        dropped.push_back(std::move(entry.client));
+
+    _p->idle.clear();
+  }
+
+  drop(dropped);
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+basic_connection_pool::stats basic_connection_pool::statistics() const
+{
+  HEADSOCKET_LOCK(_p->mutex);
+  stats result = _p->counters;
+
+  for (auto &idle : _p->idle)
+    result.idle += idle.second.size();
+
+  return result;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+bool basic_connection_pool::is_expired(basic_tcp_client &client, uint64_t idleSince, uint64_t now) const
+{
+  int maxIdle = _p->options.max_idle_ms, maxAge = _p->options.max_age_ms;
+
+  // Zero (or less) is no limit, like timeouts of connect_options
+  return (maxIdle > 0 && now - idleSince > static_cast<uint64_t>(maxIdle) * 1000000) ||
+    (maxAge > 0 && now - client._p->connectedAt > static_cast<uint64_t>(maxAge) * 1000000);
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+bool basic_connection_pool::is_reusable(basic_tcp_client &client)
+{
+  if (!client.is_connected())
+    return false;
+
+  // Reading threads own sockets of asynchronous clients, a closed one disconnects them
+  if (async_tcp_client *async = dynamic_cast<async_tcp_client *>(&client))
+    return !async->peek();
+
+  detail::connection_impl &conn = *client._p->conn.impl();
+
+  if (conn.buffered())
+    return false;
+
+  pollfd fd = { };
+  fd.fd = conn.socket;
+  fd.events = POLLIN;
+  return !detail::poll_sockets(&fd, 1, 0);
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+void basic_connection_pool::drop(std::vector<ptr<basic_tcp_client>> &clients)
+{
+  for (auto &client : clients)
+    client->disconnect();
+
+  if (!clients.empty())
+  {
+    HEADSOCKET_LOCK(_p->mutex);
+    _p->counters.dropped += clients.size();
+  }
+
+  clients.clear();
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace detail {
+
+// Formatted events are appended once, every subscriber only keeps its absolute offset into the stream
+struct event_stream_impl
+{
+  mutable std::mutex mutex;
+  std::vector<char> buffer;
+  uint64_t base = 0;
+  size_t limit;
+  std::vector<ptr<event_stream_client>> subscribers;
+
+  uint64_t end() const { return base + buffer.size(); }
+};
+
+class event_stream_client : public async_tcp_client
+{
+  HEADSOCKET_CLIENT(event_stream_client, async_tcp_client)
+
+public:
+  ptr<event_stream> stream;
+  uint64_t offset = 0;
+
+  void wake() { _ap->writeSemaphore.notify(); }
+
+protected:
+  size_t async_write_handler(uint8_t *ptr, size_t length) override
+  {
+    auto &sp = *stream->_p;
+    HEADSOCKET_LOCK(sp.mutex);
+
+    size_t available = offset >= sp.base ? static_cast<size_t>(sp.end() - offset) : 0;
+    size_t toCopy = available < length ? available : length;
+
+    if (toCopy)
+    {
+      memcpy(ptr, sp.buffer.data() + (offset - sp.base), toCopy);
+      offset += toCopy;
+    }
+
+    // All caught up. Write thread holds the semaphore locked while calling this, publishers notify under the same lock,
+    // so nothing published after the copy gets lost.
+    if (toCopy == available)
+      _ap->writeSemaphore.consume_all();
+
+    return toCopy;
+  }
+
+  // Clients have nothing to say, reads only detect closed connections
+  size_t async_read_handler(uint8_t *ptr, size_t length) override { return length; }
+
+  void on_disconnect() override
+  {
+    if (stream)
+    {
+      auto &sp = *stream->_p;
+      HEADSOCKET_LOCK(sp.mutex);
+
+      for (size_t i = 0; i < sp.subscribers.size(); ++i)
+        if (sp.subscribers[i].get() == this)
+        {
+          sp.subscribers.erase(sp.subscribers.begin() + i);
+          break;
+        }
+    }
+
+    async_tcp_client::on_disconnect();
+  }
+};
+
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+event_stream::event_stream(size_t bufferLimit)
+  : _p(std::make_unique<detail::event_stream_impl>())
+{
+  _p->limit = bufferLimit;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+event_stream::~event_stream()
+{
+
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+ptr<event_stream> event_stream::create(size_t bufferLimit)
+{
+  return ptr<event_stream>(new event_stream(bufferLimit));
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+void event_stream::publish(const std::string_view &data, const std::string_view &event, const std::string_view &id)
+{
+  std::string text;
+  text.reserve(data.length() + event.length() + id.length() + 32);
+
+  if (!id.empty())
+    (text += "id: ").append(id.data(), id.length()) += '\n';
+
+  if (!event.empty())
+    (text += "event: ").append(event.data(), event.length()) += '\n';
+
+  for (size_t pos = 0; pos <= data.length();)
+  {
+    size_t newLine = data.find('\n', pos);
+    size_t end = newLine == std::string_view::npos ? data.length() : newLine;
+
+    (text += "data: ").append(data.data() + pos, end - pos) += '\n';
+    pos = end + 1;
+  }
+
+  text += '\n';
+  append(text);
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+void event_stream::comment(const std::string_view &text)
+{
+  std::string line = ": ";
+  line.append(text.data(), text.length());
+  line += "\n\n";
+  append(line);
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+void event_stream::append(const std::string &text)
+{
+  std::vector<ptr<detail::event_stream_client>> notify, slow;
+
+  {
+    HEADSOCKET_LOCK(_p->mutex);
+    _p->buffer.insert(_p->buffer.end(), text.begin(), text.end());
+
+    // Subscribers lagging behind more than the limit are dropped, the rest are waiting for the data
+    uint64_t oldest = _p->end();
+
+    for (auto &subscriber : _p->subscribers)
+      if (_p->end() - subscriber->offset > _p->limit)
+        slow.push_back(subscriber);
+      else
+      {
+        notify.push_back(subscriber);
+        oldest = subscriber->offset < oldest ? subscriber->offset : oldest;
+      }
+
+    // Bytes everybody has sent are dropped once they make up half of the buffer
+    size_t sent = static_cast<size_t>(oldest - _p->base);
+
+    if (sent && sent * 2 >= _p->buffer.size())
+    {
+      _p->buffer.erase(_p->buffer.begin(), _p->buffer.begin() + sent);
+      _p->base = oldest;
+    }
+  }
+
+  for (auto &subscriber : notify)
+    subscriber->wake();
+
+  for (auto &subscriber : slow)
+    subscriber->disconnect();
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+size_t event_stream::subscribers() const
+{
+  HEADSOCKET_LOCK(_p->mutex);
+  return _p->subscribers.size();
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace detail {
+
+struct file_info
+{
+  uint64_t size = 0;
+  int64_t mtime = 0;
+  bool is_directory = false;
+
+  bool read(const std::string &fileName)
+  {
+#ifdef HEADSOCKET_PLATFORM_WINDOWS
+    struct _stat64 st;
+    if (_stat64(fileName.c_str(), &st))
+      return false;
+
+    is_directory = (st.st_mode & _S_IFDIR) != 0;
+#else
+    struct stat st;
+    if (stat(fileName.c_str(), &st))
+      return false;
+
+    is_directory = S_ISDIR(st.st_mode);
+#endif
+    size = static_cast<uint64_t>(st.st_size);
+    mtime = static_cast<int64_t>(st.st_mtime);
+    return true;
+  }
+
+  bool operator==(const file_info &fi) const { return size == fi.size && mtime == fi.mtime; }
+
+  std::string etag() const
+  {
+    char buff[48];
+    HEADSOCKET_SPRINTF(buff, "\"%llx-%llx\"", static_cast<unsigned long long>(size), static_cast<unsigned long long>(mtime));
+    return buff;
+  }
+
+  static const char *content_type(const std::string &fileName)
+  {
+    static const char *types[][2] =
+    {
+      { ".html", "text/html" }, { ".htm", "text/html" }, { ".js", "application/javascript" },
+      { ".css", "text/css" }, { ".json", "application/json" }, { ".txt", "text/plain" },
+      { ".png", "image/png" }, { ".jpg", "image/jpeg" }, { ".jpeg", "image/jpeg" }, { ".gif", "image/gif" },
+      { ".svg", "image/svg+xml" }, { ".ico", "image/x-icon" }, { ".wasm", "application/wasm" },
+    };
+
+    auto dot = fileName.rfind('.');
+
+    if (dot != std::string::npos)
+      for (auto &type : types)
+        if (iequals(std::string_view(fileName).substr(dot), type[0]))
+          return type[1];
+
+    return "application/octet-stream";
+  }
+};
+
+// Read-only file contents (memory mapped where possible) with precomputed ETag
+struct file_contents
+{
+  const char *data = nullptr;
+  size_t size = 0;
+  file_info info;
+  std::string etag;
+
+#if defined(HEADSOCKET_PLATFORM_ANDROID) || defined(HEADSOCKET_PLATFORM_NIX)
+  ~file_contents()
+  {
+    if (data)
+      munmap(const_cast<char *>(data), size);
+  }
+
+  bool load(const std::string &fileName, const file_info &fi)
+  {
+    info = fi;
+    etag = fi.etag();
+
+    if (!fi.size)
+      return true;
+
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0)
+      return false;
+
+    void *mapping = mmap(nullptr, static_cast<size_t>(fi.size), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (mapping == MAP_FAILED)
+      return false;
+
+    data = static_cast<const char *>(mapping);
+    size = static_cast<size_t>(fi.size);
+    return true;
+  }
+#else
+  std::vector<char> storage;
+
+  bool load(const std::string &fileName, const file_info &fi)
+  {
+    info = fi;
+    etag = fi.etag();
+
+    FILE *f = fopen(fileName.c_str(), "rb");
+    if (!f)
+      return false;
+
+    storage.resize(static_cast<size_t>(fi.size));
+    size = fread(storage.data(), 1, storage.size(), f);
+    data = storage.data();
+    fclose(f);
+    return size == storage.size();
+  }
+#endif
+};
+
+// LRU cache of small files, entries are shared, so eviction never pulls data from under an ongoing send
+class file_cache
+{
+public:
+  typedef ptr<const file_contents> entry_ptr;
+
+  entry_ptr get(const std::string &fileName, const file_info &info, size_t cacheSize)
+  {
+    {
+      HEADSOCKET_LOCK(_mutex);
+      auto iter = _index.find(fileName);
+
+      if (iter != _index.end())
+      {
+        if (iter->second->second->info == info)
+        {
+          _lru.splice(_lru.begin(), _lru, iter->second);
+          return _lru.front().second;
+        }
+
+        remove(iter);
+      }
+    }
+
+    auto contents = std::make_shared<file_contents>();
+    if (!contents->load(fileName, info))
+      return nullptr;
+
+    HEADSOCKET_LOCK(_mutex);
+    auto iter = _index.find(fileName);
+
+    if (iter != _index.end())
+      remove(iter);
+
+    _lru.emplace_front(fileName, contents);
+    _index[fileName] = _lru.begin();
+    _total += contents->size;
+
+    while (_total > cacheSize && _lru.size() > 1)
+      remove(_index.find(_lru.back().first));
+
+    return contents;
+  }
+
+private:
+  typedef std::list<std::pair<std::string, entry_ptr>> lru_t;
+
+  void remove(std::unordered_map<std::string, lru_t::iterator>::iterator iter)
+  {
+    _total -= iter->second->second->size;
+    _lru.erase(iter->second);
+    _index.erase(iter);
+  }
+
+  std::mutex _mutex;
+  lru_t _lru;
+  std::unordered_map<std::string, lru_t::iterator> _index;
+  size_t _total = 0;
+};
+
+// Single pass LZ77 with fixed Huffman codes, fast and compact, good enough for text payloads
+class deflater
+{
+public:
+  enum format_type { zlib, gzip };
+
+  static std::string compress(const void *ptr, size_t length, format_type format)
+  {
+    deflater d(static_cast<const uint8_t *>(ptr), length);
+
+    if (format == gzip)
+      d._out.append("\x1f\x8b\x08\x00\x00\x00\x00\x00\x00\xff", 10);
+    else
+      d._out.append("\x78\x01", 2);
+
+    d.run();
+
+    if (format == gzip)
+    {
+      d.put_word_le(crc32(d._data, length));
+      d.put_word_le(static_cast<uint32_t>(length));
+    }
+    else
+    {
+      uint32_t adler = adler32(d._data, length);
+      for (int shift = 24; shift >= 0; shift -= 8)
+        d._out += static_cast<char>((adler >> shift) & 0xFF);
+    }
+
+    return std::move(d._out);
+  }
+
+  static uint32_t crc32(const uint8_t *data, size_t length)
+  {
+    static const struct table_type
+    {
+      uint32_t values[256];
+
+      table_type()
+      {
+        for (uint32_t i = 0; i < 256; ++i)
+        {
+          uint32_t c = i;
+          for (int k = 0; k < 8; ++k)
+            c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+
+          values[i] = c;
+        }
+      }
+    } table;
+
+    uint32_t c = 0xFFFFFFFFu;
+    for (size_t i = 0; i < length; ++i)
+      c = table.values[(c ^ data[i]) & 0xFF] ^ (c >> 8);
+
+    return c ^ 0xFFFFFFFFu;
+  }
+
+  static uint32_t adler32(const uint8_t *data, size_t length)
+  {
+    uint32_t a = 1, b = 0;
+
+    while (length)
+    {
+      // Sums cannot overflow within 5552 bytes
+      size_t block = length < 5552 ? length : 5552;
+      length -= block;
+
+      for (; block; --block)
+      {
+        a += *data++;
+        b += a;
+      }
+
+      a %= 65521;
+      b %= 65521;
+    }
+
+    return (b << 16) | a;
+  }
+
+private:
+  static const size_t window_size = 32768;
+  static const size_t hash_size = 1 << 15;
+  static const size_t max_match = 258;
+  static const int max_chain = 32;
+
+  deflater(const uint8_t *data, size_t length): _data(data), _length(length) { _out.reserve(length / 2 + 64); }
+
+  void put_bits(uint32_t value, int count)
+  {
+    _bits |= value << _count;
+    _count += count;
+
+    while (_count >= 8)
+    {
+      _out += static_cast<char>(_bits & 0xFF);
+      _bits >>= 8;
+      _count -= 8;
+    }
+  }
+
+  // Huffman codes are packed starting from their most significant bit
+  void put_code(uint32_t code, int count)
+  {
+    uint32_t reversed = 0;
+    for (int i = 0; i < count; ++i)
+      reversed |= ((code >> i) & 1) << (count - 1 - i);
+
+    put_bits(reversed, count);
+  }
+
+  void put_word_le(uint32_t value)
+  {
+    for (int shift = 0; shift < 32; shift += 8)
+      _out += static_cast<char>((value >> shift) & 0xFF);
+  }
+
+  void put_literal(uint8_t value)
+  {
+    if (value < 144)
+      put_code(0x30 + value, 8);
+    else
+      put_code(0x190 + value - 144, 9);
+  }
+
+  void put_symbol(int symbol)
+  {
+    if (symbol < 280)
+      put_code(symbol - 256, 7);
+    else
+      put_code(0xC0 + symbol - 280, 8);
+  }
+
+  void put_match(size_t length, size_t distance)
+  {
+    static const uint16_t length_base[] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
+      67, 83, 99, 115, 131, 163, 195, 227, 258 };
+    static const uint8_t length_extra[] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4,
+      5, 5, 5, 5, 0 };
+    static const uint16_t distance_base[] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385,
+      513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+    static const uint8_t distance_extra[] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10,
+      10, 11, 11, 12, 12, 13, 13 };
+
+    int l = 0;
+    while (l < 28 && length_base[l + 1] <= length) ++l;
+
+    put_symbol(257 + l);
+    put_bits(static_cast<uint32_t>(length - length_base[l]), length_extra[l]);
+
+    int d = 0;
+    while (d < 29 && distance_base[d + 1] <= distance) ++d;
+
+    put_code(d, 5);
+    put_bits(static_cast<uint32_t>(distance - distance_base[d]), distance_extra[d]);
+  }
+
+  uint32_t hash(size_t pos) const
+  {
+    uint32_t value = _data[pos] | (_data[pos + 1] << 8) | (_data[pos + 2] << 16);
+    return (value * 2654435761u) >> 17;
+  }
+
+  void insert(size_t pos)
+  {
+    if (pos + 3 > _length)
+      return;
+
+    uint32_t h = hash(pos);
+    _prev[pos & (window_size - 1)] = _head[h];
+    _head[h] = static_cast<int32_t>(pos);
+  }
+
+  void run()
+  {
+    _head.assign(hash_size, -1);
+    _prev.assign(window_size, -1);
+
+    // One final block with fixed codes
+    put_bits(1, 1);
+    put_bits(1, 2);
+
+    for (size_t pos = 0; pos < _length;)
+    {
+      size_t bestLength = 0, bestDistance = 0;
+
+      if (pos + 3 <= _length)
+      {
+        size_t limit = _length - pos < max_match ? _length - pos : max_match;
+        int32_t candidate = _head[hash(pos)];
+
+        for (int chain = max_chain; candidate >= 0 && pos - candidate <= window_size && chain; --chain)
+        {
+          const uint8_t *a = _data + candidate, *b = _data + pos;
+          size_t matched = 0;
+          while (matched < limit && a[matched] == b[matched]) ++matched;
+
+          if (matched > bestLength)
+          {
+            bestLength = matched;
+            bestDistance = pos - candidate;
+
+            if (matched == limit)
+              break;
+          }
+
+          candidate = _prev[candidate & (window_size - 1)];
+        }
+      }
+
+      if (bestLength >= 3)
+      {
+        put_match(bestLength, bestDistance);
+
+        for (size_t end = pos + bestLength; pos < end; ++pos)
+          insert(pos);
+      }
+      else
+      {
+        put_literal(_data[pos]);
+        insert(pos++);
+      }
+    }
+
+    put_symbol(256);
+
+    if (_count)
+      put_bits(0, 8 - _count);
+  }
+
+  const uint8_t *_data;
+  size_t _length;
+  std::string _out;
+  uint32_t _bits = 0;
+  int _count = 0;
+  std::vector<int32_t> _head;
+  std::vector<int32_t> _prev;
+};
+
+// Ready to send response without status line and connection headers, in plain and compressed variants
+struct cached_response
+{
+  enum encoding_type { identity, gzip, deflate, encoding_count };
+
+  std::string key;
+  std::chrono::steady_clock::time_point expires;
+  std::string variants[encoding_count];
+  size_t head_lengths[encoding_count] = { };
+
+  size_t size() const { return key.length() + variants[0].length() + variants[1].length() + variants[2].length(); }
+
+  void build(const http_server::response &resp)
+  {
+    std::string compressed[encoding_count];
+
+    // Compressed variants are kept only when they actually save something
+    if (resp.message.length() > 256)
+    {
+      compressed[gzip] = deflater::compress(resp.message.data(), resp.message.length(), deflater::gzip);
+      compressed[deflate] = deflater::compress(resp.message.data(), resp.message.length(), deflater::zlib);
+    }
+
+    static const char *encodings[] = { nullptr, "gzip", "deflate" };
+    bool vary = !compressed[gzip].empty() && compressed[gzip].length() < resp.message.length();
+
+    for (int i = 0; i < encoding_count; ++i)
+    {
+      const std::string &body = i == identity ? resp.message : compressed[i];
+
+      if (i != identity && (body.empty() || body.length() >= resp.message.length()))
+        continue;
+
+      std::string &out = variants[i];
+      out = "Content-Type: " + resp.content_type + "\r\n";
+
+      if (encodings[i])
+        out += std::string("Content-Encoding: ") + encodings[i] + "\r\n";
+
+      if (vary)
+        out += "Vary: Accept-Encoding\r\n";
+
+      out += "Content-Length: " + std::to_string(body.length()) + "\r\n\r\n";
+      head_lengths[i] = out.length();
+      out += body;
+    }
+  }
+
+  // Picks smallest variant allowed by Accept-Encoding header value
+  encoding_type select(const std::string_view &acceptEncoding) const
+  {
+    if (!variants[gzip].empty() && accepts(acceptEncoding, "gzip"))
+      return gzip;
+
+    if (!variants[deflate].empty() && accepts(acceptEncoding, "deflate"))
+      return deflate;
+
+    return identity;
+  }
+
+  static bool accepts(std::string_view header, const std::string_view &coding)
+  {
+    while (!header.empty())
+    {
+      size_t comma = header.find(',');
+      std::string_view token = header.substr(0, comma);
+      header = comma == std::string_view::npos ? std::string_view() : header.substr(comma + 1);
+
+      size_t semicolon = token.find(';');
+      std::string_view name = token.substr(0, semicolon);
+
+      while (!name.empty() && name.front() == ' ') name.remove_prefix(1);
+      while (!name.empty() && name.back() == ' ') name.remove_suffix(1);
+
+      if (!iequals(name, coding) && name != "*")
+        continue;
+
+      // "q=0" explicitly refuses the coding
+      size_t q = semicolon == std::string_view::npos ? std::string_view::npos : token.find("q=", semicolon);
+      if (q == std::string_view::npos)
+        return true;
+
+      std::string_view value = token.substr(q + 2);
+      while (!value.empty() && value.back() == ' ') value.remove_suffix(1);
+      return value.find_first_not_of("0.") != std::string_view::npos;
+    }
+
+    return false;
+  }
+};
+
+class response_cache
+{
+public:
+  typedef ptr<const cached_response> entry_ptr;
+
+  bool empty() const { return !_count.load(); }
+
+  entry_ptr find(const std::string &key)
+  {
+    HEADSOCKET_LOCK(_mutex);
+    auto iter = _index.find(key);
+
+    if (iter == _index.end())
+      return nullptr;
+
+    if ((*iter->second)->expires <= std::chrono::steady_clock::now())
+    {
+      remove(iter);
+      return nullptr;
+    }
+
+    _lru.splice(_lru.begin(), _lru, iter->second);
+    return _lru.front();
+  }
+
+  void insert(entry_ptr entry, size_t cacheSize)
+  {
+    if (entry->size() > cacheSize)
+      return;
+
+    HEADSOCKET_LOCK(_mutex);
+    auto iter = _index.find(entry->key);
+
+    if (iter != _index.end())
+      remove(iter);
+
+    _lru.push_front(entry);
+    _index[entry->key] = _lru.begin();
+    _total += entry->size();
+
+    while (_total > cacheSize && _lru.size() > 1)
+      remove(_index.find(_lru.back()->key));
+
+    _count = _lru.size();
+  }
+
+  // Length-prefixed path and query parameters sorted by name, so parameter order does not matter
+  static std::string key(const http_request &req, size_t paramCount);
+
+private:
+  typedef std::list<entry_ptr> lru_t;
+
+  void remove(std::unordered_map<std::string, lru_t::iterator>::iterator iter)
+  {
+    _total -= (*iter->second)->size();
+    _lru.erase(iter->second);
+    _index.erase(iter);
+    _count = _lru.size();
+  }
+
+  std::mutex _mutex;
+  lru_t _lru;
+  std::unordered_map<std::string, lru_t::iterator> _index;
+  size_t _total = 0;
+  std::atomic<size_t> _count { 0 };
+};
+
+// Routes compiled into a trie of path segments, children are sorted for binary search over string_views
+class route_table
+{
+public:
+  static const size_t no_route = static_cast<size_t>(-1);
+
+  static const unsigned any_method = ~0u;
+
+  // Common methods are matched by bit, any other one has no bit (0) and is compared by name
+  static unsigned method_bit(const std::string_view &method)
+  {
+    for (unsigned i = 0; i < method_count; ++i)
+      if (method == method_names[i])
+        return 1u << i;
+
+    return 0;
+  }
+
+  void add(const std::string &methods, std::string_view pattern, http_server::handler_t handler)
+  {
+    unsigned mask = 0;
+    std::vector<std::string> custom;
 
-  if (listen(_p->serverSocket, 8))
-    return;
+    for (size_t pos = 0; pos < methods.length();)
+    {
+      size_t end = methods.find_first_of(" ,", pos);
+      std::string_view token = std::string_view(methods).substr(pos, end == std::string::npos ? end : end - pos);
+      pos = end == std::string::npos ? methods.length() : end + 1;
+
+      if (token.empty())
+        continue;
+
+      if (token == "*")
+        mask = any_method;
+      else if (unsigned bit = method_bit(token))
+        mask |= bit;
+      else if (std::find(custom.begin(), custom.end(), token) == custom.end())
+        custom.emplace_back(token);
+    }
 
-  _p->isRunning = true;
-  _p->port = port;
-  _p->acceptThread = std::make_unique<std::thread>(std::bind(&basic_tcp_server::accept_thread, this));
-  _p->disconnectThread = std::make_unique<std::thread>(std::bind(&basic_tcp_server::disconnect_thread, this));
-}
+    // GET handlers answer HEAD as well, body is dropped by the server
+    if (!mask && custom.empty())
+      mask = any_method;
+    else if (mask & method_bit("GET"))
+      mask |= method_bit("HEAD");
 
-//---------------------------------------------------------------------------------------------------------------------
-basic_tcp_server::~basic_tcp_server()
-{
-  stop();
+    while (!pattern.empty() && pattern.front() == '/') pattern.remove_prefix(1);
+    while (!pattern.empty() && pattern.back() == '/') pattern.remove_suffix(1);
 
-#ifdef HEADSOCKET_PLATFORM_WINDOWS
-  WSACleanup();
-#endif
-}
+    _routes.push_back({ mask, std::move(custom), std::string(pattern), handler });
+    compile();
+  }
 
-//---------------------------------------------------------------------------------------------------------------------
-int basic_tcp_server::port() const { return _p->port; }
+  bool empty() const { return _routes.empty(); }
+  const http_server::handler_t &handler(size_t index) const { return _routes[index].handler; }
 
-//---------------------------------------------------------------------------------------------------------------------
-void basic_tcp_server::stop()
-{
-  if (_p->isRunning.exchange(false))
+  // Returns matching route index or no_route. Routes whose path matched, but method did not, list their methods in
+  // 'allowed' (comma separated, for Allow header of 405 Method Not Allowed).
+  size_t match(std::string_view path, const std::string_view &method, http_server::parameters_t &params, std::string &allowed) const
   {
-    detail::close_socket(_p->serverSocket);
+    size_t result = no_route;
+    allowed.clear();
 
-    {
-      acquire_clients();
+    if (!_nodes.empty())
+      match(0, path, method, method_bit(method), params, result, allowed);
 
-      for (size_t i = 0, S = num_clients(); i < S; ++i)
-        client_at(i)->disconnect();
+    return result;
+  }
 
-      release_clients();
-    }
+private:
+  static const unsigned method_count = 7;
+  static constexpr const char *method_names[method_count] = { "GET", "HEAD", "POST", "PUT", "DELETE", "OPTIONS", "PATCH" };
 
-    if (_p->acceptThread)
+  struct route
+  {
+    unsigned methods;
+    std::vector<std::string> custom_methods;
+    std::string pattern;
+    http_server::handler_t handler;
+
+    bool accepts(const std::string_view &method, unsigned bit) const
     {
-      _p->acceptThread->join();
-      _p->acceptThread = nullptr;
+      return (methods & bit) || methods == any_method
+        || std::find(custom_methods.begin(), custom_methods.end(), method) != custom_methods.end();
     }
 
-    if (_p->disconnectThread)
+    void allow(std::string &allowed) const
     {
-      _p->disconnectThreadQuit = true;
-      _p->disconnectSemaphore.notify();
+      auto append = [&allowed](const std::string_view &name)
+      {
+        // Each method just once, even when listed by several routes
+        for (size_t pos = 0; pos < allowed.length();)
+        {
+          size_t end = allowed.find(", ", pos);
+          end = end == std::string::npos ? allowed.length() : end;
 
-      _p->disconnectThread->join();
-      _p->disconnectThread = nullptr;
-    }
-  }
-}
+          if (std::string_view(allowed).substr(pos, end - pos) == name)
+            return;
 
-//---------------------------------------------------------------------------------------------------------------------
-bool basic_tcp_server::is_running() const { return _p->isRunning; }
+          pos = end + 2;
+        }
 
-//---------------------------------------------------------------------------------------------------------------------
-bool basic_tcp_server::disconnect(ptr<basic_tcp_client> client)
-{
-  bool found = false;
+        if (!allowed.empty())
+          allowed += ", ";
 
-  if (client)
+        allowed += name;
+      };
+
+      for (unsigned i = 0; i < method_count; ++i)
+        if (methods & (1u << i))
+          append(method_names[i]);
+
+      for (auto &name : custom_methods)
+        append(name);
+    }
+  };
+
+  struct node
+  {
+    std::vector<std::pair<std::string, size_t>> children;
+    size_t param_child = 0;
+    std::string param_name;
+    std::vector<size_t> endpoints;
+    std::vector<size_t> wildcards;
+  };
+
+  void compile()
   {
+    _nodes.assign(1, node());
+
+    for (size_t r = 0; r < _routes.size(); ++r)
     {
-      HEADSOCKET_LOCK(_p->connections);
-      for (size_t i = 0, S = _p->connections->size(); i < S; ++i)
-        if (_p->connections->at(i).client == client)
+      std::string_view rest = _routes[r].pattern;
+      size_t n = 0;
+      bool wildcard = false;
+
+      while (!rest.empty())
+      {
+        size_t slash = rest.find('/');
+        std::string_view segment = rest.substr(0, slash);
+        rest = slash == std::string_view::npos ? std::string_view() : rest.substr(slash + 1);
+
+        if (segment == "*" && rest.empty())
         {
-          found = true;
+          wildcard = true;
           break;
         }
-    }
 
-    if (found && !client->disconnect())
-    {
-      client_disconnected(client);
-      _p->disconnectSemaphore.notify();
-    }
-  }
+        size_t next = 0;
 
-  return found;
-}
+        if (!segment.empty() && segment.front() == ':')
+        {
+          if (!_nodes[n].param_child)
+          {
+            _nodes[n].param_child = _nodes.size();
+            _nodes[n].param_name = std::string(segment.substr(1));
+            _nodes.emplace_back();
+          }
+
+          next = _nodes[n].param_child;
+        }
+        else
+        {
+          for (auto &child : _nodes[n].children)
+            if (child.first == segment)
+              next = child.second;
+
+          if (!next)
+          {
+            next = _nodes.size();
+            _nodes[n].children.emplace_back(std::string(segment), next);
+            _nodes.emplace_back();
+          }
+        }
 
-//---------------------------------------------------------------------------------------------------------------------
-bool basic_tcp_server::disconnect(id_t id)
-{
-  bool found = false;
+        n = next;
+      }
 
-  if (id)
+      (wildcard ? _nodes[n].wildcards : _nodes[n].endpoints).push_back(r);
+    }
+
+    for (auto &nd : _nodes)
+      std::sort(nd.children.begin(), nd.children.end());
+  }
+
+  // Exact segments win over parameters, parameters win over wildcards
+  bool match(size_t n, const std::string_view &rest, const std::string_view &method, unsigned bit, http_server::parameters_t &params, size_t &result, std::string &allowed) const
   {
-    ptr<basic_tcp_client> client;
+    const node &nd = _nodes[n];
 
+    if (rest.empty())
     {
-      HEADSOCKET_LOCK(_p->connections);
-      for (size_t i = 0, S = _p->connections->size(); i < S; ++i)
-        if (_p->connections->at(i).client->id() == id)
+      for (size_t r : nd.endpoints)
+      {
+        if (_routes[r].accepts(method, bit))
         {
-          client = _p->connections->at(i).client;
-          found = true;
-          break;
+          result = r;
+          return true;
         }
+
+        _routes[r].allow(allowed);
+      }
     }
+    else
+    {
+      size_t slash = rest.find('/');
+      std::string_view segment = rest.substr(0, slash);
+      std::string_view tail = slash == std::string_view::npos ? std::string_view() : rest.substr(slash + 1);
 
-    if (found && !client->disconnect())
+      auto iter = std::lower_bound(nd.children.begin(), nd.children.end(), segment,
+        [](const std::pair<std::string, size_t> &child, const std::string_view &seg) { return std::string_view(child.first) < seg; });
+
+      if (iter != nd.children.end() && iter->first == segment && match(iter->second, tail, method, bit, params, result, allowed))
+        return true;
+
+      if (nd.param_child)
+      {
+        size_t mark = params.size();
+
+        if (params.push_back({ nd.param_name, segment }) && match(nd.param_child, tail, method, bit, params, result, allowed))
+          return true;
+
+        params.truncate(mark);
+      }
+    }
+
+    for (size_t r : nd.wildcards)
     {
-      client_disconnected(client);
-      _p->disconnectSemaphore.notify();
+      if (!_routes[r].accepts(method, bit))
+        _routes[r].allow(allowed);
+      else if (params.push_back({ "*", rest }))
+      {
+        result = r;
+        return true;
+      }
     }
+
+    return false;
   }
 
-  return found;
-}
+  std::vector<route> _routes;
+  std::vector<node> _nodes;
+};
 
-//---------------------------------------------------------------------------------------------------------------------
-ptr<basic_tcp_client> basic_tcp_server::client_at(size_t index) const
+// Serving threads of one server, shared with them so it outlives the server when the last reference dies on one
+struct serving_threads
 {
-  HEADSOCKET_LOCK(_p->connections);
-  return index < _p->connections->size() ? _p->connections->at(index).client : nullptr;
-}
+  std::mutex mutex;
+  std::condition_variable finished;
+  size_t count = 0;
 
-//---------------------------------------------------------------------------------------------------------------------
-size_t basic_tcp_server::num_clients() const
+  // Server whose thread is the calling one, stop() must not wait for it
+  static const serving_threads *&current() { static thread_local const serving_threads *c = nullptr; return c; }
+};
+
+struct http_server_impl
 {
-  HEADSOCKET_LOCK(_p->connections);
-  return _p->connections->size();
-}
+  std::vector<std::pair<std::string, std::string>> mounts;
+  file_cache files;
+  route_table routes;
+  response_cache responses;
+  std::vector<std::pair<std::string, ptr<event_stream>>> events;
+  ptr<serving_threads> threads = std::make_shared<serving_threads>();
+};
 
-//---------------------------------------------------------------------------------------------------------------------
-size_t basic_tcp_server::acquire_clients() const
+// Per-connection receive buffer, parsed requests point directly into it
+struct http_buffer
 {
-  HEADSOCKET_LOCK(_p->connections);
+  std::vector<char> data;
+  size_t begin = 0;
+  size_t end = 0;
+  size_t scanned = 0;
 
-  for (auto &clientRef : _p->connections.value)
-    ++clientRef.refCount;
+  http_buffer() : data(http_server::request_size_limit) { }
 
-  return _p->connections->size();
-}
+  char *ptr() { return data.data() + begin; }
+  size_t size() const { return end - begin; }
+  bool full() const { return !begin && end == data.size(); }
 
-//---------------------------------------------------------------------------------------------------------------------
-void basic_tcp_server::release_clients() const
-{
-  HEADSOCKET_LOCK(_p->connections);
+  bool receive(tcp_client &client)
+  {
+    if (end == data.size() && begin)
+    {
+      memmove(data.data(), data.data() + begin, end - begin);
+      end -= begin;
+      begin = 0;
+    }
 
-  for (auto &clientRef : _p->connections.value)
-    --clientRef.refCount;
+    if (end == data.size())
+      return false;
 
-  remove_disconnected();
-}
+    size_t result = client.read(data.data() + end, data.size() - end);
 
-//---------------------------------------------------------------------------------------------------------------------
-void basic_tcp_server::remove_disconnected() const
+    if (!result || result == basic_tcp_client::invalid_operation)
+      return false;
+
+    end += result;
+    return true;
+  }
+
+  void consume(size_t length)
+  {
+    begin += length;
+    scanned = 0;
+
+    if (begin == end)
+      begin = end = 0;
+  }
+};
+
+struct http_request
 {
-  size_t i = 0;
+  std::string_view method;
+  std::string_view path;
+  std::string_view version;
+  http_server::headers_t headers;
+  http_server::parameters_t params;
+  size_t content_length = 0;
+  bool keep_alive = false;
+
+  // Body ends after 'content_length' bytes, false when its framing is anything else (Transfer-Encoding), such body
+  // cannot be skipped and the connection has to be closed after the response
+  bool length_delimited = true;
+};
 
-  while (i < _p->connections->size())
+// Everything needed to answer parked request, request strings are copied out of the connection buffer
+struct deferred_state
+{
+  std::mutex mutex;
+  bool parked = false;
+  bool completed = false;
+
+  ptr<http_server> server;
+  http_server::client_ptr client;
+  ptr<http_buffer> buffer;
+  std::string method;
+  std::string version;
+  bool keep_alive = false;
+  size_t served = 0;
+
+  // Response completed before the connection got parked
+  http_server::response early;
+  const char *early_status = nullptr;
+
+  void request(http_request &req) const
   {
-    auto &clientRef = _p->connections.value[i];
+    req.method = method;
+    req.version = version;
+  }
+};
 
-    if (!clientRef.client->is_connected() && clientRef.refCount == 0)
-    {
-      clientRef.client->on_disconnect();
-      _p->connections->erase(_p->connections->begin() + i);
-    }
-    else
-      ++i;
+std::string response_cache::key(const http_request &req, size_t paramCount)
+{
+  const http_server::parameter *sorted[http_server::parameters_t::capacity()];
+
+  for (size_t i = 0; i < paramCount; ++i)
+    sorted[i] = req.params.begin() + i;
+
+  std::sort(sorted, sorted + paramCount, [](const http_server::parameter *a, const http_server::parameter *b)
+  {
+    return a->name != b->name ? a->name < b->name : a->value < b->value;
+  });
+
+  // Path, names and values are decoded and may contain any character, every one is prefixed with its length, so
+  // "a=b%26c%3Dd" and "a=b&c=d" do not end up with the same key
+  std::string result;
+
+  auto append = [&result](const std::string_view &text)
+  {
+    result += std::to_string(text.length());
+    result += ':';
+    result += text;
+  };
+
+  append(req.path);
+
+  for (size_t i = 0; i < paramCount; ++i)
+  {
+    append(sorted[i]->name);
+    append(sorted[i]->value);
   }
+
+  return result;
 }
 
-//---------------------------------------------------------------------------------------------------------------------
-void basic_tcp_server::accept_thread()
+struct http_parser
 {
-  detail::set_thread_name("BaseTcpServer::acceptThread");
+  static std::string_view trim(const char *begin, const char *end)
+  {
+    while (begin < end && (*begin == ' ' || *begin == '\t')) ++begin;
+    while (end > begin && (end[-1] == ' ' || end[-1] == '\t')) --end;
+    return std::string_view(begin, end - begin);
+  }
 
-  while (_p->isRunning)
+  static std::string_view decode(char *begin, char *end)
   {
-    detail::connection_impl conn_impl;
-    conn_impl.socket = ::accept(_p->serverSocket, reinterpret_cast<struct sockaddr *>(&conn_impl.from), nullptr);
-    conn_impl.id = _p->nextClientID++;
+    return std::string_view(begin, utils::url_decode(begin, end - begin));
+  }
 
-    if (!_p->nextClientID)
-      ++_p->nextClientID;
+  // Parses single 'bytes=first-last' range, returns 1 when valid, -1 when not satisfiable and 0 when ignored
+  static int parse_range(std::string_view value, uint64_t size, uint64_t &first, uint64_t &last)
+  {
+    auto number = [](const std::string_view &str, uint64_t &result)->bool
+    {
+      auto r = std::from_chars(str.data(), str.data() + str.length(), result);
+      return !str.empty() && r.ec == std::errc() && r.ptr == str.data() + str.length();
+    };
 
-    if (!_p->isRunning)
-      break;
+    if (value.substr(0, 6) != "bytes=" || value.find(',') != std::string_view::npos)
+      return 0;
 
-    if (conn_impl.socket != detail::invalid_socket)
-    {
-      connection conn(conn_impl);
+    value.remove_prefix(6);
+    size_t dash = value.find('-');
 
-      ptr<basic_tcp_client> newClient;
-      bool failed = false;
+    if (dash == std::string_view::npos)
+      return 0;
 
-      if (handshake(conn))
-      {
-        if (newClient = accept(conn))
-        {
-          newClient->on_accept();
+    std::string_view from = value.substr(0, dash), to = value.substr(dash + 1);
 
-          HEADSOCKET_LOCK(_p->connections);
-          _p->connections->push_back(newClient);
-        }
-        else
-          failed = true;
-      }
-      else
-        failed = true;
+    if (from.empty())
+    {
+      uint64_t suffix;
 
-      if (failed)
-      {
-        conn_impl.close();
-        --_p->nextClientID;
+      if (!number(to, suffix))
+        return 0;
 
-        if (!_p->nextClientID)
-          --_p->nextClientID;
-      }
-      else
-        client_connected(newClient);
+      if (!suffix || !size)
+        return -1;
+
+      first = suffix < size ? size - suffix : 0;
+      last = size - 1;
+      return 1;
     }
+
+    if (!number(from, first))
+      return 0;
+
+    if (to.empty())
+      last = size - 1;
+    else if (!number(to, last) || last < first)
+      return 0;
+
+    if (first >= size)
+      return -1;
+
+    if (last >= size)
+      last = size - 1;
+
+    return 1;
   }
-}
 
-//---------------------------------------------------------------------------------------------------------------------
-void basic_tcp_server::disconnect_thread()
-{
-  detail::set_thread_name("BaseTcpServer::disconnectThread");
+  // Looks for the end of request head, continuing where the previous call stopped. Returns head size, or 0 when
+  // more data is needed.
+  static size_t find_head(http_buffer &buffer)
+  {
+    while (true)
+    {
+      char *cursor = buffer.ptr() + buffer.scanned;
+      char *lf = static_cast<char *>(memchr(cursor, '\n', buffer.size() - buffer.scanned));
+
+      if (!lf)
+        return 0;
+
+      size_t lineLength = lf - cursor;
+      if (lineLength && lf[-1] == '\r')
+        --lineLength;
+
+      buffer.scanned = lf + 1 - buffer.ptr();
 
-  while (!_p->disconnectThreadQuit)
-  {
-    {
-      HEADSOCKET_LOCK(_p->disconnectSemaphore);
-      HEADSOCKET_LOCK(_p->connections);
+      if (!lineLength)
+      {
+        // Empty line in front of the request line is skipped, any other one terminates the head
+        if (cursor == buffer.ptr())
+        {
+          buffer.consume(buffer.scanned);
+          continue;
+        }
 
-      remove_disconnected();
-      _p->disconnectSemaphore.consume();
+        return buffer.scanned;
+      }
     }
   }
-}
 
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+  // Parses request head of given size in place (URL escapes are decoded directly in the buffer)
+  static bool parse(char *ptr, size_t length, http_request &req)
+  {
+    char *end = ptr + length;
+    char *lineEnd = static_cast<char *>(memchr(ptr, '\n', length));
+    char *cursor = lineEnd + 1;
 
-namespace detail {
+    if (lineEnd > ptr && lineEnd[-1] == '\r')
+      --lineEnd;
 
-struct basic_tcp_client_impl
-{
-  std::atomic_int refCount;
-  std::atomic_bool isConnected;
-  std::weak_ptr<basic_tcp_server> server;
-  connection conn = detail::connection_impl();
-  std::string address = "";
-  int port = 0;
+    // Request line
+    char *sp1 = static_cast<char *>(memchr(ptr, ' ', lineEnd - ptr));
+    if (!sp1)
+      return false;
 
-  basic_tcp_client_impl()
-  {
-    refCount = 0;
-    isConnected = false;
-  }
-};
+    char *sp2 = static_cast<char *>(memchr(sp1 + 1, ' ', lineEnd - sp1 - 1));
+    char *targetEnd = sp2 ? sp2 : lineEnd;
+    char *query = static_cast<char *>(memchr(sp1 + 1, '?', targetEnd - sp1 - 1));
 
-}
+    req.method = std::string_view(ptr, sp1 - ptr);
+    req.version = sp2 ? trim(sp2 + 1, lineEnd) : std::string_view("HTTP/1.0");
+    req.path = decode(sp1 + 1, query ? query : targetEnd);
 
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    while (!req.path.empty() && req.path.front() == '/') req.path.remove_prefix(1);
+    while (!req.path.empty() && req.path.back() == '/') req.path.remove_suffix(1);
 
-//---------------------------------------------------------------------------------------------------------------------
-basic_tcp_client::basic_tcp_client(const std::string &address, int port)
-  : _p(std::make_unique<detail::basic_tcp_client_impl>())
-{
-  struct addrinfo *result = nullptr, *ptr = nullptr, hints;
+    // Query parameters
+    for (char *param = query ? query + 1 : targetEnd; param < targetEnd;)
+    {
+      char *paramEnd = static_cast<char *>(memchr(param, '&', targetEnd - param));
+      if (!paramEnd)
+        paramEnd = targetEnd;
 
-  memset(&hints, 0, sizeof(hints));
-  hints.ai_family = AF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_protocol = IPPROTO_TCP;
+      if (paramEnd != param)
+      {
+        char *eq = static_cast<char *>(memchr(param, '=', paramEnd - param));
 
-  char buff[16];
-  HEADSOCKET_SPRINTF(buff, "%d", port);
+        http_server::parameter p;
+        p.name = decode(param, eq ? eq : paramEnd);
+        p.value = eq ? decode(eq + 1, paramEnd) : std::string_view();
 
-  if (getaddrinfo(address.c_str(), buff, &hints, &result))
-    return;
+        if (!req.params.push_back(p))
+          return false;
+      }
 
-  for (ptr = result; ptr != nullptr; ptr = ptr->ai_next)
-  {
-    _p->conn.impl()->socket = socket(ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol);
+      param = paramEnd + 1;
+    }
 
-    if (!_p->conn.is_valid())
-      return;
+    // Headers
+    req.keep_alive = req.version != "HTTP/1.0";
+    bool hasLength = false;
 
-    if (connect(_p->conn.impl()->socket, ptr->ai_addr, static_cast<int>(ptr->ai_addrlen)) == detail::socket_error)
+    while (cursor < end)
     {
-      detail::close_socket(_p->conn.impl()->socket);
-      _p->conn.impl()->socket = detail::invalid_socket;
-      continue;
-    }
+      lineEnd = static_cast<char *>(memchr(cursor, '\n', end - cursor));
+      char *next = lineEnd + 1;
 
-    break;
-  }
+      if (lineEnd > cursor && lineEnd[-1] == '\r')
+        --lineEnd;
 
-  freeaddrinfo(result);
+      if (lineEnd == cursor)
+        break;
 
-  if (!_p->conn.is_valid())
-    return;
+      char *colon = static_cast<char *>(memchr(cursor, ':', lineEnd - cursor));
+      if (!colon)
+        return false;
 
-  _p->address = address;
-  _p->port = port;
-  _p->isConnected = true;
-}
+      http_server::header h;
+      h.name = trim(cursor, colon);
+      h.value = trim(colon + 1, lineEnd);
 
-//---------------------------------------------------------------------------------------------------------------------
-basic_tcp_client::basic_tcp_client(ptr<basic_tcp_server> server, connection &conn)
-  : _p(std::make_unique<detail::basic_tcp_client_impl>())
-{
-  _p->server = server;
-  _p->conn.impl()->assign(*(conn.impl()));
-  _p->isConnected = true;
-}
+      if (!req.headers.push_back(h))
+        return false;
 
-//---------------------------------------------------------------------------------------------------------------------
-basic_tcp_client::~basic_tcp_client()
-{
-  disconnect();
-}
+      if (iequals(h.name, "Connection"))
+      {
+        if (utils::icontains(h.value, "close"))
+          req.keep_alive = false;
+        else if (utils::icontains(h.value, "keep-alive"))
+          req.keep_alive = true;
+      }
+      else if (iequals(h.name, "Transfer-Encoding"))
+        req.length_delimited = false;
+      else if (iequals(h.name, "Content-Length"))
+      {
+        // Overflowing or conflicting lengths would leave client and server disagreeing where the body ends
+        size_t length;
+        auto r = std::from_chars(h.value.data(), h.value.data() + h.value.length(), length);
 
-//---------------------------------------------------------------------------------------------------------------------
-bool basic_tcp_client::disconnect()
-{
-  bool wasConnected = _p->isConnected.exchange(false);
+        if (h.value.empty() || r.ec != std::errc() || r.ptr != h.value.data() + h.value.length())
+          return false;
 
-  if (wasConnected)
-  {
-    _p->conn.impl()->close();
+        if (hasLength && length != req.content_length)
+          return false;
 
-    ptr<basic_tcp_server> s = server();
+        req.content_length = length;
+        hasLength = true;
+      }
 
-    if (s)
-      s->disconnect(_p->conn.id());
+      cursor = next;
+    }
+
+    return true;
   }
+};
 
-  return wasConnected;
 }
 
 //---------------------------------------------------------------------------------------------------------------------
-bool basic_tcp_client::is_connected() const { return _p->isConnected; }
-
-//---------------------------------------------------------------------------------------------------------------------
-ptr<basic_tcp_server> basic_tcp_client::server() const { return _p->server.lock(); }
+int http_server::parameter::integer() const
+{
+  int result = 0;
+  std::from_chars(value.data(), value.data() + value.length(), result);
+  return result;
+}
 
 //---------------------------------------------------------------------------------------------------------------------
-id_t basic_tcp_client::id() const { return _p->conn.id(); }
-
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+double http_server::parameter::real() const
+{
+  char buff[64];
+  size_t length = value.length() < sizeof(buff) ? value.length() : sizeof(buff) - 1;
+  memcpy(buff, value.data(), length);
+  buff[length] = 0;
+  return atof(buff);
+}
 
 //---------------------------------------------------------------------------------------------------------------------
-tcp_client::tcp_client(const std::string &address, int port)
-  : base_t(address, port)
+http_server::http_server(int port)
+  : base_t(port)
+  , _hp(std::make_unique<detail::http_server_impl>())
 {
 
 }
 
 //---------------------------------------------------------------------------------------------------------------------
-tcp_client::tcp_client(ptr<basic_tcp_server> server, connection &conn)
-  : base_t(server, conn)
+http_server::~http_server()
 {
-
+  stop();
 }
 
 //---------------------------------------------------------------------------------------------------------------------
-tcp_client::~tcp_client()
+void http_server::stop()
 {
+  base_t::stop();
 
-}
+  // Connections are closed by now, so are the serving threads blocked on them
+  detail::serving_threads &threads = *_hp->threads;
+  size_t own = detail::serving_threads::current() == &threads ? 1 : 0;
 
-//---------------------------------------------------------------------------------------------------------------------
-size_t tcp_client::write(const void *ptr, size_t length) { return _p->conn.write(ptr, length); }
+  std::unique_lock<std::mutex> lock(threads.mutex);
+  threads.finished.wait(lock, [&threads, own]() { return threads.count == own; });
+}
 
 //---------------------------------------------------------------------------------------------------------------------
-size_t tcp_client::read(void *ptr, size_t length) { return _p->conn.read(ptr, length); }
+void http_server::serve_files(const std::string &prefix, const std::string &directory)
+{
+  std::string_view p = prefix;
 
-//---------------------------------------------------------------------------------------------------------------------
-bool tcp_client::force_write(const void *ptr, size_t length) { return _p->conn.force_write(ptr, length); }
+  while (!p.empty() && p.front() == '/') p.remove_prefix(1);
+  while (!p.empty() && p.back() == '/') p.remove_suffix(1);
 
-//---------------------------------------------------------------------------------------------------------------------
-bool tcp_client::force_read(void *ptr, size_t length) { return _p->conn.force_read(ptr, length); }
+  _hp->mounts.emplace_back(std::string(p), directory);
+}
 
 //---------------------------------------------------------------------------------------------------------------------
-bool tcp_client::read_line(std::string &output) { return _p->conn.read_line(output); }
+void http_server::serve_events(const std::string &path, ptr<event_stream> stream)
+{
+  std::string_view p = path;
 
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+  while (!p.empty() && p.front() == '/') p.remove_prefix(1);
+  while (!p.empty() && p.back() == '/') p.remove_suffix(1);
 
-namespace detail {
+  _hp->events.emplace_back(std::string(p), stream);
+}
 
-struct async_tcp_client_impl
+//---------------------------------------------------------------------------------------------------------------------
+void http_server::serve_metrics(const std::string &path)
 {
-  detail::semaphore writeSemaphore;
-  detail::lockable_value<detail::data_block_buffer> writeBlocks;
-  detail::lockable_value<detail::data_block_buffer> readBlocks;
-  std::unique_ptr<std::thread> writeThread;
-  std::unique_ptr<std::thread> readThread;
-  std::atomic_int threadCounter = { 0 };
-};
+  ptr<detail::latency_recorders> latency = _p->latency;
 
+  route("GET", path, [latency](const std::string_view &, const parameters_t &, response &resp)
+  {
+    resp.content_type = "text/plain; version=0.0.4";
+    resp.message = metrics::snapshot().prometheus() + latency->snapshot().prometheus();
+    return true;
+  });
 }
 
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
 //---------------------------------------------------------------------------------------------------------------------
-async_tcp_client::async_tcp_client(const std::string &address, int port)
-  : base_t(address, port)
-  , _ap(std::make_unique<detail::async_tcp_client_impl>())
+void http_server::route(const std::string &methods, const std::string &pattern, handler_t handler)
 {
-  
+  _hp->routes.add(methods, pattern, handler);
 }
 
 //---------------------------------------------------------------------------------------------------------------------
-async_tcp_client::async_tcp_client(ptr<basic_tcp_server> server, connection &conn)
-  : base_t(server, conn)
-  , _ap(new detail::async_tcp_client_impl())
+bool http_server::handshake(connection &conn)
 {
-  
+  // Idle connections are closed by the serving thread once this timeout expires
+  detail::set_socket_timeout(conn.impl()->socket, keep_alive_timeout > 0 ? keep_alive_timeout : request_timeout);
+  return true;
 }
 
 //---------------------------------------------------------------------------------------------------------------------
-async_tcp_client::~async_tcp_client()
+void http_server::client_connected(client_ptr client)
 {
-  disconnect();
-
-  _ap->writeSemaphore.notify();
-  _ap->writeThread->join();
-  _ap->readThread->join();
+  serve_connection(client, std::make_shared<detail::http_buffer>(), 1);
 }
 
 //---------------------------------------------------------------------------------------------------------------------
-void async_tcp_client::push(const void *ptr, size_t length, opcode opcode)
+void http_server::serve_connection(client_ptr client, ptr<detail::http_buffer> buffer, size_t served)
 {
-  if (!ptr)
-    return;
+  ptr<detail::serving_threads> threads = _hp->threads;
+  bool admitted = false;
 
   {
-    HEADSOCKET_LOCK(_ap->writeBlocks);
-    _ap->writeBlocks->block_begin(opcode);
-    _ap->writeBlocks->write(ptr, length);
-    _ap->writeBlocks->block_end();
+    // Checked under the lock, stop() either sees this thread counted or this sees the server stopped
+    HEADSOCKET_LOCK(threads->mutex);
+
+    if (is_running() && threads->count < max_serving_threads)
+    {
+      ++threads->count;
+      admitted = true;
+    }
   }
 
-  _ap->writeSemaphore.notify();
-}
+  if (!admitted)
+  {
+    // Resumed deferred connection has its response sent already, it is just closed
+    if (is_running() && served == 1)
+    {
+      static const char *unavailable = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+      client->force_write(unavailable, strlen(unavailable));
+    }
 
-//---------------------------------------------------------------------------------------------------------------------
-void async_tcp_client::push(const void *ptr, size_t length)
-{
-  push(ptr, length, opcode::binary);
-}
+    client->disconnect();
+    return;
+  }
 
-//---------------------------------------------------------------------------------------------------------------------
-void async_tcp_client::push(const std::string &text)
-{
-  push(text.c_str(), text.length(), opcode::text);
-}
+  std::thread([client, buffer, served, threads]() mutable
+  {
+    detail::set_thread_name("HttpServer::serveThread");
+    detail::serving_threads::current() = threads.get();
 
-//---------------------------------------------------------------------------------------------------------------------
-size_t async_tcp_client::peek() const
-{
-  HEADSOCKET_LOCK(_ap->readBlocks);
-  return _ap->readBlocks->peek(nullptr);
-}
+    for (; client->is_connected(); ++served)
+    {
+      auto s = std::static_pointer_cast<http_server>(client->server());
 
-//---------------------------------------------------------------------------------------------------------------------
-size_t async_tcp_client::pop(void *ptr, size_t length)
-{
-  if (!ptr)
-    return invalid_operation;
+      if (!s || !s->serve(client, buffer, served))
+        break;
+    }
 
-  if (!length)
-    return 0;
+    // Parked connection took the buffer, deferred response decides what happens next
+    if (buffer)
+      client->disconnect();
 
-  HEADSOCKET_LOCK(_ap->readBlocks);
-  return _ap->readBlocks->read(ptr, length);
-}
+    client.reset();
+    buffer.reset();
 
-//---------------------------------------------------------------------------------------------------------------------
-void async_tcp_client::init_threads()
-{
-  _ap->threadCounter = 0;
-  _ap->writeThread = std::make_unique<std::thread>(std::bind(&async_tcp_client::write_thread, this));
-  _ap->readThread = std::make_unique<std::thread>(std::bind(&async_tcp_client::read_thread, this));
+    HEADSOCKET_LOCK(threads->mutex);
+    --threads->count;
+    threads->finished.notify_all();
+  }).detach();
 }
 
 //---------------------------------------------------------------------------------------------------------------------
-void async_tcp_client::write_thread()
+bool http_server::serve(const client_ptr &clientPtr, ptr<detail::http_buffer> &bufferPtr, size_t served)
 {
-  ++_ap->threadCounter;
-  detail::set_thread_name("AsyncTcpClient::writeThread");
+  tcp_client &client = *clientPtr;
+  detail::http_buffer &buffer = *bufferPtr;
+  size_t headSize;
 
-  std::vector<uint8_t> buffer(1024 * 1024);
+  while (!(headSize = detail::http_parser::find_head(buffer)))
+  {
+    if (buffer.full())
+    {
+      static const char *tooLarge = "HTTP/1.1 431 Request Header Fields Too Large\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+      client.force_write(tooLarge, strlen(tooLarge));
+      return false;
+    }
 
-  while (_p->isConnected)
+    if (!buffer.receive(client))
+      return false;
+  }
+
+  detail::http_request req;
+
+  if (!detail::http_parser::parse(buffer.ptr(), headSize, req))
   {
-    size_t written = 0;
+    static const char *badRequest = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    client.force_write(badRequest, strlen(badRequest));
+    return false;
+  }
+
+  // Chunked (or otherwise encoded) request bodies are not decoded, their end cannot be found
+  if (!req.length_delimited)
+  {
+    static const char *notImplemented = "HTTP/1.1 501 Not Implemented\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    client.force_write(notImplemented, strlen(notImplemented));
+    return false;
+  }
+
+  detail::metrics_registry::add(detail::metrics_registry::http_requests);
+  // Next pipelined request is found by skipping the body, that only works for plain Content-Length framing
+  bool keepAlive = req.keep_alive && req.length_delimited && keep_alive_timeout > 0 && served < keep_alive_max_requests;
+
+  auto upgradeHeader = req.headers.find("Upgrade");
+
+  if (upgradeHeader != req.headers.end() && detail::utils::icontains(upgradeHeader->value, "websocket"))
+  {
+    if (upgrade_connection(client, buffer, headSize, req))
+      return false;
+  }
+
+  // Event streams take the connection over for good
+  if (req.method == "GET")
+    for (auto &events : _hp->events)
+      if (req.path == events.first)
+      {
+        subscribe(client, buffer, headSize, events.second);
+        return false;
+      }
+
+  // Static files
+  for (auto &mount : _hp->mounts)
+  {
+    std::string_view rest = req.path;
+
+    if (rest.substr(0, mount.first.length()) != mount.first)
+      continue;
+
+    rest.remove_prefix(mount.first.length());
+
+    if (!mount.first.empty() && !rest.empty() && rest.front() != '/')
+      continue;
+
+    std::string fileName = mount.second;
+
+    for (size_t pos = 0; pos < rest.length();)
     {
-      HEADSOCKET_LOCK(_ap->writeSemaphore);
+      size_t slash = rest.find('/', pos);
+      std::string_view segment = rest.substr(pos, slash == std::string_view::npos ? slash : slash - pos);
+      pos = slash == std::string_view::npos ? rest.length() : slash + 1;
 
-      if (!_p->isConnected)
+      if (segment.empty())
+        continue;
+
+      // Never leave the mounted directory
+      if (segment == ".." || segment.find('\\') != std::string_view::npos)
+      {
+        fileName.clear();
         break;
+      }
 
-      written = async_write_handler(buffer.data(), buffer.size());
+      fileName += '/';
+      fileName += segment;
     }
 
-    if (written == invalid_operation)
-      break;
+    bool sent = fileName.empty()
+      ? client.force_write(begin_response(req, "404 Not Found", keepAlive, served) + "Content-Length: 0\r\n\r\n")
+      : serve_file(client, req, fileName, keepAlive, served);
 
-    if (!written)
-      buffer.resize(buffer.size() * 2);
-    else
+    return sent && skip_body(client, buffer, headSize, req.content_length) && keepAlive;
+  }
+
+  bool cacheable = req.method == "GET" || req.method == "HEAD";
+  size_t queryParams = req.params.size();
+  std::string cacheKey;
+
+  // Cache hit skips the handler entirely, response goes out as one send
+  if (cacheable && !_hp->responses.empty())
+  {
+    cacheKey = detail::response_cache::key(req, queryParams);
+
+    if (auto cached = _hp->responses.find(cacheKey))
+      return send_cached(client, req, *cached, keepAlive, served) && skip_body(client, buffer, headSize, req.content_length) && keepAlive;
+  }
+
+  response resp;
+  bool found;
+
+  if (!_hp->routes.empty())
+  {
+    std::string allowed;
+    size_t r = _hp->routes.match(req.path, req.method, req.params, allowed);
+
+    if (r != detail::route_table::no_route)
+      found = _hp->routes.handler(r)(req.path, req.params, resp);
+    else if (!allowed.empty())
     {
-      const char *cursor = reinterpret_cast<const char *>(buffer.data());
+      std::string header = begin_response(req, "405 Method Not Allowed", keepAlive, served);
+      header += "Allow: " + allowed + "\r\nContent-Length: 0\r\n\r\n";
+      return client.force_write(header) && skip_body(client, buffer, headSize, req.content_length) && keepAlive;
+    }
+    else
+      found = request(req.path, req.params, resp);
+  }
+  else
+    found = request(req.path, req.params, resp);
 
-      while (written)
-      {
-        int result = send(_p->conn.impl()->socket, cursor, static_cast<int>(written), 0);
+  if (found && resp.deferred_handle)
+    return park(clientPtr, bufferPtr, headSize, req, resp, keepAlive, served);
 
-        if (!result || result == detail::socket_error)
-          break;
+  if (found && cacheable && resp.cache_ttl > 0 && !resp.producer)
+  {
+    if (cacheKey.empty())
+      cacheKey = detail::response_cache::key(req, queryParams);
 
-        cursor += result;
-        written -= static_cast<size_t>(result);
-      }
-    }
+    auto cached = std::make_shared<detail::cached_response>();
+    cached->key = cacheKey;
+    cached->expires = std::chrono::steady_clock::now() + std::chrono::seconds(resp.cache_ttl);
+    cached->build(resp);
+    _hp->responses.insert(cached, response_cache_size);
+
+    return send_cached(client, req, *cached, keepAlive, served) && skip_body(client, buffer, headSize, req.content_length) && keepAlive;
   }
 
-  kill_threads();
-  --_ap->threadCounter;
+  if (!found)
+    resp = response();
+
+  return send_response(client, req, resp, found ? "200 OK" : "404 Not Found", keepAlive, served)
+    && skip_body(client, buffer, headSize, req.content_length) && keepAlive;
 }
 
 //---------------------------------------------------------------------------------------------------------------------
-size_t async_tcp_client::async_write_handler(uint8_t *ptr, size_t length)
+bool http_server::send_response(tcp_client &client, const detail::http_request &req, response &resp, const char *status, bool &keepAlive, size_t served)
 {
-  HEADSOCKET_LOCK(_ap->writeBlocks);
- 
-  size_t toWrite = _ap->writeBlocks->peek(nullptr);
-  size_t toConsume = length > toWrite ? toWrite : length;
-  _ap->writeBlocks->read(ptr, toConsume);
+  if (resp.producer)
+  {
+    // HTTP/1.0 has no chunked encoding, the end of stream is marked by closing the connection
+    if (resp.content_length == response::unknown_length && req.version == "HTTP/1.0")
+      keepAlive = false;
 
-  if (toWrite == toConsume)
-    _ap->writeSemaphore.consume();
+    return stream_response(client, req, resp, keepAlive, served);
+  }
 
-  return toConsume;
-}
+  std::string header = begin_response(req, status, keepAlive, served);
 
-//---------------------------------------------------------------------------------------------------------------------
-size_t async_tcp_client::async_read_handler(uint8_t *ptr, size_t length)
-{
-  HEADSOCKET_LOCK(_ap->readBlocks);
+  if (!resp.message.empty())
+    header += "Content-Type: " + resp.content_type + "\r\n";
 
-  _ap->readBlocks->block_begin(opcode::binary);
-  _ap->readBlocks->write(ptr, length);
-  _ap->readBlocks->block_end();
+  header += "Content-Length: " + std::to_string(resp.message.length()) + "\r\n\r\n";
 
-  return length;
+  // Send header and body in one go, two small writes would stall on delayed ACKs
+  if (req.method != "HEAD")
+    header += resp.message;
+
+  return client.force_write(header);
 }
 
 //---------------------------------------------------------------------------------------------------------------------
-void async_tcp_client::read_thread()
+bool http_server::park(const client_ptr &clientPtr, ptr<detail::http_buffer> &bufferPtr, size_t headSize, const detail::http_request &req, response &resp, bool keepAlive, size_t served)
 {
-  ++_ap->threadCounter;
-  detail::set_thread_name("AsyncTcpClient::readThread");
+  auto handle = resp.deferred_handle;
+  detail::deferred_state &state = *handle->_p;
 
-  std::vector<uint8_t> buffer(1024 * 1024);
-  size_t bufferBytes = 0, consumed = 0;
+  // Request views die with the buffer contents, keep copies of what the response needs
+  std::string method(req.method), version(req.version);
 
-  while (_p->isConnected)
-  {
-    while (true)
-    {
-      int result = static_cast<int>(bufferBytes);
+  if (!skip_body(*clientPtr, *bufferPtr, headSize, req.content_length))
+    return false;
 
-      if (!result || !consumed)
-      {
-        result = recv(
-          _p->conn.impl()->socket,
-          reinterpret_cast<char *>(buffer.data() + bufferBytes),
-          static_cast<int>(buffer.size() - bufferBytes),
-          0);
+  std::unique_lock<std::mutex> lock(state.mutex);
+  state.method = method;
+  state.version = version;
+  state.keep_alive = keepAlive;
+  state.served = served;
 
-        if (!result || result == detail::socket_error)
-        {
-          consumed = invalid_operation;
-          break;
-        }
+  // Completed already, answer right here and keep serving
+  if (state.completed)
+  {
+    lock.unlock();
 
-        bufferBytes += static_cast<size_t>(result);
-      }
+    detail::http_request parkedReq;
+    state.request(parkedReq);
+    return send_response(*clientPtr, parkedReq, state.early, state.early_status, keepAlive, served) && keepAlive;
+  }
 
-      consumed = async_read_handler(buffer.data(), bufferBytes);
+  state.server = std::static_pointer_cast<http_server>(shared_from_this());
+  state.client = clientPtr;
+  state.buffer = std::move(bufferPtr);
+  state.parked = true;
+  return false;
+}
 
-      if (!consumed)
-      {
-        if (bufferBytes == buffer.size())
-          buffer.resize(buffer.size() * 2);
-      }
-      else
-        break;
-    }
+//---------------------------------------------------------------------------------------------------------------------
+ptr<http_server::deferred> http_server::response::defer()
+{
+  if (!deferred_handle)
+    deferred_handle = ptr<deferred>(new deferred());
 
-    if (consumed == invalid_operation)
-      break;
+  return deferred_handle;
+}
 
-    bufferBytes -= consumed;
+//---------------------------------------------------------------------------------------------------------------------
+http_server::deferred::deferred()
+  : _p(std::make_unique<detail::deferred_state>())
+{
 
-    if (bufferBytes)
-      memcpy(buffer.data(), buffer.data() + consumed, bufferBytes);
-  }
+}
 
-  kill_threads();
-  --_ap->threadCounter;
+//---------------------------------------------------------------------------------------------------------------------
+http_server::deferred::~deferred()
+{
+  response resp;
+  finish(resp, "500 Internal Server Error");
 }
 
 //---------------------------------------------------------------------------------------------------------------------
-void async_tcp_client::kill_threads()
+bool http_server::deferred::complete(response resp, bool found)
 {
-  if (std::this_thread::get_id() == _ap->readThread->get_id())
-    _ap->writeSemaphore.notify();
+  if (!found)
+    resp = response();
 
-  disconnect();
+  return finish(resp, found ? "200 OK" : "404 Not Found");
 }
 
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//---------------------------------------------------------------------------------------------------------------------
+bool http_server::deferred::is_pending() const
+{
+  HEADSOCKET_LOCK(_p->mutex);
+  return !_p->completed;
+}
 
 //---------------------------------------------------------------------------------------------------------------------
-web_socket_client::web_socket_client(const std::string &address, int port)
-  : base_t(address, port)
+bool http_server::deferred::finish(response &resp, const char *status)
 {
+  std::unique_lock<std::mutex> lock(_p->mutex);
+
+  if (_p->completed)
+    return false;
+
+  _p->completed = true;
 
+  // Serving thread has not parked the connection yet, it picks the response up by itself
+  if (!_p->parked)
+  {
+    resp.deferred_handle.reset();
+    _p->early = std::move(resp);
+    _p->early_status = status;
+    return true;
+  }
+
+  lock.unlock();
+  return _p->server->resume(*_p, resp, status);
 }
 
 //---------------------------------------------------------------------------------------------------------------------
-web_socket_client::web_socket_client(ptr<basic_tcp_server> server, connection &conn)
-  : base_t(server, conn)
+bool http_server::resume(detail::deferred_state &state, response &resp, const char *status)
 {
+  detail::http_request req;
+  state.request(req);
+
+  bool keepAlive = state.keep_alive;
+  bool sent = send_response(*state.client, req, resp, status, keepAlive, state.served);
+
+  // Whatever follows the request gets a fresh serving thread
+  if (sent && keepAlive)
+    serve_connection(state.client, state.buffer, state.served + 1);
+  else
+    state.client->disconnect();
 
+  state.client.reset();
+  state.buffer.reset();
+  state.server.reset();
+  return sent;
 }
 
 //---------------------------------------------------------------------------------------------------------------------
-web_socket_client::~web_socket_client()
+bool http_server::upgrade_connection(tcp_client &client, detail::http_buffer &buffer, size_t headSize, const detail::http_request &req)
 {
+  auto key = req.headers.find("Sec-WebSocket-Key");
+
+  if (key == req.headers.end())
+    return false;
 
+  ptr<basic_tcp_client> newClient = upgrade(client._p->conn);
+
+  if (!newClient || !hand_over(client, buffer, headSize, newClient, detail::web_socket_response(key->value)))
+    return false;
+
+  upgraded(newClient);
+  return true;
 }
 
 //---------------------------------------------------------------------------------------------------------------------
-size_t web_socket_client::peek(opcode *op) const
+bool http_server::subscribe(tcp_client &client, detail::http_buffer &buffer, size_t headSize, ptr<event_stream> stream)
 {
-  HEADSOCKET_LOCK(_ap->readBlocks);
-  return _ap->readBlocks->peek(op);
+  auto newClient = detail::event_stream_client::create(shared_from_this(), client._p->conn);
+  newClient->stream = stream;
+
+  static const std::string header =
+    "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\nConnection: keep-alive\r\n\r\n";
+
+  if (!hand_over(client, buffer, headSize, newClient, header))
+    return false;
+
+  HEADSOCKET_LOCK(stream->_p->mutex);
+  newClient->offset = stream->_p->end();
+  stream->_p->subscribers.push_back(newClient);
+  return true;
 }
 
 //---------------------------------------------------------------------------------------------------------------------
-size_t web_socket_client::async_write_handler(uint8_t *ptr, size_t length)
+bool http_server::hand_over(tcp_client &client, detail::http_buffer &buffer, size_t headSize, ptr<basic_tcp_client> newClient, const std::string &response)
 {
-  uint8_t *cursor = ptr;
-  HEADSOCKET_LOCK(_ap->writeBlocks);
+  // Long lived connections stay idle for as long as they want
+  detail::set_socket_timeout(client._p->conn.impl()->socket, 0);
 
-  while (length >= 16)
+  if (!client.force_write(response))
   {
-    opcode op;
-    size_t toWrite = _ap->writeBlocks->peek(&op);
-    size_t toConsume = (length - 15) > frame_size_limit ? frame_size_limit : (length - 15);
-    toConsume = toConsume > toWrite ? toWrite : toConsume;
+    // New client shares socket and id of 'client', releasing it must not close the socket or disconnect 'client'
+    newClient->_p->conn.impl()->socket = detail::invalid_socket;
 
-    frame_header header;
-    header.fin = (toWrite - toConsume) == 0;
-    header.op = op;
-    header.masked = false;
-    header.payload_length = toConsume;
+    if (newClient->_p->isConnected.exchange(false))
+      detail::metrics_registry::add(detail::metrics_registry::clients, -1);
 
-    size_t headerSize = header.write(cursor, length);
-    cursor += headerSize;
-    length -= headerSize;
-    _ap->writeBlocks->read(cursor, toConsume);
-    cursor += toConsume;
-    length -= toConsume;
+    return false;
+  }
 
-    if (header.fin)
-      _ap->writeSemaphore.consume();
+  // Anything already received behind the request belongs to the new client
+  buffer.consume(headSize);
+  newClient->_p->conn.impl()->unread(buffer.ptr(), buffer.size());
+  buffer.consume(buffer.size());
 
-    if (!_ap->writeBlocks->peek(&op))
-      break;
-  }
+  // New client takes over the socket and the registry slot, old one goes away quietly
+  replace_client(&client, newClient);
+  client._p->conn.impl()->socket = detail::invalid_socket;
 
-  return cursor - ptr;
+  if (client._p->isConnected.exchange(false))
+    detail::metrics_registry::add(detail::metrics_registry::clients, -1);
+
+  newClient->on_accept();
+  return true;
 }
 
 //---------------------------------------------------------------------------------------------------------------------
-size_t web_socket_client::async_read_handler(uint8_t *ptr, size_t length)
+bool http_server::send_cached(tcp_client &client, const detail::http_request &req, const detail::cached_response &cached, bool keepAlive, size_t served)
 {
-  uint8_t *cursor = ptr;
-  HEADSOCKET_LOCK(_ap->readBlocks);
+  auto acceptEncoding = req.headers.find("Accept-Encoding");
+  auto encoding = acceptEncoding != req.headers.end() ? cached.select(acceptEncoding->value) : detail::cached_response::identity;
 
-  if (!_payload_size)
-  {
-    opcode prevOpcode = _current_header.op;
-    size_t headerSize = _current_header.read(cursor, length);
+  const std::string &variant = cached.variants[encoding];
+  size_t length = req.method == "HEAD" ? cached.head_lengths[encoding] : variant.length();
 
-    if (!headerSize)
-      return 0;
-    else if (headerSize == invalid_operation)
-      return invalid_operation;
+  std::string status = begin_response(req, "200 OK", keepAlive, served);
+  return detail::send_all(client._p->conn.impl()->socket, status.data(), status.length(), variant.data(), length);
+}
 
-    _payload_size = _current_header.payload_length;
-    cursor += headerSize;
-    length -= headerSize;
+//---------------------------------------------------------------------------------------------------------------------
+bool http_server::stream_response(tcp_client &client, const detail::http_request &req, response &resp, bool keepAlive, size_t served)
+{
+  bool chunked = resp.content_length == response::unknown_length && req.version != "HTTP/1.0";
 
-    if (_current_header.op != opcode::continuation)
-      _ap->readBlocks->block_begin(_current_header.op);
-    else
-      _current_header.op = prevOpcode;
-  }
+  std::string header = begin_response(req, "200 OK", keepAlive, served);
+  header += "Content-Type: " + resp.content_type + "\r\n";
 
-  if (_payload_size)
-  {
-    size_t toConsume = length >= _payload_size ? _payload_size : length;
+  if (chunked)
+    header += "Transfer-Encoding: chunked\r\n\r\n";
+  else if (resp.content_length != response::unknown_length)
+    header += "Content-Length: " + std::to_string(resp.content_length) + "\r\n\r\n";
+  else
+    header += "\r\n";
 
-    if (toConsume)
-    {
-      _ap->readBlocks->write(cursor, toConsume);
-      _payload_size -= toConsume;
-      cursor += toConsume;
-      length -= toConsume;
-    }
-  }
+  detail::socket_type s = client._p->conn.impl()->socket;
 
-  if (!_payload_size)
-  {
-    if (_current_header.masked)
-    {
-      data_block &db = _ap->readBlocks->blocks.back();
-      size_t len = _current_header.payload_length;
-      detail::utils::xor32(_current_header.masking_key, _ap->readBlocks->buffer.data() + _ap->readBlocks->buffer.size() - len, len);
-    }
+  if (req.method == "HEAD")
+    return detail::send_all(s, header.c_str(), header.length());
 
-    if (_current_header.fin)
-    {
-      data_block &db = _ap->readBlocks->blocks.back();
+  if (!detail::send_all(s, header.c_str(), header.length(), true))
+    return false;
 
-      switch (_current_header.op)
-      {
-        case opcode::ping:
-          push(_ap->readBlocks->buffer.data() + db.offset, db.length, opcode::pong);
-          break;
+  // Chunk size line goes right in front of the produced data and CRLF right after it, so every chunk is one send
+  static const size_t prefix = 10;
+  std::vector<char> chunk(prefix + stream_chunk_size + 2);
+  size_t remaining = resp.content_length;
 
-        case opcode::text:
-          _ap->readBlocks->buffer.push_back(0);
-          ++db.length;
-          break;
+  while (true)
+  {
+    size_t toProduce = remaining < stream_chunk_size ? remaining : stream_chunk_size;
+    size_t produced = toProduce ? resp.producer(chunk.data() + prefix, toProduce) : 0;
 
-        case opcode::connection_close:
-          kill_threads();
-          break;
+    if (produced > toProduce)
+      produced = toProduce;
 
-        default:
-          break;
-      }
+    if (!produced)
+      break;
 
-      if (_current_header.op == opcode::text || _current_header.op == opcode::binary)
-      {
-        _ap->readBlocks->block_end();
+    if (chunked)
+    {
+      char sizeLine[prefix + 1];
+      int sizeLength = HEADSOCKET_SPRINTF(sizeLine, "%zx\r\n", produced);
+      memcpy(chunk.data() + prefix - sizeLength, sizeLine, sizeLength);
+      memcpy(chunk.data() + prefix + produced, "\r\n", 2);
 
-        if (async_received_data(db, _ap->readBlocks->buffer.data() + db.offset, db.length))
-          _ap->readBlocks->block_remove();
-      }
+      if (!detail::send_all(s, chunk.data() + prefix - sizeLength, sizeLength + produced + 2))
+        return false;
+    }
+    else
+    {
+      if (!detail::send_all(s, chunk.data() + prefix, produced))
+        return false;
+
+      if (remaining != response::unknown_length)
+        remaining -= produced;
     }
   }
 
-  return cursor - ptr;
+  if (chunked)
+    return detail::send_all(s, "0\r\n\r\n", 5);
+
+  // Producer giving up early leaves the client waiting for the rest, only closing the connection can fix it
+  return remaining == response::unknown_length || !remaining;
 }
 
 //---------------------------------------------------------------------------------------------------------------------
-#define HAVE_ENOUGH_BYTES(num) if (length < num) return 0; else length -= num;
-size_t web_socket_client::frame_header::read(const uint8_t *ptr, size_t length)
+bool http_server::skip_body(tcp_client &client, detail::http_buffer &buffer, size_t headSize, size_t contentLength)
 {
-  const uint8_t *cursor = ptr;
-  HAVE_ENOUGH_BYTES(2);
-  this->fin = ((*cursor) & 0x80) != 0;
-  this->op = static_cast<opcode>((*cursor++) & 0x0F);
+  // Skip request body, so the next pipelined request starts at the right place
+  buffer.consume(headSize);
 
-  this->masked = ((*cursor) & 0x80) != 0;
-  uint8_t byte = (*cursor++) & 0x7F;
-
-  if (byte < 126)
-    this->payload_length = byte;
-  else if (byte == 126)
-  {
-    HAVE_ENOUGH_BYTES(2);
-    this->payload_length = detail::utils::swap16bits(*(reinterpret_cast<const uint16_t *>(cursor)));
-    cursor += 2;
-  }
-  else if (byte == 127)
+  for (size_t toSkip = contentLength; toSkip;)
   {
-    HAVE_ENOUGH_BYTES(8);
-    uint64_t length64 = detail::utils::swap64bits(*(reinterpret_cast<const uint64_t *>(cursor))) & 0x7FFFFFFFFFFFFFFFULL;
-    this->payload_length = static_cast<size_t>(length64);
-    cursor += 8;
-  }
+    if (!buffer.size() && !buffer.receive(client))
+      return false;
 
-  if (this->masked)
-  {
-    HAVE_ENOUGH_BYTES(4);
-    this->masking_key = *(reinterpret_cast<const uint32_t *>(cursor));
-    cursor += 4;
+    size_t skipped = toSkip < buffer.size() ? toSkip : buffer.size();
+    buffer.consume(skipped);
+    toSkip -= skipped;
   }
 
-  return cursor - ptr;
+  return true;
 }
 
 //---------------------------------------------------------------------------------------------------------------------
-size_t web_socket_client::frame_header::write(uint8_t *ptr, size_t length) const
+std::string http_server::begin_response(const detail::http_request &req, const char *status, bool keepAlive, size_t served) const
 {
-  uint8_t *cursor = ptr;
-  HAVE_ENOUGH_BYTES(2);
-  *cursor = this->fin ? 0x80 : 0x00;
-  *cursor++ |= static_cast<uint8_t>(this->op);
-
-  *cursor = this->masked ? 0x80 : 0x00;
+  std::string result(req.version);
+  result += ' ';
+  result += status;
 
-  if (this->payload_length < 126)
-    *cursor++ |= static_cast<uint8_t>(this->payload_length);
-  else if (this->payload_length < 65536)
+  if (keepAlive)
   {
-    HAVE_ENOUGH_BYTES(2);
-    *cursor++ |= 126;
-    *reinterpret_cast<uint16_t *>(cursor) = detail::utils::swap16bits(static_cast<uint16_t>(this->payload_length));
-    cursor += 2;
+    result += "\r\nConnection: keep-alive\r\nKeep-Alive: timeout=" + std::to_string(keep_alive_timeout);
+    result += ", max=" + std::to_string(keep_alive_max_requests - served) + "\r\n";
   }
   else
+    result += "\r\nConnection: close\r\n";
+
+  return result;
+}
+
+//---------------------------------------------------------------------------------------------------------------------
+bool http_server::serve_file(tcp_client &client, const detail::http_request &req, const std::string &fileName, bool keepAlive, size_t served)
+{
+  std::string name = fileName;
+  detail::file_info info;
+  bool found = info.read(name);
+
+  if (found && info.is_directory)
   {
-    HAVE_ENOUGH_BYTES(8);
-    *cursor++ |= 127;
-    *reinterpret_cast<uint64_t *>(cursor) = detail::utils::swap64bits(static_cast<uint64_t>(this->payload_length));
-    cursor += 8;
+    name += "/index.html";
+    found = info.read(name);
   }
 
-  if (this->masked)
+  if (!found || info.is_directory)
+    return client.force_write(begin_response(req, "404 Not Found", keepAlive, served) + "Content-Length: 0\r\n\r\n");
+
+  std::string etag = info.etag();
+  auto ifNoneMatch = req.headers.find("If-None-Match");
+
+  if (ifNoneMatch != req.headers.end() && (ifNoneMatch->value == "*" || ifNoneMatch->value.find(etag) != std::string_view::npos))
+    return client.force_write(begin_response(req, "304 Not Modified", keepAlive, served) + "ETag: " + etag + "\r\n\r\n");
+
+  // Single byte range only, anything fancier gets the whole file
+  uint64_t first = 0, last = info.size ? info.size - 1 : 0;
+  int range = 0;
+  auto rangeHeader = req.headers.find("Range");
+  auto ifRange = req.headers.find("If-Range");
+
+  if (rangeHeader != req.headers.end() && (ifRange == req.headers.end() || ifRange->value == etag))
+    range = detail::http_parser::parse_range(rangeHeader->value, info.size, first, last);
+
+  if (range < 0)
   {
-    HAVE_ENOUGH_BYTES(4);
-    *reinterpret_cast<uint32_t *>(cursor) = this->masking_key;
-    cursor += 4;
+    std::string header = begin_response(req, "416 Range Not Satisfiable", keepAlive, served);
+    header += "Content-Range: bytes */" + std::to_string(info.size) + "\r\nContent-Length: 0\r\n\r\n";
+    return client.force_write(header);
   }
 
-  return cursor - ptr;
-}
-#undef HAVE_ENOUGH_BYTES
+  uint64_t length = info.size ? last - first + 1 : 0;
 
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+  std::string header = begin_response(req, range ? "206 Partial Content" : "200 OK", keepAlive, served);
+  header += "Content-Type: ";
+  header += detail::file_info::content_type(name);
+  header += "\r\nContent-Length: " + std::to_string(length);
+  header += "\r\nETag: " + etag + "\r\nAccept-Ranges: bytes\r\n";
 
-namespace detail {
+  if (range)
+    header += "Content-Range: bytes " + std::to_string(first) + "-" + std::to_string(last) + "/" + std::to_string(info.size) + "\r\n";
 
-}
+  header += "\r\n";
 
-//---------------------------------------------------------------------------------------------------------------------
-bool http_server::handshake(connection &conn)
-{
-  std::string requestLine;
+  detail::socket_type s = client._p->conn.impl()->socket;
 
-  if (!conn.read_line(requestLine))
-    return false;
+  if (req.method == "HEAD" || !length)
+    return detail::send_all(s, header.c_str(), header.length());
 
-  std::string headerLine;
-  while (conn.read_line(headerLine))
+  // Hot small files come straight from the memory mapped cache
+  if (info.size <= file_cache_max_file_size)
   {
-    if (headerLine.empty())
-      break;
+    if (auto contents = _hp->files.get(name, info, file_cache_size))
+    {
+      if (contents->size < first + length)
+        return false;
+
+      return detail::send_all(s, header.c_str(), header.length(), true)
+        && detail::send_all(s, contents->data + first, static_cast<size_t>(length));
+    }
   }
 
-  std::string method = detail::utils::cut_front(requestLine);
-  std::string path = detail::utils::url_decode(detail::utils::cut_front(requestLine));
-  
-  if (!path.empty() && path.front() == '/') path = path.substr(1);
-  if (!path.empty() && path.back() == '/') path = path.substr(0, path.length() - 1);
+  if (!detail::send_all(s, header.c_str(), header.length(), true))
+    return false;
 
-  std::string params_get = detail::utils::cut_back(path, '?', false, false);
-  std::string version = detail::utils::cut_front(requestLine);
-  
-  parameters_t params;
-  std::string param_str;
-  while (!(param_str = detail::utils::cut_front(params_get, '&')).empty())
-  {
-    parameter param;
-    param.name = detail::utils::cut_front(param_str, '=');
-    param.value = param_str;
-    param.integer = atoi(param_str.c_str());
-    param.real = atof(param_str.c_str());
-    param.boolean = (param.integer != 0) || (param_str == "true");
+#ifdef HEADSOCKET_SENDFILE
+  int fd = open(name.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
 
-    params[param.name] = param;
-  }
+  off_t offset = static_cast<off_t>(first);
 
-  response resp;
-  if (path != "favicon.ico" && request(path, params, resp))
+  while (length)
   {
-    std::stringstream ss;
-    ss << version << " 200 OK\r\n";
-    ss << "Content-Type: " << resp.content_type << "\r\n";
-    ss << "Content-Length: " << resp.message.length() << "\r\n\r\n";
-    ss << resp.message;
+    ssize_t result = sendfile(s, fd, &offset, static_cast<size_t>(length));
+
+    if (result <= 0)
+      break;
 
-    conn.write(ss.str());
+    detail::metrics_registry::add(detail::metrics_registry::bytes_out, result);
+    length -= static_cast<uint64_t>(result);
   }
-  else
+
+  close(fd);
+#else
+  FILE *f = fopen(name.c_str(), "rb");
+  if (!f)
+    return false;
+
+  std::vector<char> chunk(64 * 1024);
+
+#ifdef HEADSOCKET_PLATFORM_WINDOWS
+  _fseeki64(f, static_cast<__int64>(first), SEEK_SET);
+#else
+  fseeko(f, static_cast<off_t>(first), SEEK_SET);
+#endif
+
+  while (length)
   {
-    conn.write(version);
-    conn.write(" 404 Not Found\r\n");
+    size_t toRead = length < chunk.size() ? static_cast<size_t>(length) : chunk.size();
+    size_t result = fread(chunk.data(), 1, toRead, f);
+
+    if (!result || !detail::send_all(s, chunk.data(), result))
+      break;
+
+    length -= result;
   }
 
-  return false;
+  fclose(f);
+#endif
+
+  return !length;
 }
 
 }
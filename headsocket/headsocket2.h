@@ -80,6 +80,25 @@ protected:
 #ifndef __HEADSOCKET_H_IMPL__
 #define __HEADSOCKET_H_IMPL__
 
+#include <cstring>
+
+// SHA-1 instructions: x86 ones are detected at runtime, ARMv8 ones have to be enabled for the whole build
+#if !defined(HEADSOCKET_NO_SIMD) && (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86))
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define HEADSOCKET_TARGET_SHA_NI
+#define HEADSOCKET_SHA_NI
+#elif defined(__GNUC__) && (defined(__clang__) || __GNUC__ >= 5)
+#include <immintrin.h>
+#include <cpuid.h>
+#define HEADSOCKET_TARGET_SHA_NI __attribute__((target("sha,ssse3,sse4.1")))
+#define HEADSOCKET_SHA_NI
+#endif
+#elif !defined(HEADSOCKET_NO_SIMD) && (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_SHA2))
+#include <arm_neon.h>
+#define HEADSOCKET_SHA_ARM
+#endif
+
 class sha1
 {
 public:
@@ -88,55 +107,61 @@ public:
 
 	inline static uint32_t rotate_left( uint32_t value, size_t count ) { return ( value << count ) ^ ( value >> ( 32 - count ) ); }
 
-	void process_byte( uint8_t octet )
-	{
-		_block[_block_byte_index++] = octet;
-		++_byte_count;
-
-		if ( _block_byte_index == 64 )
-		{
-			_block_byte_index = 0;
-			process_block();
-		}
-	}
+	void process_byte( uint8_t octet ) { process_bytes( &octet, 1 ); }
 
 	void process_block( const void *start, const void *end )
 	{
-		const uint8_t *begin = static_cast<const uint8_t *>( start );
-
-		while ( begin != end )
-			process_byte( *begin++ );
+		process_bytes( start, static_cast<const uint8_t *>( end ) - static_cast<const uint8_t *>( start ) );
 	}
 
+	// Whole blocks are hashed straight from 'data', only the tail is buffered
 	void process_bytes( const void *data, size_t len )
 	{
-		process_block( data, static_cast<const uint8_t *>( data ) + len );
+		const uint8_t *input = static_cast<const uint8_t *>( data );
+		_byte_count += len;
+
+		if ( _block_byte_index )
+		{
+			size_t toCopy = 64 - _block_byte_index < len ? 64 - _block_byte_index : len;
+			memcpy( _block + _block_byte_index, input, toCopy );
+			_block_byte_index += toCopy;
+			input += toCopy;
+			len -= toCopy;
+
+			if ( _block_byte_index < 64 )
+				return;
+
+			compress( _digest, _block, 1 );
+			_block_byte_index = 0;
+		}
+
+		if ( len >= 64 )
+		{
+			compress( _digest, input, len / 64 );
+			input += len & ~static_cast<size_t>( 63 );
+			len &= 63;
+		}
+
+		memcpy( _block, input, len );
+		_block_byte_index = len;
 	}
 
 	const uint32_t *get_digest( digest32_t digest )
 	{
-		size_t bitCount = _byte_count * 8;
-		process_byte( 0x80 );
+		uint64_t bitCount = static_cast<uint64_t>( _byte_count ) * 8;
 
-		if ( _block_byte_index > 56 )
-		{
-			while ( _block_byte_index != 0 )
-				process_byte( 0 );
+		// Padding and length go into one or two final blocks
+		uint8_t tail[128] = { };
+		memcpy( tail, _block, _block_byte_index );
+		tail[_block_byte_index] = 0x80;
 
-			while ( _block_byte_index < 56 )
-				process_byte( 0 );
-		}
-		else
-			while ( _block_byte_index < 56 )
-				process_byte( 0 );
+		size_t tailLength = _block_byte_index < 56 ? 64 : 128;
 
-		process_byte( 0 );
-		process_byte( 0 );
-		process_byte( 0 );
-		process_byte( 0 );
+		for ( size_t i = 0; i < 8; ++i )
+			tail[tailLength - 1 - i] = static_cast<uint8_t>( bitCount >> ( i * 8 ) );
 
-		for ( int i = 24; i >= 0; i -= 8 )
-			process_byte( static_cast<unsigned char>( ( bitCount >> i ) & 0xFF ) );
+		compress( _digest, tail, tailLength / 64 );
+		_block_byte_index = 0;
 
 		memcpy( digest, _digest, 5 * sizeof( uint32_t ) );
 		return digest;
@@ -146,50 +171,184 @@ public:
 	{
 		digest32_t d32;
 		get_digest( d32 );
-		size_t s[] = { 24, 16, 8, 0 };
 
-		for ( size_t i = 0, j = 0; i < 20; ++i, j = i % 4 )
-			digest[i] = ( ( d32[i >> 2] >> s[j] ) & 0xFF );
+		for ( size_t i = 0; i < 20; ++i )
+			digest[i] = static_cast<uint8_t>( d32[i >> 2] >> ( 24 - ( i & 3 ) * 8 ) );
 
 		return digest;
 	}
 
-private:
-	void process_block()
+	// Hashes 'blocks' 64 byte blocks with the fastest implementation this CPU supports
+	static void compress( uint32_t state[5], const uint8_t *data, size_t blocks )
 	{
-		uint32_t w[80], s[] = { 24, 16, 8, 0 };
+#if defined(HEADSOCKET_SHA_NI)
+		static const bool hasShaNi = cpu_has_sha_ni();
 
-		for ( size_t i = 0, j = 0; i < 64; ++i, j = i % 4 )
-			w[i / 4] = j ? ( w[i / 4] | ( _block[i] << s[j] ) ) : ( _block[i] << s[j] );
+		if ( hasShaNi )
+		{
+			compress_sha_ni( state, data, blocks );
+			return;
+		}
+#elif defined(HEADSOCKET_SHA_ARM)
+		compress_arm( state, data, blocks );
+		return;
+#endif
 
-		for ( size_t i = 16; i < 80; i++ )
-			w[i] = rotate_left( ( w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16] ), 1 );
+		compress_generic( state, data, blocks );
+	}
 
-		digest32_t dig = { _digest[0], _digest[1], _digest[2], _digest[3], _digest[4] };
+	static void compress_generic( uint32_t state[5], const uint8_t *data, size_t blocks )
+	{
+		for ( ; blocks--; data += 64 )
+		{
+			uint32_t w[16];
+
+			for ( size_t i = 0; i < 16; ++i )
+				w[i] = ( uint32_t( data[i * 4] ) << 24 ) | ( uint32_t( data[i * 4 + 1] ) << 16 ) | ( uint32_t( data[i * 4 + 2] ) << 8 ) | data[i * 4 + 3];
+
+			uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+
+			// Message schedule lives in a 16 word ring, variables rotate their roles instead of being shifted
+#define HEADSOCKET_SHA1_W( i ) ( ( i ) < 16 ? w[( i ) & 15] : ( w[( i ) & 15] = rotate_left( w[( ( i ) + 13 ) & 15] ^ w[( ( i ) + 8 ) & 15] ^ w[( ( i ) + 2 ) & 15] ^ w[( i ) & 15], 1 ) ) )
+#define HEADSOCKET_SHA1_ROUND( a, b, c, d, e, f, k, i ) e += rotate_left( a, 5 ) + ( f ) + ( k ) + HEADSOCKET_SHA1_W( i ); b = rotate_left( b, 30 );
+#define HEADSOCKET_SHA1_R0( a, b, c, d, e, i ) HEADSOCKET_SHA1_ROUND( a, b, c, d, e, d ^ ( b & ( c ^ d ) ), 0x5A827999, i )
+#define HEADSOCKET_SHA1_R1( a, b, c, d, e, i ) HEADSOCKET_SHA1_ROUND( a, b, c, d, e, b ^ c ^ d, 0x6ED9EBA1, i )
+#define HEADSOCKET_SHA1_R2( a, b, c, d, e, i ) HEADSOCKET_SHA1_ROUND( a, b, c, d, e, ( b & c ) | ( d & ( b | c ) ), 0x8F1BBCDC, i )
+#define HEADSOCKET_SHA1_R3( a, b, c, d, e, i ) HEADSOCKET_SHA1_ROUND( a, b, c, d, e, b ^ c ^ d, 0xCA62C1D6, i )
+#define HEADSOCKET_SHA1_R5( R, i ) R( a, b, c, d, e, i ) R( e, a, b, c, d, i + 1 ) R( d, e, a, b, c, i + 2 ) R( c, d, e, a, b, i + 3 ) R( b, c, d, e, a, i + 4 )
+
+			HEADSOCKET_SHA1_R5( HEADSOCKET_SHA1_R0, 0 ) HEADSOCKET_SHA1_R5( HEADSOCKET_SHA1_R0, 5 )
+			HEADSOCKET_SHA1_R5( HEADSOCKET_SHA1_R0, 10 ) HEADSOCKET_SHA1_R5( HEADSOCKET_SHA1_R0, 15 )
+			HEADSOCKET_SHA1_R5( HEADSOCKET_SHA1_R1, 20 ) HEADSOCKET_SHA1_R5( HEADSOCKET_SHA1_R1, 25 )
+			HEADSOCKET_SHA1_R5( HEADSOCKET_SHA1_R1, 30 ) HEADSOCKET_SHA1_R5( HEADSOCKET_SHA1_R1, 35 )
+			HEADSOCKET_SHA1_R5( HEADSOCKET_SHA1_R2, 40 ) HEADSOCKET_SHA1_R5( HEADSOCKET_SHA1_R2, 45 )
+			HEADSOCKET_SHA1_R5( HEADSOCKET_SHA1_R2, 50 ) HEADSOCKET_SHA1_R5( HEADSOCKET_SHA1_R2, 55 )
+			HEADSOCKET_SHA1_R5( HEADSOCKET_SHA1_R3, 60 ) HEADSOCKET_SHA1_R5( HEADSOCKET_SHA1_R3, 65 )
+			HEADSOCKET_SHA1_R5( HEADSOCKET_SHA1_R3, 70 ) HEADSOCKET_SHA1_R5( HEADSOCKET_SHA1_R3, 75 )
+
+#undef HEADSOCKET_SHA1_R5
+#undef HEADSOCKET_SHA1_R3
+#undef HEADSOCKET_SHA1_R2
+#undef HEADSOCKET_SHA1_R1
+#undef HEADSOCKET_SHA1_R0
+#undef HEADSOCKET_SHA1_ROUND
+#undef HEADSOCKET_SHA1_W
+
+			state[0] += a;
+			state[1] += b;
+			state[2] += c;
+			state[3] += d;
+			state[4] += e;
+		}
+	}
+
+#if defined(HEADSOCKET_SHA_NI)
+	static bool cpu_has_sha_ni()
+	{
+		// SHA extensions (leaf 7, EBX bit 29), SSSE3 and SSE4.1 (leaf 1, ECX bits 9 and 19)
+#if defined(_MSC_VER)
+		int info[4];
+		__cpuid( info, 0 );
+		if ( info[0] < 7 ) return false;
+		__cpuid( info, 1 );
+		bool sse = ( info[2] & ( 1 << 9 ) ) && ( info[2] & ( 1 << 19 ) );
+		__cpuidex( info, 7, 0 );
+		return sse && ( info[1] & ( 1 << 29 ) );
+#else
+		unsigned eax, ebx, ecx, edx;
+		if ( __get_cpuid_max( 0, nullptr ) < 7 || !__get_cpuid( 1, &eax, &ebx, &ecx, &edx ) ) return false;
+		bool sse = ( ecx & ( 1 << 9 ) ) && ( ecx & ( 1 << 19 ) );
+		__cpuid_count( 7, 0, eax, ebx, ecx, edx );
+		return sse && ( ebx & ( 1 << 29 ) );
+#endif
+	}
+
+	// Four rounds per instruction, message schedule words are expanded four at a time as well
+	HEADSOCKET_TARGET_SHA_NI static void compress_sha_ni( uint32_t state[5], const uint8_t *data, size_t blocks )
+	{
+		const __m128i byteSwap = _mm_set_epi64x( 0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL );
+		__m128i abcd = _mm_shuffle_epi32( _mm_loadu_si128( reinterpret_cast<const __m128i *>( state ) ), 0x1B );
+		__m128i e0 = _mm_set_epi32( static_cast<int>( state[4] ), 0, 0, 0 );
 
-		for ( size_t f, k, i = 0; i < 80; ++i )
+		for ( ; blocks--; data += 64 )
 		{
-			if ( i < 20 )
-				f = ( dig[1] & dig[2] ) | ( ~dig[1] & dig[3] ), k = 0x5A827999;
-			else if ( i < 40 )
-				f = dig[1] ^ dig[2] ^ dig[3], k = 0x6ED9EBA1;
-			else if ( i < 60 )
-				f = ( dig[1] & dig[2] ) | ( dig[1] & dig[3] ) | ( dig[2] & dig[3] ), k = 0x8F1BBCDC;
-			else
-				f = dig[1] ^ dig[2] ^ dig[3], k = 0xCA62C1D6;
-
-			uint32_t temp = static_cast<uint32_t>( rotate_left( dig[0], 5 ) + f + dig[4] + k + w[i] );
-			dig[4] = dig[3];
-			dig[3] = dig[2];
-			dig[2] = rotate_left( dig[1], 30 );
-			dig[1] = dig[0];
-			dig[0] = temp;
+			__m128i abcdSaved = abcd, e0Saved = e0, previous = abcd, msg[4];
+
+			for ( int g = 0; g < 20; ++g )
+			{
+				__m128i &w = msg[g & 3];
+
+				if ( g < 4 )
+					w = _mm_shuffle_epi8( _mm_loadu_si128( reinterpret_cast<const __m128i *>( data + g * 16 ) ), byteSwap );
+
+				__m128i e = g ? _mm_sha1nexte_epu32( previous, w ) : _mm_add_epi32( e0, w );
+				previous = abcd;
+
+				switch ( g / 5 )
+				{
+					case 0: abcd = _mm_sha1rnds4_epu32( abcd, e, 0 ); break;
+					case 1: abcd = _mm_sha1rnds4_epu32( abcd, e, 1 ); break;
+					case 2: abcd = _mm_sha1rnds4_epu32( abcd, e, 2 ); break;
+					default: abcd = _mm_sha1rnds4_epu32( abcd, e, 3 ); break;
+				}
+
+				if ( g >= 3 && g <= 18 ) msg[( g + 1 ) & 3] = _mm_sha1msg2_epu32( msg[( g + 1 ) & 3], w );
+				if ( g >= 1 && g <= 16 ) msg[( g - 1 ) & 3] = _mm_sha1msg1_epu32( msg[( g - 1 ) & 3], w );
+				if ( g >= 2 && g <= 17 ) msg[( g - 2 ) & 3] = _mm_xor_si128( msg[( g - 2 ) & 3], w );
+			}
+
+			e0 = _mm_sha1nexte_epu32( previous, e0Saved );
+			abcd = _mm_add_epi32( abcd, abcdSaved );
 		}
 
-		for ( size_t i = 0; i < 5; ++i )
-			_digest[i] += dig[i];
+		_mm_storeu_si128( reinterpret_cast<__m128i *>( state ), _mm_shuffle_epi32( abcd, 0x1B ) );
+		state[4] = static_cast<uint32_t>( _mm_extract_epi32( e0, 3 ) );
 	}
+#endif
 
+#if defined(HEADSOCKET_SHA_ARM)
+	static void compress_arm( uint32_t state[5], const uint8_t *data, size_t blocks )
+	{
+		static const uint32_t k[] = { 0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6 };
+		uint32x4_t abcd = vld1q_u32( state );
+		uint32_t e0 = state[4];
+
+		for ( ; blocks--; data += 64 )
+		{
+			uint32x4_t abcdSaved = abcd, msg[4];
+			uint32_t e = e0;
+
+			for ( int i = 0; i < 4; ++i )
+				msg[i] = vreinterpretq_u32_u8( vrev32q_u8( vld1q_u8( data + i * 16 ) ) );
+
+			for ( int g = 0; g < 20; ++g )
+			{
+				uint32x4_t wk = vaddq_u32( msg[g & 3], vdupq_n_u32( k[g / 5] ) );
+				uint32_t nextE = vsha1h_u32( vgetq_lane_u32( abcd, 0 ) );
+
+				switch ( g / 5 )
+				{
+					case 0: abcd = vsha1cq_u32( abcd, e, wk ); break;
+					case 2: abcd = vsha1mq_u32( abcd, e, wk ); break;
+					default: abcd = vsha1pq_u32( abcd, e, wk ); break;
+				}
+
+				e = nextE;
+
+				if ( g < 16 )
+					msg[g & 3] = vsha1su1q_u32( vsha1su0q_u32( msg[g & 3], msg[( g + 1 ) & 3], msg[( g + 2 ) & 3] ), msg[( g + 3 ) & 3] );
+			}
+
+			abcd = vaddq_u32( abcd, abcdSaved );
+			e0 += e;
+		}
+
+		vst1q_u32( state, abcd );
+		state[4] = e0;
+	}
+#endif
+
+private:
 	digest32_t _digest = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
 	uint8_t _block[64];
 	size_t _block_byte_index = 0;
@@ -27,6 +27,7 @@ filter { "system:windows" }
   end
   
 filter { }
+  cppdialect "C++17"
   includedirs { "." }
   targetdir "bin/%{cfg.buildcfg}"
   flags { "StaticRuntime" }
@@ -34,6 +35,9 @@ filter { }
 group "tests"
   include "tests"
 
+group "benchmarks"
+  include "benchmarks"
+
 -- Dummy HeadSocket project
 group ""
   project "HeadSocket"
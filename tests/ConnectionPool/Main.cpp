@@ -0,0 +1,73 @@
+#include <iostream>
+#include <string>
+#include <thread>
+
+#define HEADSOCKET_IMPLEMENTATION
+#include <headsocket/headsocket.h>
+
+using namespace headsocket;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static int failures = 0;
+
+static void check(bool passed, const std::string &name)
+{
+  std::cout << (passed ? "PASS " : "FAIL ") << name << std::endl;
+
+  if (!passed)
+    ++failures;
+}
+
+// Checks one connection in, waits and checks it out again, returns pool statistics after that
+static basic_connection_pool::stats reuse(int port, const basic_connection_pool::options &opts, int waitMs)
+{
+  connection_pool<tcp_client> pool(opts);
+  pool.checkin(pool.checkout("127.0.0.1", port));
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(waitMs));
+  pool.prune();
+
+  auto client = pool.checkout("127.0.0.1", port);
+  return pool.statistics();
+}
+
+int main(int argc, char *argv[])
+{
+  // Accepted connections stay open and silent, just like an idle peer
+  auto host = tcp_server<tcp_client>::create(8082);
+
+  if (!host->is_running())
+  {
+    std::cout << "Could not start TCP server!" << std::endl;
+    return 1;
+  }
+
+  basic_connection_pool::options opts;
+  auto stats = reuse(host->port(), opts, 50);
+  check(stats.hits == 1 && stats.misses == 1 && !stats.dropped, "Default limits reuse idle connection");
+
+  opts.max_idle_ms = 0;
+  opts.max_age_ms = 0;
+  stats = reuse(host->port(), opts, 50);
+  check(stats.hits == 1 && stats.misses == 1 && !stats.dropped, "Zero limits never expire");
+
+  opts.max_idle_ms = -1;
+  opts.max_age_ms = -1;
+  stats = reuse(host->port(), opts, 50);
+  check(stats.hits == 1 && stats.misses == 1 && !stats.dropped, "Negative limits never expire");
+
+  opts = basic_connection_pool::options();
+  opts.max_idle_ms = 20;
+  stats = reuse(host->port(), opts, 100);
+  check(!stats.hits && stats.misses == 2 && stats.dropped == 1, "Idle limit still expires");
+
+  opts = basic_connection_pool::options();
+  opts.max_idle_ms = 0;
+  opts.max_age_ms = 20;
+  stats = reuse(host->port(), opts, 100);
+  check(!stats.hits && stats.misses == 2 && stats.dropped == 1, "Age limit still expires");
+
+  std::cout << (failures ? std::to_string(failures) + " check(s) failed" : std::string("All checks passed")) << std::endl;
+  return failures ? 1 : 0;
+}
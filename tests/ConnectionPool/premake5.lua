@@ -0,0 +1,7 @@
+project("ConnectionPool")
+
+generateProject(
+{
+  type = "console",
+	language = "C++",
+})
@@ -11,21 +11,25 @@ class http : public headsocket::http_server
   HEADSOCKET_SERVER(http, headsocket::http_server) { }
 
 public:
-  bool request(const std::string &path, const parameters_t &params, response &resp) override
+  bool request(const std::string_view &path, const parameters_t &params, response &resp) override
   {
     resp.message += "Requested path: ";
-    resp.message += path + "<br>\n";
+    resp.message += path;
+    resp.message += "<br>\n";
     
     if (!params.empty())
     {
       resp.message += "Parameters:<br>\n";
 
-      for (auto &kvp : params)
+      for (auto &param : params)
       {
-        resp.message += kvp.first;
+        resp.message += param.name;
 
-        if (!kvp.second.value.empty())
-          resp.message += " = " + kvp.second.value;
+        if (!param.value.empty())
+        {
+          resp.message += " = ";
+          resp.message += param.value;
+        }
 
         resp.message += "<br>\n";
       }
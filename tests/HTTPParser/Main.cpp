@@ -0,0 +1,134 @@
+#include <iostream>
+#include <string>
+#include <vector>
+
+#define HEADSOCKET_IMPLEMENTATION
+#include <headsocket/headsocket.h>
+
+using namespace headsocket;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+class http : public http_server
+{
+  HEADSOCKET_SERVER(http, http_server) { }
+
+public:
+  bool request(const std::string_view &path, const parameters_t &params, response &resp) override
+  {
+    resp.message = path;
+    return true;
+  }
+};
+
+static int failures = 0;
+
+static void check(bool passed, const std::string &name)
+{
+  std::cout << (passed ? "PASS " : "FAIL ") << name << std::endl;
+
+  if (!passed)
+    ++failures;
+}
+
+// Parses request head (parser decodes in place, so it gets a copy)
+static bool parse(std::string head, detail::http_request &req)
+{
+  return detail::http_parser::parse(&head[0], head.length(), req);
+}
+
+// Sends raw request over loopback, returns status line of the answer followed by everything the server sent after
+static std::string exchange(int port, const std::string &text)
+{
+  auto client = tcp_client::create("127.0.0.1", port);
+  std::string result;
+
+  if (!client || !client->force_write(text))
+    return result;
+
+  char buffer[4096];
+
+  for (size_t length; (length = client->read(buffer, sizeof(buffer))) && length != basic_tcp_client::invalid_operation;)
+    result.append(buffer, length);
+
+  return result;
+}
+
+static std::string status_line(const std::string &response)
+{
+  return response.substr(0, response.find("\r\n"));
+}
+
+int main(int argc, char *argv[])
+{
+  {
+    detail::http_request req;
+    check(parse("POST /a HTTP/1.1\r\nContent-Length: 42\r\n\r\n", req) && req.content_length == 42 && req.length_delimited,
+      "Content-Length");
+  }
+
+  {
+    detail::http_request req;
+    check(parse("POST /a HTTP/1.1\r\nContent-Length: 7\r\ncontent-length: 7\r\n\r\n", req) && req.content_length == 7,
+      "Repeated equal Content-Length");
+  }
+
+  {
+    detail::http_request req;
+    check(!parse("POST /a HTTP/1.1\r\nContent-Length: 5\r\nContent-Length: 6\r\n\r\n", req),
+      "Conflicting Content-Length is rejected");
+  }
+
+  {
+    detail::http_request req;
+    check(!parse("POST /a HTTP/1.1\r\nContent-Length: 18446744073709551621\r\n\r\n", req),
+      "Overflowing Content-Length is rejected");
+  }
+
+  for (const char *value : { "", "-1", "+5", "5a", "0x10", "5, 5" })
+  {
+    detail::http_request req;
+    check(!parse(std::string("POST /a HTTP/1.1\r\nContent-Length: ") + value + "\r\n\r\n", req),
+      std::string("Malformed Content-Length '") + value + "' is rejected");
+  }
+
+  {
+    detail::http_request req;
+    check(parse("POST /a HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n", req) && !req.length_delimited,
+      "Transfer-Encoding is not length-delimited");
+  }
+
+  {
+    detail::http_request req;
+    check(parse("POST /a HTTP/1.1\r\nContent-Length: 4\r\nTransfer-Encoding: chunked\r\n\r\n", req) && !req.length_delimited,
+      "Transfer-Encoding wins over Content-Length");
+  }
+
+  // Same cases answered by a running server, none of them may leave the connection open for another request
+  auto host = http::create(8081);
+
+  if (!host->is_running())
+  {
+    std::cout << "Could not start HTTP server!" << std::endl;
+    return 1;
+  }
+
+  std::string pipelined = "GET /next HTTP/1.1\r\n\r\n";
+  std::string answer;
+
+  answer = exchange(host->port(), "POST /a HTTP/1.1\r\nContent-Length: 3\r\n\r\nabc" + pipelined + "GET /last HTTP/1.1\r\nConnection: close\r\n\r\n");
+  check(status_line(answer) == "HTTP/1.1 200 OK" && answer.find("next") != std::string::npos, "Body is skipped before pipelined request");
+
+  answer = exchange(host->port(), "POST /a HTTP/1.1\r\nContent-Length: 99999999999999999999999\r\n\r\n" + pipelined);
+  check(status_line(answer) == "HTTP/1.1 400 Bad Request" && answer.find("next") == std::string::npos, "Overflow answered with 400");
+
+  answer = exchange(host->port(), "POST /a HTTP/1.1\r\nContent-Length: 0\r\nContent-Length: 23\r\n\r\n" + pipelined);
+  check(status_line(answer) == "HTTP/1.1 400 Bad Request" && answer.find("next") == std::string::npos, "Conflict answered with 400");
+
+  answer = exchange(host->port(), "POST /a HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n17\r\n" + pipelined + "\r\n0\r\n\r\n");
+  check(status_line(answer) == "HTTP/1.1 501 Not Implemented" && answer.find("Connection: close") != std::string::npos
+    && answer.find("next") == std::string::npos, "Transfer-Encoding answered with 501");
+
+  std::cout << (failures ? std::to_string(failures) + " check(s) failed" : std::string("All checks passed")) << std::endl;
+  return failures ? 1 : 0;
+}
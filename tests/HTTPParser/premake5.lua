@@ -0,0 +1,7 @@
+project("HTTPParser")
+
+generateProject(
+{
+  type = "console",
+	language = "C++",
+})
@@ -1,5 +1,6 @@
 #include <iostream>
 #include <sstream>
+#include <cmath>
 
 #define HEADSOCKET_IMPLEMENTATION
 #include <headsocket/headsocket.h>
@@ -11,20 +12,6 @@ static const char *xm_player_html =
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-class http : public headsocket::http_server
-{
-  HEADSOCKET_SERVER(http, headsocket::http_server) { }
-
-public:
-  bool request(const std::string &path, const parameters_t &params, response &resp) override
-  {
-    resp.message = xm_player_html;
-    return true;
-  }
-};
-
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
 class client : public headsocket::web_socket_client
 {
   HEADSOCKET_CLIENT(client, headsocket::web_socket_client);
@@ -108,17 +95,26 @@ private:
   std::vector<float> _sampleBuffer;
 };
 
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+class server : public headsocket::web_server<client>
+{
+  HEADSOCKET_SERVER(server, headsocket::web_server<client>)
+  {
+    route("GET", "", [](const std::string_view &path, const parameters_t &params, response &resp)
+    {
+      resp.message = xm_player_html;
+      resp.cache_ttl = 3600;
+      return true;
+    });
+  }
+};
+
 int main(int argc, char *argv[])
 {
-  auto host = http::create(8080);
+  auto host = server::create(8080);
   if (host->is_running())
-    std::cout << "HTTP server is running, open http://localhost:" << host->port() << " and dance!" << std::endl;
-  else
-    std::cout << "Could not start HTTP server!" << std::endl;
-
-  auto server = headsocket::web_socket_server<client>::create(42667);
-  if (server->is_running())
-    std::cout << "XM module server is running at port " << server->port() << std::endl;
+    std::cout << "XM module server is running, open http://localhost:" << host->port() << " and dance!" << std::endl;
   else
     std::cout << "Could not start server!" << std::endl;
 
@@ -20,7 +20,7 @@ R"H34D50CK3T(<!DOCTYPE html>
   console.log(window.location.href);
 
   var content = document.getElementById("content");
-  var port = 42667;
+  var port = 8080;
   var bufferSize = 4096;
   var sampleBuffer = [];
   var ws;
@@ -29,14 +29,10 @@ R"H34D50CK3T(<!DOCTYPE html>
   var audioSource;
   var totalSamplesStreamed = 0;
 
-  var uri = "ws://localhost";
+  // WebSocket is upgraded from the same host & port the page came from
+  var uri = "ws://localhost:" + port.toString();
   if (window.location.href.startsWith("http"))
-  {
-    var arr = window.location.href.split("/");
-    uri = "ws://" + arr[2].split(":")[0];
-  }
-  
-  uri += ":" + port.toString();
+    uri = "ws://" + window.location.host;
   
   function rgb2hex(r, g, b) {
     if (g !== undefined) 
@@ -1,3 +1,5 @@
+include "ConnectionPool"
 include "DirList"
 include "HTTP"
+include "HTTPParser"
 include "XmPlayer"